@@ -0,0 +1,534 @@
+/*
+ * Throughput and latency of each stage of xcbft, against a running X
+ * server (Xvfb, see the Makefile). Every measurement is printed as one
+ * JSON object per line on stdout, to compare runs with each other.
+ *
+ * usage: bench [iterations] [fontsearch list]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fontconfig/fontconfig.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <xcb/xcb.h>
+#include <xcb/render.h>
+#include <xcb/xcb_renderutil.h>
+
+#include "../utf8_utils/utf8.h"
+#include "../xcbft/xcbft.h"
+
+#define DEFAULT_ITERATIONS 50
+#define DEFAULT_SEARCH "sans:pixelsize=14,monospace:pixelsize=14,emoji:pixelsize=14"
+#define LONG_LINE_BYTES 8192
+#define IMAGE_WIDTH 2048
+#define IMAGE_HEIGHT 64
+/* rounding of the server's compositing against the client's blending */
+#define PIXEL_TOLERANCE 2
+
+struct corpus {
+	const char *name;
+	char *text;
+};
+
+/* latencies of one stage, in microseconds */
+struct samples {
+	double *values;
+	unsigned int length;
+};
+
+static const char *ascii_text =
+	"The quick brown fox jumps over the lazy dog. 0123456789 "
+	"{}[]()<>;:,.!?@#$%^&*-_=+/\\|~`'\"";
+
+static const char *mixed_text =
+	"Héllo wörld, Привет мир, Γειά σου κόσμε, שלום עולם, "
+	"مرحبا بالعالم, नमस्ते दुनिया, 你好世界, こんにちは世界, 안녕하세요";
+
+static const char *emoji_text =
+	"😀😃😄😁😆😅🤣😂🙂🙃😉😊😇🥰😍🤩😘😗☺😚😙🥲😋😛😜🤪😝🤑🤗🤭"
+	"👍👎👏🙌👐🤲🤝🙏✌🤞🤟🤘👌🤌🤏👈👉👆👇☝✋🤚🖐🖖👋🤙💪";
+
+static double
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* wait for the server to have processed everything sent */
+static void
+sync_server(xcb_connection_t *c)
+{
+	free(xcb_get_input_focus_reply(c, xcb_get_input_focus(c), NULL));
+}
+
+static long
+screen_dpi(xcb_screen_t *screen)
+{
+	if (screen->width_in_millimeters == 0) {
+		return 96;
+	}
+	return (long)(screen->width_in_pixels * 25.4 /
+		screen->width_in_millimeters + 0.5);
+}
+
+/* ascii and mixed repeated, as a long terminal or log line */
+static char *
+long_line(void)
+{
+	char *text;
+	size_t length, piece;
+	const char *pieces[2];
+	unsigned int i;
+
+	pieces[0] = ascii_text;
+	pieces[1] = mixed_text;
+	text = malloc(LONG_LINE_BYTES + 256);
+	length = 0;
+	for (i = 0; length < LONG_LINE_BYTES; i++) {
+		piece = strlen(pieces[i % 2]);
+		memcpy(text + length, pieces[i % 2], piece);
+		length += piece;
+	}
+	text[length] = '\0';
+	return text;
+}
+
+static void
+samples_init(struct samples *samples, unsigned int iterations)
+{
+	samples->values = malloc(sizeof(double) * iterations);
+	samples->length = 0;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(const struct samples *samples, double p)
+{
+	unsigned int i;
+
+	i = (unsigned int)(p * (samples->length - 1) + 0.5);
+	return samples->values[i];
+}
+
+/* print a stage as one line of JSON and forget its samples */
+static void
+report(const char *stage, const char *corpus, const char *cache,
+	struct samples *samples, unsigned long units_per_iteration)
+{
+	double total = 0;
+	unsigned int i;
+
+	if (samples->length == 0) {
+		return;
+	}
+	for (i = 0; i < samples->length; i++) {
+		total += samples->values[i];
+	}
+	qsort(samples->values, samples->length, sizeof(double), compare_double);
+	printf("{\"stage\":\"%s\",\"corpus\":\"%s\",\"cache\":\"%s\","
+		"\"iterations\":%u,\"chars\":%lu,"
+		"\"mean_us\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,"
+		"\"min_us\":%.2f,\"ops_per_s\":%.1f,\"chars_per_s\":%.0f}\n",
+		stage, corpus, cache, samples->length, units_per_iteration,
+		total / samples->length,
+		percentile(samples, 0.5), percentile(samples, 0.99),
+		samples->values[0],
+		samples->length / (total / 1e6),
+		units_per_iteration * samples->length / (total / 1e6));
+	fflush(stdout);
+	samples->length = 0;
+}
+
+/* pixels of two ARGB32 images that differ by more than the tolerance */
+static unsigned long
+compare_pixels(const uint32_t *golden, const uint32_t *pixels,
+	unsigned int *max_difference)
+{
+	unsigned long differing = 0;
+	unsigned int i, shift;
+	int difference;
+
+	for (i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++) {
+		for (shift = 0; shift < 24; shift += 8) {
+			difference = (int)(golden[i] >> shift & 0xff) -
+				(int)(pixels[i] >> shift & 0xff);
+			if (difference < 0) {
+				difference = -difference;
+			}
+			if ((unsigned int)difference > *max_difference) {
+				*max_difference = difference;
+			}
+			if (difference > PIXEL_TOLERANCE) {
+				differing++;
+				break;
+			}
+		}
+	}
+	return differing;
+}
+
+/* print how far an image is from the golden one as one line of JSON */
+static void
+report_pixels(const char *corpus, const char *against,
+	unsigned long differing, unsigned int max_difference)
+{
+	printf("{\"stage\":\"check_image\",\"corpus\":\"%s\","
+		"\"against\":\"%s\",\"pixels\":%u,\"differing\":%lu,"
+		"\"max_difference\":%u}\n",
+		corpus, against, IMAGE_WIDTH * IMAGE_HEIGHT, differing,
+		max_difference);
+	fflush(stdout);
+}
+
+/*
+ * Draw the list on the cleared pixmap with a backend and compare what
+ * the server has with the golden image, channels of the depth 24 pixmap
+ * only: both are blended over black
+ */
+static void
+check_backend(xcb_connection_t *c, xcb_pixmap_t pmap, xcb_gcontext_t gc,
+	struct xcbft_draw_list *list, long dpi, enum xcbft_backend backend,
+	const uint32_t *golden, const char *corpus, const char *against)
+{
+	xcb_rectangle_t all = { 0, 0, IMAGE_WIDTH, IMAGE_HEIGHT };
+	xcb_get_image_reply_t *reply;
+	unsigned int max_difference = 0;
+	unsigned long differing;
+
+	xcb_poly_fill_rectangle(c, pmap, gc, 1, &all);
+	xcbft_draw_list_render_backend(c, pmap, list, dpi, backend);
+	reply = xcb_get_image_reply(c, xcb_get_image(c,
+		XCB_IMAGE_FORMAT_Z_PIXMAP, pmap, 0, 0, IMAGE_WIDTH, IMAGE_HEIGHT,
+		~0), NULL);
+	/* a 24 bit visual in 32 bits per pixel, as Xvfb gives it */
+	if (reply == NULL || xcb_get_image_data_length(reply) !=
+			4 * IMAGE_WIDTH * IMAGE_HEIGHT) {
+		fprintf(stderr, "can't compare the pixmap with the image\n");
+		free(reply);
+		return;
+	}
+	differing = compare_pixels(golden,
+		(const uint32_t *)xcb_get_image_data(reply), &max_difference);
+	report_pixels(corpus, against, differing, max_difference);
+	free(reply);
+}
+
+static void
+bench_query(FcStrSet *fontsearch, unsigned int iterations)
+{
+	struct xcbft_patterns_holder patterns;
+	struct samples samples;
+	unsigned int i;
+	double start;
+
+	samples_init(&samples, iterations);
+	for (i = 0; i < iterations; i++) {
+		start = now_us();
+		patterns = xcbft_query_fontsearch_all(fontsearch);
+		samples.values[samples.length++] = now_us() - start;
+		xcbft_patterns_holder_destroy(patterns);
+		/* the first match fills the caches of fontconfig */
+		if (i == 0) {
+			report("query_fontsearch_all", "-", "cold", &samples, 0);
+		}
+	}
+	report("query_fontsearch_all", "-", "warm", &samples, 0);
+	free(samples.values);
+}
+
+static void
+bench_load_faces(struct xcbft_patterns_holder patterns, long dpi,
+	unsigned int iterations)
+{
+	struct xcbft_face_holder faces;
+	struct samples samples;
+	unsigned int i;
+	double start;
+
+	samples_init(&samples, iterations);
+	for (i = 0; i < iterations; i++) {
+		start = now_us();
+		faces = xcbft_load_faces(patterns, dpi);
+		samples.values[samples.length++] = now_us() - start;
+		xcbft_face_holder_destroy(faces);
+		if (i == 0) {
+			report("load_faces", "-", "cold", &samples, 0);
+		}
+	}
+	report("load_faces", "-", "warm", &samples, 0);
+	free(samples.values);
+}
+
+/*
+ * What xcbft does for each glyph it hasn't seen: the corpus loaded without
+ * a connection, each character rasterized once in the face the library
+ * picks for it, and nothing sent
+ */
+static double
+rasterize_text(struct xcbft_face_holder faces, struct utf_holder text,
+	long dpi)
+{
+	double start;
+
+	start = now_us();
+	xcbft_load_glyphset(NULL, faces, text, dpi);
+	return now_us() - start;
+}
+
+static void
+bench_corpus(xcb_connection_t *c, xcb_pixmap_t pmap, xcb_gcontext_t gc,
+	struct xcbft_patterns_holder patterns, long dpi,
+	const struct corpus *corpus, unsigned int iterations)
+{
+	struct xcbft_face_holder faces, view;
+	struct samples raster, load, upload, draw, draw_utf8, draw_shm, measure;
+	struct samples image;
+	struct xcbft_draw_list *list;
+	struct xcbft_image pixels;
+	struct utf_holder text;
+	xcb_render_color_t color = { 0x4242, 0x4242, 0x4242, 0xffff };
+	unsigned int i, max_difference;
+	unsigned long differing;
+	uint32_t *golden;
+	double start;
+	size_t bytes;
+
+	text = char_to_uint32(corpus->text);
+	bytes = strlen(corpus->text);
+	samples_init(&raster, iterations);
+	samples_init(&load, iterations);
+	samples_init(&upload, iterations);
+	samples_init(&draw, iterations);
+	samples_init(&draw_utf8, iterations);
+	samples_init(&draw_shm, iterations);
+	samples_init(&measure, iterations);
+	samples_init(&image, iterations);
+	list = xcbft_draw_list_create();
+	pixels.width = IMAGE_WIDTH;
+	pixels.height = IMAGE_HEIGHT;
+	pixels.pixels = calloc(pixels.width*pixels.height, sizeof(uint32_t));
+	/* the first image of the corpus, every other one must look the same */
+	golden = calloc(pixels.width*pixels.height, sizeof(uint32_t));
+	differing = 0;
+	max_difference = 0;
+
+	/* cold: new faces, nothing rasterized nor uploaded */
+	for (i = 0; i < iterations; i++) {
+		faces = xcbft_load_faces(patterns, dpi);
+		raster.values[raster.length++] = rasterize_text(faces, text,
+			dpi);
+		xcbft_face_holder_destroy(faces);
+
+		faces = xcbft_load_faces(patterns, dpi);
+		sync_server(c);
+		start = now_us();
+		xcbft_load_glyphset(c, faces, text, dpi);
+		sync_server(c);
+		load.values[load.length++] = now_us() - start;
+		xcbft_face_holder_destroy(faces);
+
+		faces = xcbft_load_faces(patterns, dpi);
+		sync_server(c);
+		start = now_us();
+		xcbft_draw_text(c, pmap, 0, 40, text, color, faces, dpi);
+		sync_server(c);
+		draw.values[draw.length++] = now_us() - start;
+		xcbft_face_holder_destroy(faces);
+
+		/* the same in memory, no server involved */
+		faces = xcbft_load_faces(patterns, dpi);
+		memset(pixels.pixels, 0, 4 * IMAGE_WIDTH * IMAGE_HEIGHT);
+		start = now_us();
+		xcbft_draw_list_add(list, 0, 40, text, color, faces);
+		xcbft_draw_list_render_image(list, &pixels, dpi);
+		image.values[image.length++] = now_us() - start;
+		xcbft_face_holder_destroy(faces);
+		if (i == 0) {
+			memcpy(golden, pixels.pixels, 4 * IMAGE_WIDTH * IMAGE_HEIGHT);
+		} else {
+			differing += compare_pixels(golden, pixels.pixels,
+				&max_difference);
+		}
+	}
+	report("rasterize", corpus->name, "cold", &raster, text.length);
+	report("load_glyphset", corpus->name, "cold", &load, text.length);
+	report("draw_text", corpus->name, "cold", &draw, text.length);
+	report("draw_image", corpus->name, "cold", &image, text.length);
+
+	/*
+	 * upload: a view of the faces takes the glyphs rasterized for them
+	 * and only sends them (characters no face has are looked up again)
+	 */
+	faces = xcbft_load_faces(patterns, dpi);
+	view = xcbft_face_holder_view(faces, dpi);
+	xcbft_load_glyphset(c, view, text, dpi);
+	xcbft_face_holder_destroy(view);
+	for (i = 0; i < iterations; i++) {
+		view = xcbft_face_holder_view(faces, dpi);
+		sync_server(c);
+		start = now_us();
+		xcbft_load_glyphset(c, view, text, dpi);
+		sync_server(c);
+		upload.values[upload.length++] = now_us() - start;
+		xcbft_face_holder_destroy(view);
+	}
+	report("upload", corpus->name, "cold", &upload, text.length);
+	xcbft_face_holder_destroy(faces);
+
+	/* warm: the same faces, every glyph already on the server */
+	faces = xcbft_load_faces(patterns, dpi);
+	xcbft_draw_text(c, pmap, 0, 40, text, color, faces, dpi);
+	xcbft_measure_text(faces, text, dpi);
+	sync_server(c);
+	for (i = 0; i < iterations; i++) {
+		start = now_us();
+		xcbft_draw_text(c, pmap, 0, 40, text, color, faces, dpi);
+		sync_server(c);
+		draw.values[draw.length++] = now_us() - start;
+
+		start = now_us();
+		xcbft_draw_utf8(c, pmap, 0, 40, corpus->text, bytes, color,
+			faces, dpi);
+		sync_server(c);
+		draw_utf8.values[draw_utf8.length++] = now_us() - start;
+
+		/* blended on the client, Render if MIT-SHM isn't there */
+		start = now_us();
+		xcbft_draw_list_add(list, 0, 40, text, color, faces);
+		xcbft_draw_list_render_backend(c, pmap, list, dpi,
+			XCBFT_BACKEND_SHM);
+		sync_server(c);
+		draw_shm.values[draw_shm.length++] = now_us() - start;
+
+		start = now_us();
+		xcbft_measure_text(faces, text, dpi);
+		measure.values[measure.length++] = now_us() - start;
+	}
+	report("draw_text", corpus->name, "warm", &draw, text.length);
+	report("draw_utf8", corpus->name, "warm", &draw_utf8, text.length);
+	report("draw_shm", corpus->name, "warm", &draw_shm, text.length);
+	report("measure_text", corpus->name, "warm", &measure, text.length);
+	xcbft_face_holder_destroy(faces);
+
+	/* the faces of a memory image never have their glyphs uploaded */
+	faces = xcbft_load_faces(patterns, dpi);
+	xcbft_draw_list_add(list, 0, 40, text, color, faces);
+	xcbft_draw_list_render_image(list, &pixels, dpi);
+	for (i = 0; i < iterations; i++) {
+		memset(pixels.pixels, 0, 4 * IMAGE_WIDTH * IMAGE_HEIGHT);
+		start = now_us();
+		xcbft_draw_list_add(list, 0, 40, text, color, faces);
+		xcbft_draw_list_render_image(list, &pixels, dpi);
+		image.values[image.length++] = now_us() - start;
+		differing += compare_pixels(golden, pixels.pixels,
+			&max_difference);
+	}
+	report("draw_image", corpus->name, "warm", &image, text.length);
+	report_pixels(corpus->name, "image", differing, max_difference);
+
+	/* the glyphs only drawn in memory so far, then sent to the server */
+	xcbft_draw_list_add(list, 0, 40, text, color, faces);
+	check_backend(c, pmap, gc, list, dpi, XCBFT_BACKEND_RENDER, golden,
+		corpus->name, "render");
+	xcbft_draw_list_add(list, 0, 40, text, color, faces);
+	check_backend(c, pmap, gc, list, dpi, XCBFT_BACKEND_SHM, golden,
+		corpus->name, "shm");
+	xcbft_face_holder_destroy(faces);
+
+	free(raster.values);
+	free(load.values);
+	free(upload.values);
+	free(draw.values);
+	free(draw_utf8.values);
+	free(draw_shm.values);
+	free(measure.values);
+	free(image.values);
+	free(pixels.pixels);
+	free(golden);
+	xcbft_draw_list_destroy(list);
+	utf_holder_destroy(text);
+}
+
+int
+main(int argc, char **argv)
+{
+	xcb_connection_t *c;
+	xcb_screen_t *screen;
+	xcb_pixmap_t pmap;
+	xcb_gcontext_t gc;
+	FcStrSet *fontsearch;
+	struct xcbft_patterns_holder patterns;
+	struct corpus corpora[4];
+	unsigned int iterations, i;
+	long dpi;
+	char *search;
+
+	iterations = argc > 1 ? (unsigned int)atoi(argv[1]) : DEFAULT_ITERATIONS;
+	search = argc > 2 ? argv[2] : DEFAULT_SEARCH;
+	if (iterations == 0) {
+		fprintf(stderr, "usage: %s [iterations] [fontsearch list]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (xcb_connection_has_error(c = xcb_connect(NULL, NULL))) {
+		fprintf(stderr, "can't connect to the X server, run under Xvfb\n");
+		return 1;
+	}
+	screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+	dpi = screen_dpi(screen);
+	pmap = xcb_generate_id(c);
+	xcb_create_pixmap(c, screen->root_depth, pmap, screen->root,
+		IMAGE_WIDTH, IMAGE_HEIGHT);
+	/* clears the pixmap before the pixels are compared */
+	gc = xcb_generate_id(c);
+	xcb_create_gc(c, gc, pmap, XCB_GC_FOREGROUND, &screen->black_pixel);
+
+	corpora[0].name = "ascii";
+	corpora[0].text = strdup(ascii_text);
+	corpora[1].name = "mixed";
+	corpora[1].text = strdup(mixed_text);
+	corpora[2].name = "emoji";
+	corpora[2].text = strdup(emoji_text);
+	corpora[3].name = "long_line";
+	corpora[3].text = long_line();
+
+	xcbft_init();
+	fontsearch = xcbft_extract_fontsearch_list(search);
+	bench_query(fontsearch, iterations);
+	patterns = xcbft_query_fontsearch_all(fontsearch);
+	if (patterns.length == 0) {
+		fprintf(stderr, "no font matches %s\n", search);
+		return 1;
+	}
+	bench_load_faces(patterns, dpi, iterations);
+	for (i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+		bench_corpus(c, pmap, gc, patterns, dpi, &corpora[i],
+			iterations);
+		free(corpora[i].text);
+	}
+	/* only built with XCBFT_TRACE (make trace) */
+	xcbft_trace_dump("bench-trace.json");
+
+	xcbft_patterns_holder_destroy(patterns);
+	FcStrSetDestroy(fontsearch);
+	xcbft_done();
+	xcb_free_gc(c, gc);
+	xcb_free_pixmap(c, pmap);
+	xcb_disconnect(c);
+	return 0;
+}
@@ -1,34 +1,245 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <fontconfig/fontconfig.h>
 
 #include "utf8.h"
 
+/* what invalid sequences decode to */
+#define UTF8_REPLACEMENT 0xfffd
+
+/*
+ * Start a sequence on its lead byte c, not ASCII.
+ *
+ * Returns 0 when c can't start a sequence
+ */
+static int
+utf8_lead(struct utf_decoder *decoder, uint8_t c)
+{
+	decoder->low = 0x80;
+	decoder->high = 0xbf;
+	if (c < 0xc2) {
+		/* continuation byte or overlong 2-byte lead */
+		return 0;
+	} else if (c < 0xe0) {
+		decoder->need = 1;
+		decoder->partial = c & 0x1f;
+	} else if (c < 0xf0) {
+		decoder->need = 2;
+		decoder->partial = c & 0x0f;
+		/* no overlongs, no surrogates */
+		if (c == 0xe0) decoder->low = 0xa0;
+		if (c == 0xed) decoder->high = 0x9f;
+	} else if (c < 0xf5) {
+		decoder->need = 3;
+		decoder->partial = c & 0x07;
+		/* no overlongs, nothing above U+10FFFF */
+		if (c == 0xf0) decoder->low = 0x90;
+		if (c == 0xf4) decoder->high = 0x8f;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Add the continuation byte c to the sequence started.
+ *
+ * Returns -1 when c doesn't belong to it (the sequence is dropped), 1
+ * when the code point is complete in decoder->partial, 0 otherwise
+ */
+static int
+utf8_next(struct utf_decoder *decoder, uint8_t c)
+{
+	if (c < decoder->low || c > decoder->high) {
+		decoder->need = 0;
+		return -1;
+	}
+	decoder->partial = (decoder->partial << 6) | (c & 0x3f);
+	decoder->low = 0x80;
+	decoder->high = 0xbf;
+	return --decoder->need == 0;
+}
+
+/*
+ * Decode the sequence at the start of s, of at most length bytes, to
+ * out. A sequence that is invalid (overlong, surrogate, above U+10FFFF)
+ * decodes to U+FFFD, consuming only its maximal valid part.
+ *
+ * Returns the number of bytes consumed, or 0 when the sequence is valid
+ * so far but continues past length
+ */
+static size_t
+utf8_decode_one(const uint8_t *s, size_t length, FcChar32 *out)
+{
+	struct utf_decoder decoder;
+	size_t i;
+
+	if (s[0] < 0x80) {
+		*out = s[0];
+		return 1;
+	}
+	if (!utf8_lead(&decoder, s[0])) {
+		*out = UTF8_REPLACEMENT;
+		return 1;
+	}
+	for (i = 1; i < length; i++) {
+		switch (utf8_next(&decoder, s[i])) {
+		case -1:
+			*out = UTF8_REPLACEMENT;
+			return i;
+		case 1:
+			*out = decoder.partial;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Decode up to length bytes of UTF-8 into out, at most out_length
+ * characters. Runs of ASCII are widened a vector at a time. It stops
+ * before a sequence that continues past length, *used says where.
+ *
+ * Returns the number of characters written
+ */
+static size_t
+utf8_decode(const uint8_t *s, size_t length, size_t *used,
+	FcChar32 *out, size_t out_length)
+{
+	size_t i = 0, written = 0, n;
+#if defined(__AVX2__)
+	__m256i chunk;
+	unsigned int mask;
+
+	while (length - i >= 32 && out_length - written >= 32) {
+		chunk = _mm256_loadu_si256((const __m256i *)(s + i));
+		mask = (unsigned int)_mm256_movemask_epi8(chunk);
+		if (mask == 0) {
+			/* 8 bytes to 8 code points at a time */
+			_mm256_storeu_si256((__m256i *)(out + written),
+				_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+					(const __m128i *)(s + i))));
+			_mm256_storeu_si256((__m256i *)(out + written + 8),
+				_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+					(const __m128i *)(s + i + 8))));
+			_mm256_storeu_si256((__m256i *)(out + written + 16),
+				_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+					(const __m128i *)(s + i + 16))));
+			_mm256_storeu_si256((__m256i *)(out + written + 24),
+				_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+					(const __m128i *)(s + i + 24))));
+			i += 32;
+			written += 32;
+			continue;
+		}
+		/* the ASCII before the first other byte, then that sequence */
+		for (mask = __builtin_ctz(mask); mask > 0; mask--) {
+			out[written++] = s[i++];
+		}
+		if ((n = utf8_decode_one(s + i, length - i, out + written)) == 0) {
+			break;
+		}
+		i += n;
+		written++;
+	}
+#elif defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i chunk, half;
+	unsigned int mask;
+
+	while (length - i >= 16 && out_length - written >= 16) {
+		chunk = _mm_loadu_si128((const __m128i *)(s + i));
+		mask = (unsigned int)_mm_movemask_epi8(chunk);
+		if (mask == 0) {
+			/* widen to 16 bits, then to 32 */
+			half = _mm_unpacklo_epi8(chunk, zero);
+			_mm_storeu_si128((__m128i *)(out + written),
+				_mm_unpacklo_epi16(half, zero));
+			_mm_storeu_si128((__m128i *)(out + written + 4),
+				_mm_unpackhi_epi16(half, zero));
+			half = _mm_unpackhi_epi8(chunk, zero);
+			_mm_storeu_si128((__m128i *)(out + written + 8),
+				_mm_unpacklo_epi16(half, zero));
+			_mm_storeu_si128((__m128i *)(out + written + 12),
+				_mm_unpackhi_epi16(half, zero));
+			i += 16;
+			written += 16;
+			continue;
+		}
+		/* the ASCII before the first other byte, then that sequence */
+		for (mask = __builtin_ctz(mask); mask > 0; mask--) {
+			out[written++] = s[i++];
+		}
+		if ((n = utf8_decode_one(s + i, length - i, out + written)) == 0) {
+			break;
+		}
+		i += n;
+		written++;
+	}
+#else
+	uint64_t word;
+
+	/* no vectors, check 8 bytes at a time in a word */
+	while (length - i >= 8 && out_length - written >= 8) {
+		memcpy(&word, s + i, sizeof(word));
+		if ((word & 0x8080808080808080ull) != 0) {
+			if ((n = utf8_decode_one(s + i, length - i,
+			    out + written)) == 0) {
+				break;
+			}
+			i += n;
+			written++;
+			continue;
+		}
+		for (n = 0; n < 8; n++) {
+			out[written++] = s[i++];
+		}
+	}
+#endif
+	while (i < length && written < out_length) {
+		if ((n = utf8_decode_one(s + i, length - i, out + written)) == 0) {
+			break;
+		}
+		i += n;
+		written++;
+	}
+
+	*used = i;
+	return written;
+}
+
 struct utf_holder
 char_to_uint32(char *str)
 {
 	struct utf_holder holder;
 	FcChar32 *output = NULL;
-	int length = 0, shift = 0;
+	size_t length, used;
 
 	/* there should be less than or same as the strlen of str */
-	output = (FcChar32 *)malloc(sizeof(FcChar32)*strlen(str));
+	length = strlen(str);
+	output = (FcChar32 *)malloc(sizeof(FcChar32)*(length ? length : 1));
 	if (!output) {
 		puts("couldn't allocate mem for char_to_uint32");
+		holder.length = 0;
+		holder.str = NULL;
+		return holder;
 	}
 
-	while (*(str+shift)) {
-		shift += FcUtf8ToUcs4(
-			(FcChar8*)(str+shift),
-			output+length,
-			strlen(str)-shift
-		);
-		length++;
+	holder.length = utf8_decode((const uint8_t *)str, length, &used,
+		output, length);
+	if (used < length) {
+		/* the string ends in the middle of a sequence */
+		output[holder.length++] = UTF8_REPLACEMENT;
 	}
-
-	holder.length = length;
 	holder.str = output;
 
 	return holder;
@@ -40,3 +251,76 @@ utf_holder_destroy(struct utf_holder holder)
 
 	free(holder.str);
 }
+
+void
+utf_decoder_init(struct utf_decoder *decoder)
+{
+
+	memset(decoder, 0, sizeof(*decoder));
+}
+
+/*
+ * Decode a chunk of a stream of UTF-8, length bytes not NUL terminated,
+ * into the out_length characters of out. A sequence cut at the end of
+ * the chunk is kept in the decoder and finished by the next one, the
+ * result is the same as decoding the whole text at once.
+ *
+ * *used is set to the bytes consumed, less than length only when out is
+ * full. Returns the number of characters written
+ */
+size_t
+utf_decode(struct utf_decoder *decoder, const char *bytes, size_t length,
+	size_t *used, FcChar32 *out, size_t out_length)
+{
+	const uint8_t *s = (const uint8_t *)bytes;
+	size_t i = 0, written = 0, n;
+
+	/* first finish the sequence the last chunk ended in */
+	while (decoder->need > 0 && i < length && written < out_length) {
+		switch (utf8_next(decoder, s[i])) {
+		case -1:
+			/* s[i] starts over, as it would in one chunk */
+			out[written++] = UTF8_REPLACEMENT;
+			break;
+		case 1:
+			out[written++] = decoder->partial;
+			/* fallthrough */
+		default:
+			i++;
+		}
+	}
+
+	if (decoder->need == 0) {
+		written += utf8_decode(s + i, length - i, &n,
+			out + written, out_length - written);
+		i += n;
+		if (i < length && written < out_length) {
+			/* keep the start of the sequence for the next chunk */
+			utf8_lead(decoder, s[i++]);
+			while (i < length) {
+				utf8_next(decoder, s[i++]);
+			}
+		}
+	}
+
+	*used = i;
+	return written;
+}
+
+/*
+ * End of the stream, out needs room for 1 character.
+ *
+ * Returns the number of characters written
+ */
+size_t
+utf_decode_end(struct utf_decoder *decoder, FcChar32 *out)
+{
+
+	if (decoder->need == 0) {
+		return 0;
+	}
+	/* the text ended in the middle of a sequence */
+	decoder->need = 0;
+	*out = UTF8_REPLACEMENT;
+	return 1;
+}
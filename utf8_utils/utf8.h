@@ -1,6 +1,8 @@
 #ifndef _UTF8_UTILS_
 #define _UTF8_UTILS_
 
+#include <stddef.h>
+
 struct utf_holder {
 	FcChar32 *str;
 	unsigned int length;
@@ -8,4 +10,19 @@ struct utf_holder {
 struct utf_holder char_to_uint32(char *str);
 void utf_holder_destroy(struct utf_holder holder);
 
+/*
+ * State kept between the chunks of a stream, the start of a sequence
+ * cut at the end of the previous chunk
+ */
+struct utf_decoder {
+	FcChar32 partial;
+	unsigned char need;
+	unsigned char low;
+	unsigned char high;
+};
+void utf_decoder_init(struct utf_decoder *decoder);
+size_t utf_decode(struct utf_decoder *decoder, const char *bytes,
+	size_t length, size_t *used, FcChar32 *out, size_t out_length);
+size_t utf_decode_end(struct utf_decoder *decoder, FcChar32 *out);
+
 #endif
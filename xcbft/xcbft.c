@@ -1,549 +1,7205 @@
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
 #include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <fontconfig/fontconfig.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_LCD_FILTER_H
+#include FT_SIZES_H
+#include FT_MODULE_H
 
 #include <xcb/xcb.h>
 #include <xcb/render.h>
 #include <xcb/xcb_renderutil.h>
+#include <xcb/shm.h>
+#include <xcb/xcb_xrm.h>
 
 #include "../utf8_utils/utf8.h"
 #include "xcbft.h"
 
-void
-xcbft_done(void)
+/* glyphs are uploaded in batches of at most this many bytes */
+#define XCBFT_UPLOAD_BATCH_BYTES 262144
+/* the prewarm worker hands over its glyphs in groups of that size */
+#define XCBFT_PREWARM_CHUNK 64
+/* below that many missing glyphs the pool isn't worth waking up */
+#define XCBFT_POOL_MIN_GLYPHS 32
+/* the pool uploader sends what it got every that many glyphs */
+#define XCBFT_POOL_UPLOAD_GLYPHS 256
+/* most glyphs a single glyph element of a composite stream can take */
+#define XCBFT_GLYPHS_PER_ELT 252
+/* characters decoded on the stack at a time when drawing UTF-8 */
+#define XCBFT_UTF8_CHUNK 128
+/* first word of a published glyph map, then its version */
+#define XCBFT_SHARE_MAGIC 0x78636266
+#define XCBFT_SHARE_VERSION 1
+/* words of the header of a published map and of each of its glyphs */
+#define XCBFT_SHARE_HEADER 9
+#define XCBFT_SHARE_GLYPH 5
+/* cache keys are the charcode (21 bits) with the render mode above it */
+#define XCBFT_MODE_SHIFT 21
+/* over budget the glyphsets are trimmed down to that fraction of it */
+#define XCBFT_BUDGET_TRIM(budget) ((budget) / 4 * 3)
+/* parts of the metric cache, each with its own lock */
+#define XCBFT_METRIC_SHARDS 16
+/* texts whose font runs are remembered, by hash */
+#define XCBFT_RUN_CACHE_SLOTS 64
+
+/*
+ * How a face is hinted and rendered, the render mode of a face is one of
+ * each and is part of the key of cached glyphs.
+ * 0 is what xcbft_load_glyph uses for glyphs loaded outside the cache.
+ */
+enum xcbft_hinting {
+	XCBFT_HINT_NATIVE = 0,
+	XCBFT_HINT_LIGHT = 1,
+	XCBFT_HINT_NONE = 2,
+	XCBFT_HINT_AUTO = 3
+};
+#define XCBFT_HINT_MASK 3
+enum xcbft_rendering {
+	XCBFT_RENDER_GRAY = 0 << 2,
+	/* antialias off */
+	XCBFT_RENDER_MONO = 1 << 2,
+	/* subpixel, see the order and filter below */
+	XCBFT_RENDER_LCD = 2 << 2,
+	/* color bitmaps (emoji), set per glyph */
+	XCBFT_RENDER_COLOR = 3 << 2
+};
+#define XCBFT_RENDER_MASK (3 << 2)
+enum xcbft_subpixel {
+	XCBFT_SUBPIXEL_RGB = 0 << 4,
+	XCBFT_SUBPIXEL_BGR = 1 << 4,
+	XCBFT_SUBPIXEL_VRGB = 2 << 4,
+	XCBFT_SUBPIXEL_VBGR = 3 << 4
+};
+#define XCBFT_SUBPIXEL_MASK (3 << 4)
+/* the lcd filter (FC_LCD_*) is in the last two bits */
+#define XCBFT_LCD_FILTER_SHIFT 6
+
+/* each format of glyphs goes in its own glyphset */
+enum xcbft_glyph_format {
+	/* 8 bits coverage */
+	XCBFT_FORMAT_A8,
+	/* 1 bit, antialias off */
+	XCBFT_FORMAT_A1,
+	/* ARGB32 with component alpha */
+	XCBFT_FORMAT_LCD,
+	/* premultiplied ARGB32, drawn as is instead of with the pen */
+	XCBFT_FORMAT_COLOR,
+	XCBFT_FORMATS
+};
+
+/* one rasterized glyph waiting to be uploaded */
+struct xcbft_glyph_bitmap {
+	uint32_t charcode;
+	uint32_t gid;
+	uint8_t face;
+	uint8_t mode;
+	xcb_render_glyphinfo_t info;
+	uint8_t *data;
+	uint32_t data_len;
+	struct xcbft_glyph_bitmap *next;
+};
+
+/* where a glyph is in the atlas, with its metrics */
+struct xcbft_atlas_slot {
+	uint16_t x, y;
+	uint16_t width, height;
+	/* x and y of the glyph info, from the pen to the top left */
+	int16_t origin_x, origin_y;
+};
+
+enum xcbft_atlas_state {
+	XCBFT_ATLAS_NONE,
+	XCBFT_ATLAS_PLACED,
+	/* didn't fit back when repacking, removed from the cache */
+	XCBFT_ATLAS_LOST
+};
+
+/* glyphs of characters none of the faces has */
+enum xcbft_fallback_state {
+	XCBFT_FALLBACK_NONE,
+	/* drawn with the first face until its font is found */
+	XCBFT_FALLBACK_WAITING,
+	/* the font was found, the glyph is replaced at the next load */
+	XCBFT_FALLBACK_FOUND
+};
+
+struct xcbft_glyph_entry {
+	uint32_t charcode;
+	uint8_t mode;
+	uint8_t used;
+	/* index in the face holder or XCBFT_FACE_FALLBACK */
+	uint8_t face;
+	/* see xcbft_fallback_state */
+	uint8_t fallback;
+	/* id in the glyphset */
+	uint32_t gid;
+	FT_Vector advance;
+	/* clock of the cache when it was last drawn */
+	uint32_t last_use;
+	/* taken in the glyphset on the server, 0 in the atlas */
+	uint32_t bytes;
+	/* in the borrowed glyphset at that index + 1, 0 if in ours */
+	uint8_t borrowed;
+	/* rasterized without a connection, sent by the next load with one */
+	uint8_t offline;
+	/* copy on the client, only kept for the shm backend */
+	struct xcbft_glyph_image *image;
+	/* in the atlas instead of a glyphset, see xcbft_atlas */
+	uint8_t atlas;
+	struct xcbft_atlas_slot slot;
+};
+
+/* a glyph as uploaded, in the layout of its format */
+struct xcbft_glyph_image {
+	xcb_render_glyphinfo_t info;
+	enum xcbft_glyph_format format;
+	uint32_t stride;
+	uint8_t *data;
+};
+
+/*
+ * The allocator of the FreeType library of a face holder and its views,
+ * counting what the faces, sizes and glyph slots take
+ */
+struct xcbft_ft_memory {
+	struct FT_MemoryRec_ memory;
+	atomic_size_t bytes;
+};
+
+/* what the font file looked like when the face was opened */
+struct xcbft_file_stamp {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+};
+
+/* read once per face from its pattern */
+struct xcbft_face_info {
+	struct xcbft_file_stamp stamp;
+	FT_Int32 load_flags;
+	FT_LcdFilter lcd_filter;
+	uint8_t mode;
+	double pixel_size;
+	/* from the strike of a bitmap only face to pixel_size */
+	double scale;
+};
+
+/* a row of glyphs of at most its height, filled left to right */
+struct xcbft_atlas_shelf {
+	uint16_t y, height;
+	uint16_t x;
+	/* x before the current upload, what is right of it is new */
+	uint16_t uploaded_x;
+};
+
+/*
+ * A8 glyphs packed on shelves in a pixmap, drawn by compositing their
+ * rectangle. The server memory is the size of the pixmap, glyphs are
+ * uploaded in tiles of a shelf and the space of dropped glyphs is taken
+ * back by repacking into a new pixmap.
+ */
+struct xcbft_atlas {
+	xcb_connection_t *c;
+	xcb_pixmap_t pixmap;
+	xcb_render_picture_t picture;
+	xcb_gcontext_t gc;
+	uint16_t width, height;
+	struct xcbft_atlas_shelf *shelves;
+	unsigned int shelves_length;
+	unsigned int shelves_allocated;
+	/* first row without shelf */
+	uint16_t bottom;
+};
+
+/* a glyphset of a cache and the allocation of its glyph ids */
+struct xcbft_glyphset {
+	xcb_render_glyphset_t id;
+	uint32_t next_gid;
+	uint32_t *free_gids;
+	uint32_t free_gids_length;
+	uint32_t free_gids_allocated;
+	/* glyph data and infos uploaded to it */
+	atomic_size_t bytes;
+};
+
+/* fontconfig results, kept until the configuration changes */
+struct xcbft_query_entry {
+	FcChar8 *fontquery;
+	FcPattern *pattern;
+	struct xcbft_query_entry *next;
+};
+
+/*
+ * Glyphs of a face holder that are already on the server, keyed by
+ * charcode and render mode. The ids in the glyphset are compact.
+ */
+struct xcbft_glyph_cache {
+	xcb_connection_t *c;
+	/* created on first use */
+	struct xcbft_glyphset glyphsets[XCBFT_FORMATS];
+	struct xcbft_glyph_entry *entries;
+	uint32_t size;
+	uint32_t count;
+	/* optional rasterization workers */
+	struct xcbft_raster_pool *pool;
+	/* one per face */
+	struct xcbft_face_info *infos;
+	unsigned long generation;
+	/* render modes that have glyphs in the cache */
+	uint8_t *modes;
+	unsigned int modes_length;
+	unsigned int modes_allocated;
+	/* set once the shm backend drew with the cache */
+	uint8_t keep_images;
+	/* A8 glyphs go there instead when set */
+	struct xcbft_atlas *atlas;
+	/* most bytes kept in the glyphsets, 0 for no limit */
+	size_t budget;
+	/* ticks once per load or draw, glyphs of the current tick stay */
+	uint32_t clock;
+	/* when the fallback glyphs were last replaced */
+	uint32_t fallbacks_clock;
+	/* our references to glyphsets of other clients, some glyphs are
+	 * drawn from */
+	xcb_render_glyphset_t *borrowed;
+	uint8_t borrowed_length;
+	/* the root property of each face once published, not trimmed then */
+	xcb_atom_t *published;
+	/* what the sizes of the faces were set for */
+	long dpi;
+	/* size of each face for this holder, views have their own */
+	FT_Size *sizes;
+	/* which of them were made by the view, NULL if none */
+	uint8_t *owns_sizes;
+	/* shared with the views of the faces */
+	struct xcbft_raster_cache *raster;
+	/* advances for xcbft_measure_text, safe to use from any thread */
+	struct xcbft_metric_cache *metrics;
+	/* fonts of the characters none of the faces has, from any thread */
+	struct xcbft_fallbacks *fallbacks;
+	/* font runs of the last texts drawn or measured */
+	struct xcbft_run_cache *runs;
+	/* FreeType allocations of the faces, shared with the views */
+	struct xcbft_ft_memory *ft_memory;
+	/* entries and glyph images, read by other threads for the totals */
+	atomic_size_t client_bytes;
+	/* the atlas pixmap on the server */
+	atomic_size_t atlas_bytes;
+	/* set by the memory budget, the old images are freed at the next load */
+	atomic_int drop_images;
+	/* in the list of every cache */
+	struct xcbft_glyph_cache *next;
+};
+
+/* advance of a character with the face it comes from */
+struct xcbft_metric {
+	uint32_t charcode;
+	uint8_t used;
+	uint8_t face;
+	FT_Vector advance;
+};
+
+/* the characters whose hash falls in one part of the metric cache */
+struct xcbft_metric_shard {
+	pthread_rwlock_t lock;
+	struct xcbft_metric *entries;
+	uint32_t size;
+	uint32_t count;
+};
+
+/* copies of the faces for a thread measuring text, FT faces aren't shared */
+struct xcbft_thread_faces {
+	pthread_t thread;
+	struct xcbft_face_holder faces;
+	/* of the metric cache when copied */
+	unsigned int generation;
+	struct xcbft_thread_faces *next;
+};
+
+/*
+ * Advances are mostly read once known, readers of different shards
+ * never wait for each other and readers of the same one only wait for
+ * a writer adding a character.
+ */
+struct xcbft_metric_cache {
+	struct xcbft_metric_shard shards[XCBFT_METRIC_SHARDS];
+	pthread_mutex_t threads_lock;
+	struct xcbft_thread_faces *threads;
+	/* bumped when the faces are reopened, the copies are made again */
+	atomic_uint generation;
+	/* of the shards */
+	atomic_size_t bytes;
+};
+
+/* the font runs of a text, in the run cache */
+struct xcbft_itemized {
+	uint64_t hash;
+	FcChar32 *text;
+	uint32_t length;
+	struct xcbft_font_run *runs;
+	unsigned int runs_length;
+};
+
+/*
+ * Direct mapped by the hash of the text, a text replaces the one in its
+ * slot. Measuring threads use it too, hence the lock.
+ */
+struct xcbft_run_cache {
+	pthread_mutex_t lock;
+	struct xcbft_itemized slots[XCBFT_RUN_CACHE_SLOTS];
+	atomic_size_t bytes;
+};
+
+/* a range of characters of a script */
+struct xcbft_script_range {
+	uint32_t first;
+	uint32_t last;
+	uint8_t script;
+};
+
+/* a rasterized glyph kept on the client, before it's uploaded */
+struct xcbft_raster_entry {
+	uint32_t charcode;
+	uint8_t face;
+	/* of the face, the glyph may have another one (color) */
+	uint8_t mode;
+	uint8_t used;
+	/* 26.6 pixel size */
+	int32_t size;
+	struct xcbft_glyph_bitmap glyph;
+};
+
+/*
+ * The faces, library and patterns of a face holder are shared by its
+ * views (one per connection and per dpi), freed with the last one. The
+ * views also share the glyphs they rasterize so that a glyph of the
+ * same size is rasterized once and only uploaded to each connection.
+ */
+struct xcbft_raster_cache {
+	pthread_mutex_t lock;
+	unsigned int refs;
+	/* only filled once there are views, protected by lock */
+	struct xcbft_raster_entry *entries;
+	uint32_t size;
+	uint32_t count;
+	atomic_size_t bytes;
+};
+
+/* incremented every time the fontconfig configuration is rebuilt */
+static atomic_ulong xcbft_config_generation;
+static struct xcbft_query_entry *xcbft_query_cache;
+static pthread_mutex_t xcbft_query_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* render settings from Xresources, used where the query says nothing */
+static pthread_mutex_t xcbft_xrm_lock = PTHREAD_MUTEX_INITIALIZER;
+static FcPattern *xcbft_xrm_settings;
+
+/* what xcbft_stats counts, in the order of struct xcbft_stats */
+enum xcbft_counter {
+	XCBFT_COUNT_FC_MATCHES,
+	XCBFT_COUNT_FACES_OPENED,
+	XCBFT_COUNT_GLYPHS_RASTERIZED,
+	XCBFT_COUNT_CACHE_HITS,
+	XCBFT_COUNT_CACHE_MISSES,
+	XCBFT_COUNT_ADD_GLYPHS_REQUESTS,
+	XCBFT_COUNT_ADD_GLYPHS_BYTES,
+	XCBFT_COUNT_COMPOSITE_REQUESTS,
+	XCBFT_COUNT_FALLBACK_LOOKUPS,
+	XCBFT_COUNTERS
+};
+
+/*
+ * Counters of one thread, only written by it. They are atomic for the
+ * readers, without the cost of a locked add for the writer.
+ */
+struct xcbft_counters {
+	atomic_uint_least64_t values[XCBFT_COUNTERS];
+	struct xcbft_counters *next;
+};
+
+/* the counters of every live thread, and what exited threads counted */
+static pthread_mutex_t xcbft_counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xcbft_counters *xcbft_counters_threads;
+static uint64_t xcbft_counters_exited[XCBFT_COUNTERS];
+static pthread_key_t xcbft_counters_key;
+static pthread_once_t xcbft_counters_once = PTHREAD_ONCE_INIT;
+
+/* every glyph cache, for the totals and the memory budget */
+static pthread_mutex_t xcbft_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xcbft_glyph_cache *xcbft_caches;
+/* bytes of the client caches of all of them, of the FreeType libraries */
+static atomic_size_t xcbft_cache_bytes;
+static atomic_size_t xcbft_ft_bytes;
+/* most bytes of client caches, 0 for no limit */
+static atomic_size_t xcbft_cache_budget;
+static atomic_flag xcbft_trimming = ATOMIC_FLAG_INIT;
+
+#ifdef XCBFT_TRACE
+/* events kept per thread, the following ones are dropped */
+#define XCBFT_TRACE_EVENTS 65536
+
+/* a timed scope, in nanoseconds of the monotonic clock */
+struct xcbft_trace_event {
+	const char *name;
+	uint64_t start;
+	uint64_t duration;
+};
+
+/*
+ * Events of one thread, only appended to by it. The lock is only taken
+ * by someone else to dump or clear them.
+ */
+struct xcbft_trace_buffer {
+	pthread_mutex_t lock;
+	struct xcbft_trace_event *events;
+	unsigned int length;
+	unsigned int allocated;
+	unsigned int tid;
+	/* the thread is gone, free the buffer once dumped and cleared */
+	int exited;
+	struct xcbft_trace_buffer *next;
+};
+
+/* the buffers of every thread that traced, exited ones included */
+static pthread_mutex_t xcbft_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xcbft_trace_buffer *xcbft_trace_buffers;
+static unsigned int xcbft_trace_tids;
+static pthread_key_t xcbft_trace_key;
+static pthread_once_t xcbft_trace_once = PTHREAD_ONCE_INIT;
+
+static uint64_t xcbft_trace_now(void);
+static void xcbft_trace_event(const char *, uint64_t);
+
+/* time the code between them, name is a string literal */
+#define XCBFT_TRACE_BEGIN(start) uint64_t start = xcbft_trace_now()
+#define XCBFT_TRACE_END(name, start) xcbft_trace_event(name, start)
+#else
+#define XCBFT_TRACE_BEGIN(start) ((void)0)
+#define XCBFT_TRACE_END(name, start) ((void)0)
+#endif
+
+/* font resolution running on a helper thread */
+struct xcbft_async_query {
+	pthread_t thread;
+	int fd;
+	/* also signaled if not -1 */
+	int notify_fd;
+	long dpi;
+	/* either a fontsearch list or a character to support */
+	FcStrSet *queries;
+	FcChar32 character;
+	FcPattern *copy_pattern;
+	/* written by the helper before signaling fd */
+	struct xcbft_face_holder faces;
+	/* the last of the helper and xcbft_async_query_cancel frees it */
+	pthread_mutex_t lock;
+	uint8_t finished;
+	uint8_t canceled;
+};
+
+/* a fallback font being looked up for a character */
+struct xcbft_fallback_lookup {
+	FcChar32 charcode;
+	struct xcbft_async_query *query;
+	struct xcbft_fallback_lookup *next;
+};
+
+/*
+ * The fallback fonts of a face holder, looked up on helper threads: the
+ * characters are drawn with the first face until their font is found.
+ * Used by the measuring threads too, the faces found only under lock.
+ */
+struct xcbft_fallbacks {
+	pthread_mutex_t lock;
+	/* readable when a lookup finished, -1 before the first one */
+	int fd;
+	struct xcbft_fallback_lookup *lookups;
+	struct xcbft_face_holder *found;
+	unsigned int found_length;
+	/* characters no font has */
+	FcCharSet *missing;
+	/* lookups finished, and when the glyphs were last replaced */
+	unsigned int finished;
+	unsigned int replaced;
+};
+
+/* text to draw at a position, part of a draw list */
+struct xcbft_draw_run {
+	int16_t x, y;
+	struct utf_holder text;
+	xcb_render_color_t color;
+	struct xcbft_face_holder faces;
+	/* known once drawn */
+	FT_Vector advance;
+	xcb_render_glyphset_t glyphset;
+	uint32_t *gids;
+	/* glyphset of each glyph, they differ by format */
+	xcb_render_glyphset_t *glyphsets;
+	FT_Vector *advances;
+	/* enum xcbft_pass of each glyph */
+	uint8_t *passes;
+	/* bytes per glyph id needed by the run: 1, 2 or 4 */
+	uint8_t width;
+	uint8_t drawn;
+};
+
+/* glyphs of a run are drawn in three passes, by how they are stored */
+enum xcbft_pass {
+	/* with the pen, from the glyphsets */
+	XCBFT_PASS_TEXT,
+	/* their own colors */
+	XCBFT_PASS_COLOR,
+	/* rectangles of the atlas */
+	XCBFT_PASS_ATLAS,
+	/* not in the cache, nothing to draw */
+	XCBFT_PASS_NONE
+};
+
+/* shared memory segment used by the shm backend */
+struct xcbft_shm {
+	xcb_connection_t *c;
+	xcb_shm_seg_t seg;
+	int shmid;
+	uint8_t *addr;
+	size_t size;
+	/* 0 untried, 1 attached, -1 unavailable */
+	int state;
+};
+
+/* everything to draw for a frame */
+struct xcbft_draw_list {
+	struct xcbft_draw_run *runs;
+	unsigned int length;
+	unsigned int allocated;
+	struct xcbft_shm shm;
+};
+
+/* a glyph to rasterize and the index of the face that has it */
+struct xcbft_raster_job {
+	uint32_t charcode;
+	unsigned int face;
+	uint8_t mode;
+};
+
+/*
+ * Rasterization workers, each one with its own FT faces as they
+ * aren't thread-safe. The workers push the bitmaps on a lock-free
+ * stack that a single uploader (the thread calling xcbft) empties.
+ */
+struct xcbft_raster_pool {
+	pthread_t *threads;
+	unsigned int length;
+	struct xcbft_patterns_holder patterns;
+	long dpi;
+	/* of each face, the ones of a view may not be the pattern's */
+	double *pixel_sizes;
+	/* protected by lock: the current batch of jobs */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t finished;
+	unsigned long generation;
+	unsigned int idle;
+	int quit;
+	const struct xcbft_raster_job *jobs;
+	unsigned int jobs_length;
+	/* lock-free part */
+	atomic_uint next_job;
+	_Atomic(struct xcbft_glyph_bitmap *) done;
+	sem_t ready;
+};
+
+struct xcbft_prewarm {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct xcbft_face_holder faces;
+	FcCharSet *charset;
+	long dpi;
+	double *pixel_sizes;
+	/* protected by lock */
+	struct xcbft_glyph_bitmap *ready;
+	int finished;
+	int cancel;
+};
+
+static enum xcbft_glyph_format
+xcbft_mode_format(uint8_t mode)
 {
-	FcFini();
+	switch (mode & XCBFT_RENDER_MASK) {
+	case XCBFT_RENDER_MONO:
+		return XCBFT_FORMAT_A1;
+	case XCBFT_RENDER_LCD:
+		return XCBFT_FORMAT_LCD;
+	case XCBFT_RENDER_COLOR:
+		return XCBFT_FORMAT_COLOR;
+	default:
+		return XCBFT_FORMAT_A8;
+	}
 }
 
-int
-xcbft_init(void)
+static void
+xcbft_glyph_image_free(struct xcbft_glyph_image *image)
 {
-	FcBool status;
-
-	status = FcInit();
-	if (status == FcFalse) {
-		fprintf(stderr, "Could not initialize fontconfig");
+	if (image != NULL) {
+		free(image->data);
+		free(image);
 	}
+}
 
-	return status == FcTrue;
+/* n more bytes in a client cache, counted in bytes and in the total */
+static void
+xcbft_memory_grow(atomic_size_t *bytes, size_t n)
+{
+	atomic_fetch_add_explicit(bytes, n, memory_order_relaxed);
+	atomic_fetch_add_explicit(&xcbft_cache_bytes, n, memory_order_relaxed);
 }
 
-/*
- * Do the font queries through fontconfig and return the info
- *
- * Assumes:
- *	Fontconfig is already init & cleaned outside
- *	the FcPattern return needs to be cleaned outside
- */
-FcPattern*
-xcbft_query_fontsearch(FcChar8 *fontquery)
+static void
+xcbft_memory_shrink(atomic_size_t *bytes, size_t n)
 {
-	FcBool status;
-	FcPattern *fc_finding_pattern, *pat_output;
-	FcResult result;
+	atomic_fetch_sub_explicit(bytes, n, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&xcbft_cache_bytes, n, memory_order_relaxed);
+}
 
-	fc_finding_pattern = FcNameParse(fontquery);
+static size_t
+xcbft_glyph_image_size(const struct xcbft_glyph_image *image)
+{
+	return sizeof(struct xcbft_glyph_image) +
+		image->stride*image->info.height;
+}
 
-	/* to match we need to fix the pattern (fill unspecified info) */
-	FcDefaultSubstitute(fc_finding_pattern);
-	status = FcConfigSubstitute(NULL, fc_finding_pattern, FcMatchPattern);
-	if (status == FcFalse) {
-		fprintf(stderr, "could not perform config font substitution");
-		return NULL;
+/* free the image of an entry of the cache */
+static void
+xcbft_glyph_image_release(struct xcbft_glyph_cache *cache,
+	struct xcbft_glyph_image *image)
+{
+	if (image != NULL) {
+		xcbft_memory_shrink(&cache->client_bytes,
+			xcbft_glyph_image_size(image));
+		xcbft_glyph_image_free(image);
 	}
+}
 
-	pat_output = FcFontMatch(NULL, fc_finding_pattern, &result);
+static uint32_t
+xcbft_glyph_key(uint32_t charcode, uint8_t mode)
+{
+	return charcode | ((uint32_t)mode << XCBFT_MODE_SHIFT);
+}
 
-	FcPatternDestroy(fc_finding_pattern);
-	if (result == FcResultMatch) {
-		return pat_output;
-	} else if (result == FcResultNoMatch) {
-		fprintf(stderr, "there wasn't a match");
-	} else {
-		fprintf(stderr, "the match wasn't as good as it should be");
+static uint32_t
+xcbft_glyph_cache_slot(const struct xcbft_glyph_cache *cache,
+	uint32_t charcode, uint8_t mode)
+{
+	/* size is always a power of two */
+	return (xcbft_glyph_key(charcode, mode) * 2654435761u) & (cache->size - 1);
+}
+
+static struct xcbft_glyph_entry *
+xcbft_glyph_cache_lookup(const struct xcbft_glyph_cache *cache,
+	uint32_t charcode, uint8_t mode)
+{
+	uint32_t slot;
+
+	if (cache->size == 0) {
+		return NULL;
+	}
+	slot = xcbft_glyph_cache_slot(cache, charcode, mode);
+	while (cache->entries[slot].used) {
+		if (cache->entries[slot].charcode == charcode &&
+				cache->entries[slot].mode == mode) {
+			return &cache->entries[slot];
+		}
+		slot = (slot + 1) & (cache->size - 1);
 	}
 	return NULL;
 }
 
 /*
- * Query a font based on character support
- * Optionally pass a pattern that it'll use as the base for the search
- *
- * fallback of font added to the list or somehow done when drawing,
- * to do that we need to search by the charset we want to draw
- * and if they are in one of the font already specified, thus need to
- * know what the users want to insert as text. This needs more thinking
- * to be decoupled.
-
-	Assumes the ft2 library is already loaded
-	Assumes the face will be cleaned outside
+ * A character is always rendered by the same face of a holder so at most
+ * one of the modes in use has it.
  */
-struct xcbft_face_holder
-xcbft_query_by_char_support(FcChar32 character,
-		const FcPattern *copy_pattern, long dpi)
+static struct xcbft_glyph_entry *
+xcbft_glyph_cache_find(const struct xcbft_glyph_cache *cache,
+	uint32_t charcode)
 {
-	FcBool status;
-	FcResult result;
-	FcCharSet *charset;
-	FcPattern *charset_pattern, *pat_output;
-	struct xcbft_patterns_holder patterns;
-	struct xcbft_face_holder faces = {0};
-
-	/* add characters we need to a charset */
-	charset = FcCharSetCreate();
-	FcCharSetAddChar(charset, character);
+	struct xcbft_glyph_entry *entry;
+	unsigned int i;
 
-	/* if we pass a pattern then copy it to get something close */
-	if (copy_pattern != NULL) {
-		charset_pattern = FcPatternDuplicate(copy_pattern);
-	} else {
-		charset_pattern = FcPatternCreate();
+	for (i = 0; i < cache->modes_length; i++) {
+		entry = xcbft_glyph_cache_lookup(cache, charcode, cache->modes[i]);
+		if (entry != NULL) {
+			return entry;
+		}
 	}
+	return NULL;
+}
 
-	/* use the charset for the pattern search */
-	FcPatternAddCharSet(charset_pattern, FC_CHARSET, charset);
-	/* also force it to be scalable */
-	FcPatternAddBool(charset_pattern, FC_SCALABLE, FcTrue);
+/* store an entry as is, growing the table if needed */
+static void
+xcbft_glyph_cache_put(struct xcbft_glyph_cache *cache,
+	const struct xcbft_glyph_entry *entry)
+{
+	uint32_t i, slot, old_size;
+	struct xcbft_glyph_entry *old_entries;
 
-	/* default & config substitutions, the usual */
-	FcDefaultSubstitute(charset_pattern);
-	status = FcConfigSubstitute(NULL, charset_pattern, FcMatchPattern);
-	if (status == FcFalse) {
-		fprintf(stderr, "could not perform config font substitution");
-		FcCharSetDestroy(charset);
-		return faces;
+	/* keep the load under 3/4 */
+	if ((cache->count + 1) * 4 > cache->size * 3) {
+		old_entries = cache->entries;
+		old_size = cache->size;
+		cache->size = old_size ? old_size * 2 : 256;
+		cache->entries = calloc(cache->size,
+			sizeof(struct xcbft_glyph_entry));
+		xcbft_memory_grow(&cache->client_bytes,
+			sizeof(struct xcbft_glyph_entry)*cache->size);
+		cache->count = 0;
+		for (i = 0; i < old_size; i++) {
+			if (old_entries[i].used) {
+				xcbft_glyph_cache_put(cache, &old_entries[i]);
+			}
+		}
+		free(old_entries);
+		xcbft_memory_shrink(&cache->client_bytes,
+			sizeof(struct xcbft_glyph_entry)*old_size);
 	}
 
-	pat_output = FcFontMatch(NULL, charset_pattern, &result);
-
-	FcPatternDestroy(charset_pattern);
+	slot = xcbft_glyph_cache_slot(cache, entry->charcode, entry->mode);
+	while (cache->entries[slot].used) {
+		slot = (slot + 1) & (cache->size - 1);
+	}
+	cache->entries[slot] = *entry;
+	cache->entries[slot].used = 1;
+	cache->count++;
+}
 
-	if (result != FcResultMatch) {
-		fprintf(stderr, "there wasn't a match");
-		FcCharSetDestroy(charset);
-		return faces;
+/*
+ * Glyph ids are handed out from 0 in each glyphset, reusing the ones of
+ * dropped glyphs first, so that most text can be sent with 8 or 16 bits
+ * per glyph
+ */
+static uint32_t
+xcbft_glyphset_new_gid(struct xcbft_glyphset *glyphset)
+{
+	if (glyphset->free_gids_length > 0) {
+		/* sorted in decreasing order, the smallest is last */
+		return glyphset->free_gids[--glyphset->free_gids_length];
 	}
+	return glyphset->next_gid++;
+}
 
-	patterns.patterns = malloc(sizeof(FcPattern *));
-	patterns.length = 1;
-	patterns.patterns[0] = pat_output;
+static int
+xcbft_gid_compare_decreasing(const void *a, const void *b)
+{
+	uint32_t gid_a = *(const uint32_t *)a, gid_b = *(const uint32_t *)b;
 
-	faces = xcbft_load_faces(patterns, dpi);
+	return gid_a < gid_b ? 1 : gid_a > gid_b ? -1 : 0;
+}
 
-	/* cleanup */
-	xcbft_patterns_holder_destroy(patterns);
-	FcCharSetDestroy(charset);
+static int
+xcbft_stamp_compare(const void *a, const void *b)
+{
+	uint64_t stamp_a = *(const uint64_t *)a, stamp_b = *(const uint64_t *)b;
 
-	return faces;
+	return stamp_a < stamp_b ? -1 : stamp_a > stamp_b ? 1 : 0;
 }
 
-struct xcbft_patterns_holder
-xcbft_query_fontsearch_all(FcStrSet *queries)
+/* the ids can be handed out again */
+static void
+xcbft_glyphset_release_gids(struct xcbft_glyphset *glyphset,
+	const uint32_t *gids, uint32_t length)
 {
-	struct xcbft_patterns_holder font_patterns;
-	FcPattern *font_pattern;
-    FcStrList *iterator;
-    FcChar8 *fontquery = NULL;
-	uint8_t current_allocated;
+	if (glyphset->free_gids_length + length > glyphset->free_gids_allocated) {
+		glyphset->free_gids_allocated = glyphset->free_gids_length + length;
+		glyphset->free_gids = realloc(glyphset->free_gids,
+			sizeof(uint32_t)*glyphset->free_gids_allocated);
+	}
+	memcpy(glyphset->free_gids + glyphset->free_gids_length, gids,
+		sizeof(uint32_t)*length);
+	glyphset->free_gids_length += length;
+	qsort(glyphset->free_gids, glyphset->free_gids_length, sizeof(uint32_t),
+		xcbft_gid_compare_decreasing);
+}
 
-	font_patterns.patterns = NULL;
-	font_patterns.length = 0;
+/* free glyphs on the server, their ids are reused */
+static void
+xcbft_glyphset_free_gids(xcb_connection_t *c, struct xcbft_glyphset *glyphset,
+	const uint32_t *gids, uint32_t length)
+{
+	if (length == 0) {
+		return;
+	}
+	/* without a connection there are only the ids */
+	if (glyphset->id != 0) {
+		xcb_render_free_glyphs(c, glyphset->id, length, gids);
+	}
+	xcbft_glyphset_release_gids(glyphset, gids, length);
+}
 
-	/* start with 5, expand if needed */
-	current_allocated = 5;
-	font_patterns.patterns = malloc(sizeof(FcPattern *)*current_allocated);
+/* look the glyphs of mode up from now on */
+static void
+xcbft_glyph_cache_add_mode(struct xcbft_glyph_cache *cache, uint8_t mode)
+{
+	unsigned int i;
 
-	/* safely iterate over set */
-	iterator = FcStrListCreate(queries);
-	FcStrListFirst(iterator);
-	while ((fontquery = FcStrListNext(iterator)) != NULL) {
-		font_pattern = xcbft_query_fontsearch(fontquery);
-		if (font_pattern != NULL) {
-			if (font_patterns.length + 1 > current_allocated) {
-				current_allocated += 5;
-				font_patterns.patterns = realloc(
-					font_patterns.patterns,
-					sizeof(FcPattern*) * current_allocated);
-			}
-			font_patterns.patterns[font_patterns.length] = font_pattern;
-			font_patterns.length++;
+	for (i = 0; i < cache->modes_length; i++) {
+		if (cache->modes[i] == mode) return;
+	}
+	/* at most the 256 values of a mode */
+	if (cache->modes_length == cache->modes_allocated) {
+		cache->modes_allocated = cache->modes_allocated ?
+			cache->modes_allocated * 2 : 4;
+		cache->modes = realloc(cache->modes, cache->modes_allocated);
+	}
+	cache->modes[cache->modes_length++] = mode;
+}
+
+/* returns the glyph id to upload the glyph with */
+static uint32_t
+xcbft_glyph_cache_insert(struct xcbft_glyph_cache *cache,
+	uint32_t charcode, uint8_t mode, FT_Vector advance, uint8_t face)
+{
+	struct xcbft_glyph_entry *entry, new_entry;
+
+	entry = xcbft_glyph_cache_lookup(cache, charcode, mode);
+	if (entry != NULL) {
+		entry->advance = advance;
+		entry->face = face;
+		entry->last_use = cache->clock;
+		/* loaded by us after all, the other client keeps its id */
+		if (entry->borrowed) {
+			entry->borrowed = 0;
+			entry->gid = xcbft_glyphset_new_gid(
+				&cache->glyphsets[xcbft_mode_format(mode)]);
 		}
+		return entry->gid;
 	}
-	FcStrListDone(iterator);
-	/* end of safely iterate over set */
 
-	return font_patterns;
+	xcbft_glyph_cache_add_mode(cache, mode);
+	memset(&new_entry, 0, sizeof(new_entry));
+	new_entry.charcode = charcode;
+	new_entry.mode = mode;
+	new_entry.advance = advance;
+	new_entry.face = face;
+	new_entry.last_use = cache->clock;
+	/* until xcbft_glyph_cache_upload has a connection to send it on */
+	new_entry.offline = 1;
+	new_entry.gid = xcbft_glyphset_new_gid(
+		&cache->glyphsets[xcbft_mode_format(mode)]);
+	xcbft_glyph_cache_put(cache, &new_entry);
+
+	return new_entry.gid;
 }
 
-/* There's no way to predict the width and height of every characters */
-/* as they can go outside the em, so let's just use whatever we have as */
-/* the biggest pixel size so far in all the loaded patterns */
-double
-xcbft_get_pixel_size(struct xcbft_patterns_holder patterns)
+/*
+ * Remove the glyphs coming from the faces flagged in drop (indexed by
+ * face, XCBFT_FACE_FALLBACK included) from the cache and the server,
+ * along with the glyphs lost by the atlas, the stand-ins of characters
+ * whose fallback font was found, the glyphs borrowed from
+ * glyphsets that aren't in the cache anymore and the glyphs of the
+ * glyphsets last drawn before the clock was at before.
+ *
+ * Returns the number of glyphs removed
+ */
+static uint32_t
+xcbft_glyph_cache_drop(struct xcbft_glyph_cache *cache, const uint8_t *drop,
+	uint32_t before)
 {
+	uint32_t i, old_size, old_count, removed;
+	uint32_t *gids[XCBFT_FORMATS], gids_length[XCBFT_FORMATS];
+	uint32_t unsent_length[XCBFT_FORMATS];
+	enum xcbft_glyph_format format;
+	struct xcbft_glyph_entry *old_entries;
+
+	old_entries = cache->entries;
+	old_size = cache->size;
+	old_count = cache->count;
+	/* ids to free on the server in front, ids never sent at the back */
+	for (format = 0; format < XCBFT_FORMATS; format++) {
+		gids[format] = malloc(sizeof(uint32_t)*(old_count+1));
+		gids_length[format] = 0;
+		unsent_length[format] = 0;
+	}
+	removed = 0;
+
+	cache->entries = NULL;
+	cache->size = 0;
+	cache->count = 0;
+	for (i = 0; i < old_size; i++) {
+		if (!old_entries[i].used) {
+			continue;
+		}
+		if (drop[old_entries[i].face] ||
+				old_entries[i].atlas == XCBFT_ATLAS_LOST ||
+				old_entries[i].fallback == XCBFT_FALLBACK_FOUND ||
+				old_entries[i].borrowed > cache->borrowed_length ||
+				(old_entries[i].atlas == XCBFT_ATLAS_NONE &&
+				old_entries[i].bytes > 0 &&
+				old_entries[i].last_use < before)) {
+			format = xcbft_mode_format(old_entries[i].mode);
+			/* the space in the atlas is taken back by a repack */
+			if (old_entries[i].atlas == XCBFT_ATLAS_NONE &&
+					!old_entries[i].borrowed) {
+				if (old_entries[i].offline) {
+					gids[format][old_count - unsent_length[format]++] =
+						old_entries[i].gid;
+				} else {
+					gids[format][gids_length[format]++] =
+						old_entries[i].gid;
+				}
+				cache->glyphsets[format].bytes -= old_entries[i].bytes;
+			}
+			xcbft_glyph_image_release(cache, old_entries[i].image);
+			removed++;
+		} else {
+			xcbft_glyph_cache_put(cache, &old_entries[i]);
+		}
+	}
+	for (format = 0; format < XCBFT_FORMATS; format++) {
+		xcbft_glyphset_free_gids(cache->c, &cache->glyphsets[format],
+			gids[format], gids_length[format]);
+		if (unsent_length[format] > 0) {
+			xcbft_glyphset_release_gids(&cache->glyphsets[format],
+				gids[format] + old_count + 1 - unsent_length[format],
+				unsent_length[format]);
+		}
+		free(gids[format]);
+	}
+
+	free(old_entries);
+	xcbft_memory_shrink(&cache->client_bytes,
+		sizeof(struct xcbft_glyph_entry)*old_size);
+	return removed;
+}
+
+/* the glyphsets are created on first use as the connection isn't known before */
+static xcb_render_glyphset_t
+xcbft_glyph_cache_glyphset(xcb_connection_t *c,
+	struct xcbft_glyph_cache *cache, enum xcbft_glyph_format format)
+{
+	static const xcb_pict_standard_t standard_formats[XCBFT_FORMATS] = {
+		[XCBFT_FORMAT_A8] = XCB_PICT_STANDARD_A_8,
+		[XCBFT_FORMAT_A1] = XCB_PICT_STANDARD_A_1,
+		[XCBFT_FORMAT_LCD] = XCB_PICT_STANDARD_ARGB_32,
+		[XCBFT_FORMAT_COLOR] = XCB_PICT_STANDARD_ARGB_32
+	};
+	xcb_render_pictforminfo_t *fmt;
+	const xcb_render_query_pict_formats_reply_t *fmt_rep;
+	struct xcbft_glyphset *glyphset = &cache->glyphsets[format];
+
+	if (glyphset->id != 0 || c == NULL) {
+		return glyphset->id;
+	}
+
+	fmt_rep = xcb_render_util_query_formats(c);
+	fmt = xcb_render_util_find_standard_format(
+		fmt_rep,
+		standard_formats[format]
+	);
+	cache->c = c;
+	glyphset->id = xcb_generate_id(c);
+	xcb_render_create_glyph_set(c, glyphset->id, fmt->id);
+
+	return glyphset->id;
+}
+
+static uint32_t
+xcbft_raster_cache_slot(const struct xcbft_raster_cache *raster,
+	uint32_t charcode, uint8_t face, uint8_t mode, int32_t size)
+{
+	uint32_t key;
+
+	key = xcbft_glyph_key(charcode, mode) ^ ((uint32_t)face << 24) ^
+		((uint32_t)size * 40503u);
+	/* size is always a power of two */
+	return (key * 2654435761u) & (raster->size - 1);
+}
+
+/* the lock must be held */
+static struct xcbft_raster_entry *
+xcbft_raster_cache_lookup(const struct xcbft_raster_cache *raster,
+	uint32_t charcode, uint8_t face, uint8_t mode, int32_t size)
+{
+	struct xcbft_raster_entry *entry;
+	uint32_t slot;
+
+	if (raster->size == 0) {
+		return NULL;
+	}
+	slot = xcbft_raster_cache_slot(raster, charcode, face, mode, size);
+	for (entry = &raster->entries[slot]; entry->used;
+			entry = &raster->entries[slot]) {
+		if (entry->charcode == charcode && entry->face == face &&
+				entry->mode == mode && entry->size == size) {
+			return entry;
+		}
+		slot = (slot + 1) & (raster->size - 1);
+	}
+	return NULL;
+}
+
+/* the lock must be held, the entry is stored as is */
+static void
+xcbft_raster_cache_put(struct xcbft_raster_cache *raster,
+	const struct xcbft_raster_entry *entry)
+{
+	uint32_t i, slot, old_size;
+	struct xcbft_raster_entry *old_entries;
+
+	/* keep the load under 3/4 */
+	if ((raster->count + 1) * 4 > raster->size * 3) {
+		old_entries = raster->entries;
+		old_size = raster->size;
+		raster->size = old_size ? old_size * 2 : 256;
+		raster->entries = calloc(raster->size,
+			sizeof(struct xcbft_raster_entry));
+		raster->count = 0;
+		for (i = 0; i < old_size; i++) {
+			if (old_entries[i].used) {
+				xcbft_raster_cache_put(raster, &old_entries[i]);
+			}
+		}
+		free(old_entries);
+	}
+
+	slot = xcbft_raster_cache_slot(raster, entry->charcode, entry->face,
+		entry->mode, entry->size);
+	while (raster->entries[slot].used) {
+		slot = (slot + 1) & (raster->size - 1);
+	}
+	raster->entries[slot] = *entry;
+	raster->entries[slot].used = 1;
+	raster->count++;
+}
+
+/* 26.6 pixel size of a face of the cache, part of the raster keys */
+static int32_t
+xcbft_raster_size(const struct xcbft_glyph_cache *cache, uint8_t face)
+{
+	return (int32_t)(cache->infos[face].pixel_size * 64 + 0.5);
+}
+
+/*
+ * Copy a glyph rasterized by a view of the faces for the same size into
+ * glyph, its data is for the caller to free.
+ *
+ * Returns 0 if no view rasterized it yet
+ */
+static int
+xcbft_raster_cache_get(const struct xcbft_glyph_cache *cache,
+	uint32_t charcode, uint8_t face, struct xcbft_glyph_bitmap *glyph)
+{
+	struct xcbft_raster_cache *raster = cache->raster;
+	struct xcbft_raster_entry *entry;
+
+	pthread_mutex_lock(&raster->lock);
+	entry = xcbft_raster_cache_lookup(raster, charcode, face,
+		cache->infos[face].mode, xcbft_raster_size(cache, face));
+	if (entry != NULL) {
+		*glyph = entry->glyph;
+		glyph->data = malloc(entry->glyph.data_len ? entry->glyph.data_len : 1);
+		memcpy(glyph->data, entry->glyph.data, entry->glyph.data_len);
+	}
+	pthread_mutex_unlock(&raster->lock);
+
+	return entry != NULL;
+}
+
+/* keep a copy of the glyphs about to be uploaded for the other views */
+static void
+xcbft_raster_cache_store(const struct xcbft_glyph_cache *cache,
+	struct xcbft_glyph_bitmap **glyphs, unsigned int count)
+{
+	struct xcbft_raster_cache *raster = cache->raster;
+	struct xcbft_raster_entry entry;
+	unsigned int i;
+
+	pthread_mutex_lock(&raster->lock);
+	for (i = 0; i < count; i++) {
+		if (glyphs[i]->face == XCBFT_FACE_FALLBACK) {
+			continue;
+		}
+		memset(&entry, 0, sizeof(entry));
+		entry.charcode = glyphs[i]->charcode;
+		entry.face = glyphs[i]->face;
+		entry.mode = cache->infos[entry.face].mode;
+		entry.size = xcbft_raster_size(cache, entry.face);
+		if (xcbft_raster_cache_lookup(raster, entry.charcode, entry.face,
+				entry.mode, entry.size) != NULL) {
+			continue;
+		}
+		entry.glyph = *glyphs[i];
+		entry.glyph.next = NULL;
+		entry.glyph.data = malloc(glyphs[i]->data_len ?
+			glyphs[i]->data_len : 1);
+		memcpy(entry.glyph.data, glyphs[i]->data, glyphs[i]->data_len);
+		xcbft_raster_cache_put(raster, &entry);
+		xcbft_memory_grow(&raster->bytes,
+			sizeof(struct xcbft_raster_entry) + glyphs[i]->data_len);
+	}
+	pthread_mutex_unlock(&raster->lock);
+}
+
+/* forget the glyphs kept for the views, they rasterize them again */
+static void
+xcbft_raster_cache_clear(struct xcbft_raster_cache *raster)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&raster->lock);
+	for (i = 0; i < raster->size; i++) {
+		if (raster->entries[i].used) {
+			free(raster->entries[i].glyph.data);
+		}
+	}
+	free(raster->entries);
+	raster->entries = NULL;
+	raster->size = raster->count = 0;
+	xcbft_memory_shrink(&raster->bytes, atomic_load(&raster->bytes));
+	pthread_mutex_unlock(&raster->lock);
+}
+
+/* returns the number of face holders still using the faces */
+static unsigned int
+xcbft_raster_cache_unref(struct xcbft_raster_cache *raster)
+{
+	unsigned int i, refs;
+
+	pthread_mutex_lock(&raster->lock);
+	refs = --raster->refs;
+	pthread_mutex_unlock(&raster->lock);
+	if (refs > 0) {
+		return refs;
+	}
+
+	for (i = 0; i < raster->size; i++) {
+		if (raster->entries[i].used) {
+			free(raster->entries[i].glyph.data);
+		}
+	}
+	free(raster->entries);
+	xcbft_memory_shrink(&raster->bytes, atomic_load(&raster->bytes));
+	pthread_mutex_destroy(&raster->lock);
+	free(raster);
+	return 0;
+}
+
+static struct xcbft_metric_cache *
+xcbft_metric_cache_create(void)
+{
+	struct xcbft_metric_cache *metrics;
+	unsigned int i;
+
+	metrics = calloc(1, sizeof(struct xcbft_metric_cache));
+	for (i = 0; i < XCBFT_METRIC_SHARDS; i++) {
+		pthread_rwlock_init(&metrics->shards[i].lock, NULL);
+	}
+	pthread_mutex_init(&metrics->threads_lock, NULL);
+	return metrics;
+}
+
+static struct xcbft_metric_shard *
+xcbft_metric_cache_shard(struct xcbft_metric_cache *metrics,
+	uint32_t charcode)
+{
+	return &metrics->shards[(charcode * 2654435761u) >> 28];
+}
+
+/* the shard must be locked */
+static struct xcbft_metric *
+xcbft_metric_shard_lookup(const struct xcbft_metric_shard *shard,
+	uint32_t charcode)
+{
+	uint32_t slot;
+
+	if (shard->size == 0) {
+		return NULL;
+	}
+	/* the top bits chose the shard, use the others */
+	slot = (charcode * 2246822519u) & (shard->size - 1);
+	while (shard->entries[slot].used) {
+		if (shard->entries[slot].charcode == charcode) {
+			return &shard->entries[slot];
+		}
+		slot = (slot + 1) & (shard->size - 1);
+	}
+	return NULL;
+}
+
+/* the shard, one of those of metrics, must be locked for writing */
+static void
+xcbft_metric_shard_put(struct xcbft_metric_cache *metrics,
+	struct xcbft_metric_shard *shard, const struct xcbft_metric *metric)
+{
+	uint32_t i, slot, old_size;
+	struct xcbft_metric *old_entries;
+
+	/* keep the load under 3/4 */
+	if ((shard->count + 1) * 4 > shard->size * 3) {
+		old_entries = shard->entries;
+		old_size = shard->size;
+		shard->size = old_size ? old_size * 2 : 64;
+		shard->entries = calloc(shard->size, sizeof(struct xcbft_metric));
+		xcbft_memory_grow(&metrics->bytes,
+			sizeof(struct xcbft_metric)*shard->size);
+		shard->count = 0;
+		for (i = 0; i < old_size; i++) {
+			if (old_entries[i].used) {
+				xcbft_metric_shard_put(metrics, shard, &old_entries[i]);
+			}
+		}
+		free(old_entries);
+		xcbft_memory_shrink(&metrics->bytes,
+			sizeof(struct xcbft_metric)*old_size);
+	}
+
+	slot = (metric->charcode * 2246822519u) & (shard->size - 1);
+	while (shard->entries[slot].used) {
+		slot = (slot + 1) & (shard->size - 1);
+	}
+	shard->entries[slot] = *metric;
+	shard->entries[slot].used = 1;
+	shard->count++;
+}
+
+/* forget the advances, measured again when needed */
+static void
+xcbft_metric_cache_clear(struct xcbft_metric_cache *metrics)
+{
+	struct xcbft_metric_shard *shard;
+	unsigned int i;
+
+	for (i = 0; i < XCBFT_METRIC_SHARDS; i++) {
+		shard = &metrics->shards[i];
+		pthread_rwlock_wrlock(&shard->lock);
+		free(shard->entries);
+		xcbft_memory_shrink(&metrics->bytes,
+			sizeof(struct xcbft_metric)*shard->size);
+		shard->entries = NULL;
+		shard->size = shard->count = 0;
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+/* forget the advances of the faces flagged in drop (indexed by face) */
+static void
+xcbft_metric_cache_drop(struct xcbft_metric_cache *metrics,
+	const uint8_t *drop)
+{
+	struct xcbft_metric_shard *shard;
+	struct xcbft_metric *old_entries;
+	uint32_t j, old_size;
+	unsigned int i;
+
+	for (i = 0; i < XCBFT_METRIC_SHARDS; i++) {
+		shard = &metrics->shards[i];
+		pthread_rwlock_wrlock(&shard->lock);
+		old_entries = shard->entries;
+		old_size = shard->size;
+		shard->entries = NULL;
+		shard->size = shard->count = 0;
+		for (j = 0; j < old_size; j++) {
+			if (old_entries[j].used && !drop[old_entries[j].face]) {
+				xcbft_metric_shard_put(metrics, shard, &old_entries[j]);
+			}
+		}
+		free(old_entries);
+		xcbft_memory_shrink(&metrics->bytes,
+			sizeof(struct xcbft_metric)*old_size);
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+static void
+xcbft_metric_cache_destroy(struct xcbft_metric_cache *metrics)
+{
+	struct xcbft_thread_faces *thread, *next;
+	unsigned int i;
+
+	for (i = 0; i < XCBFT_METRIC_SHARDS; i++) {
+		pthread_rwlock_destroy(&metrics->shards[i].lock);
+		free(metrics->shards[i].entries);
+	}
+	xcbft_memory_shrink(&metrics->bytes, atomic_load(&metrics->bytes));
+	for (thread = metrics->threads; thread != NULL; thread = next) {
+		next = thread->next;
+		if (thread->faces.cache != NULL) {
+			xcbft_face_holder_destroy(thread->faces);
+		}
+		free(thread);
+	}
+	pthread_mutex_destroy(&metrics->threads_lock);
+	free(metrics);
+}
+
+/* a thread exits, keep what it counted */
+static void
+xcbft_counters_exit(void *arg)
+{
+	struct xcbft_counters *counters = arg, **link;
+	unsigned int i;
+
+	pthread_mutex_lock(&xcbft_counters_lock);
+	for (i = 0; i < XCBFT_COUNTERS; i++) {
+		xcbft_counters_exited[i] += atomic_load_explicit(
+			&counters->values[i], memory_order_relaxed);
+	}
+	for (link = &xcbft_counters_threads; *link != counters;
+			link = &(*link)->next);
+	*link = counters->next;
+	pthread_mutex_unlock(&xcbft_counters_lock);
+	free(counters);
+}
+
+static void
+xcbft_counters_init(void)
+{
+	pthread_key_create(&xcbft_counters_key, xcbft_counters_exit);
+}
+
+/* add n to a counter of the calling thread */
+static void
+xcbft_count(enum xcbft_counter counter, uint64_t n)
+{
+	struct xcbft_counters *counters;
+
+	pthread_once(&xcbft_counters_once, xcbft_counters_init);
+	counters = pthread_getspecific(xcbft_counters_key);
+	if (counters == NULL) {
+		counters = calloc(1, sizeof(struct xcbft_counters));
+		pthread_mutex_lock(&xcbft_counters_lock);
+		counters->next = xcbft_counters_threads;
+		xcbft_counters_threads = counters;
+		pthread_mutex_unlock(&xcbft_counters_lock);
+		pthread_setspecific(xcbft_counters_key, counters);
+	}
+	atomic_store_explicit(&counters->values[counter],
+		atomic_load_explicit(&counters->values[counter],
+			memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+#ifdef XCBFT_TRACE
+static uint64_t
+xcbft_trace_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+/* the thread exits, its events stay until they're cleared */
+static void
+xcbft_trace_exit(void *arg)
+{
+	struct xcbft_trace_buffer *buffer = arg;
+
+	pthread_mutex_lock(&buffer->lock);
+	buffer->exited = 1;
+	pthread_mutex_unlock(&buffer->lock);
+}
+
+static void
+xcbft_trace_init(void)
+{
+	pthread_key_create(&xcbft_trace_key, xcbft_trace_exit);
+}
+
+/* record the scope name of the calling thread that began at start */
+static void
+xcbft_trace_event(const char *name, uint64_t start)
+{
+	struct xcbft_trace_buffer *buffer;
+	struct xcbft_trace_event *events;
+	uint64_t end = xcbft_trace_now();
+	unsigned int allocated;
+
+	pthread_once(&xcbft_trace_once, xcbft_trace_init);
+	buffer = pthread_getspecific(xcbft_trace_key);
+	if (buffer == NULL) {
+		buffer = calloc(1, sizeof(struct xcbft_trace_buffer));
+		if (buffer == NULL) {
+			return;
+		}
+		pthread_mutex_init(&buffer->lock, NULL);
+		pthread_mutex_lock(&xcbft_trace_lock);
+		buffer->tid = ++xcbft_trace_tids;
+		buffer->next = xcbft_trace_buffers;
+		xcbft_trace_buffers = buffer;
+		pthread_mutex_unlock(&xcbft_trace_lock);
+		pthread_setspecific(xcbft_trace_key, buffer);
+	}
+
+	pthread_mutex_lock(&buffer->lock);
+	if (buffer->length == buffer->allocated) {
+		allocated = buffer->allocated ? buffer->allocated*2 : 256;
+		if (buffer->allocated == XCBFT_TRACE_EVENTS ||
+				(events = realloc(buffer->events,
+				allocated*sizeof(struct xcbft_trace_event))) == NULL) {
+			pthread_mutex_unlock(&buffer->lock);
+			return;
+		}
+		buffer->events = events;
+		buffer->allocated = allocated;
+	}
+	buffer->events[buffer->length].name = name;
+	buffer->events[buffer->length].start = start;
+	buffer->events[buffer->length].duration = end - start;
+	buffer->length++;
+	pthread_mutex_unlock(&buffer->lock);
+}
+#endif
+
+/* send the queued requests, timed as flushes */
+static void
+xcbft_flush(xcb_connection_t *c)
+{
+	if (c == NULL) {
+		return;
+	}
+	XCBFT_TRACE_BEGIN(flushing);
+	xcb_flush(c);
+	XCBFT_TRACE_END("xcb_flush", flushing);
+}
+
+/*
+ * Scripts of the common blocks, sorted. Characters outside of them are
+ * XCBFT_SCRIPT_UNKNOWN.
+ */
+static const struct xcbft_script_range xcbft_scripts[] = {
+	{ 0x0000, 0x0040, XCBFT_SCRIPT_COMMON },
+	{ 0x0041, 0x005a, XCBFT_SCRIPT_LATIN },
+	{ 0x005b, 0x0060, XCBFT_SCRIPT_COMMON },
+	{ 0x0061, 0x007a, XCBFT_SCRIPT_LATIN },
+	{ 0x007b, 0x00bf, XCBFT_SCRIPT_COMMON },
+	{ 0x00c0, 0x00d6, XCBFT_SCRIPT_LATIN },
+	{ 0x00d7, 0x00d7, XCBFT_SCRIPT_COMMON },
+	{ 0x00d8, 0x00f6, XCBFT_SCRIPT_LATIN },
+	{ 0x00f7, 0x00f7, XCBFT_SCRIPT_COMMON },
+	{ 0x00f8, 0x02af, XCBFT_SCRIPT_LATIN },
+	{ 0x02b0, 0x02ff, XCBFT_SCRIPT_COMMON },
+	{ 0x0300, 0x036f, XCBFT_SCRIPT_INHERITED },
+	{ 0x0370, 0x03ff, XCBFT_SCRIPT_GREEK },
+	{ 0x0400, 0x052f, XCBFT_SCRIPT_CYRILLIC },
+	{ 0x0530, 0x058f, XCBFT_SCRIPT_ARMENIAN },
+	{ 0x0590, 0x05ff, XCBFT_SCRIPT_HEBREW },
+	{ 0x0600, 0x06ff, XCBFT_SCRIPT_ARABIC },
+	{ 0x0750, 0x077f, XCBFT_SCRIPT_ARABIC },
+	{ 0x0900, 0x097f, XCBFT_SCRIPT_DEVANAGARI },
+	{ 0x0980, 0x09ff, XCBFT_SCRIPT_BENGALI },
+	{ 0x0b80, 0x0bff, XCBFT_SCRIPT_TAMIL },
+	{ 0x0e00, 0x0e7f, XCBFT_SCRIPT_THAI },
+	{ 0x0f00, 0x0fff, XCBFT_SCRIPT_TIBETAN },
+	{ 0x10a0, 0x10ff, XCBFT_SCRIPT_GEORGIAN },
+	{ 0x1100, 0x11ff, XCBFT_SCRIPT_HANGUL },
+	{ 0x1e00, 0x1eff, XCBFT_SCRIPT_LATIN },
+	{ 0x1f00, 0x1fff, XCBFT_SCRIPT_GREEK },
+	{ 0x2000, 0x200b, XCBFT_SCRIPT_COMMON },
+	{ 0x200c, 0x200d, XCBFT_SCRIPT_INHERITED },
+	{ 0x200e, 0x20cf, XCBFT_SCRIPT_COMMON },
+	{ 0x20d0, 0x20ff, XCBFT_SCRIPT_INHERITED },
+	{ 0x2100, 0x2bff, XCBFT_SCRIPT_COMMON },
+	{ 0x2c60, 0x2c7f, XCBFT_SCRIPT_LATIN },
+	{ 0x2e80, 0x2fdf, XCBFT_SCRIPT_HAN },
+	{ 0x3000, 0x3040, XCBFT_SCRIPT_COMMON },
+	{ 0x3041, 0x309f, XCBFT_SCRIPT_HIRAGANA },
+	{ 0x30a0, 0x30ff, XCBFT_SCRIPT_KATAKANA },
+	{ 0x3130, 0x318f, XCBFT_SCRIPT_HANGUL },
+	{ 0x3400, 0x4dbf, XCBFT_SCRIPT_HAN },
+	{ 0x4e00, 0x9fff, XCBFT_SCRIPT_HAN },
+	{ 0xa720, 0xa7ff, XCBFT_SCRIPT_LATIN },
+	{ 0xac00, 0xd7af, XCBFT_SCRIPT_HANGUL },
+	{ 0xf900, 0xfaff, XCBFT_SCRIPT_HAN },
+	{ 0xfb1d, 0xfb4f, XCBFT_SCRIPT_HEBREW },
+	{ 0xfb50, 0xfdff, XCBFT_SCRIPT_ARABIC },
+	{ 0xfe00, 0xfe0f, XCBFT_SCRIPT_INHERITED },
+	{ 0xfe20, 0xfe2f, XCBFT_SCRIPT_INHERITED },
+	{ 0xfe30, 0xfe4f, XCBFT_SCRIPT_COMMON },
+	{ 0xfe70, 0xfefe, XCBFT_SCRIPT_ARABIC },
+	{ 0xff01, 0xff20, XCBFT_SCRIPT_COMMON },
+	{ 0xff21, 0xff3a, XCBFT_SCRIPT_LATIN },
+	{ 0xff3b, 0xff40, XCBFT_SCRIPT_COMMON },
+	{ 0xff41, 0xff5a, XCBFT_SCRIPT_LATIN },
+	{ 0xff5b, 0xff65, XCBFT_SCRIPT_COMMON },
+	{ 0xff66, 0xff9f, XCBFT_SCRIPT_KATAKANA },
+	{ 0x1f000, 0x1faff, XCBFT_SCRIPT_COMMON },
+	{ 0x20000, 0x3134f, XCBFT_SCRIPT_HAN },
+	{ 0xe0100, 0xe01ef, XCBFT_SCRIPT_INHERITED },
+};
+
+static enum xcbft_script
+xcbft_char_script(uint32_t charcode)
+{
+	unsigned int low, high, middle;
+
+	low = 0;
+	high = sizeof(xcbft_scripts) / sizeof(xcbft_scripts[0]);
+	while (low < high) {
+		middle = (low + high) / 2;
+		if (charcode < xcbft_scripts[middle].first) {
+			high = middle;
+		} else if (charcode > xcbft_scripts[middle].last) {
+			low = middle + 1;
+		} else {
+			return xcbft_scripts[middle].script;
+		}
+	}
+	return XCBFT_SCRIPT_UNKNOWN;
+}
+
+/* common and inherited characters take the script of their run */
+static int
+xcbft_script_is_real(enum xcbft_script script)
+{
+	return script != XCBFT_SCRIPT_COMMON &&
+		script != XCBFT_SCRIPT_INHERITED;
+}
+
+static struct xcbft_run_cache *
+xcbft_run_cache_create(void)
+{
+	struct xcbft_run_cache *runs;
+
+	runs = calloc(1, sizeof(struct xcbft_run_cache));
+	pthread_mutex_init(&runs->lock, NULL);
+	return runs;
+}
+
+/* bytes of a text and its runs in the run cache */
+static size_t
+xcbft_itemized_size(const struct xcbft_itemized *slot)
+{
+	return sizeof(FcChar32)*slot->length +
+		sizeof(struct xcbft_font_run)*slot->runs_length;
+}
+
+/* forget every text, after the faces changed or over the memory budget */
+static void
+xcbft_run_cache_clear(struct xcbft_run_cache *runs)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&runs->lock);
+	for (i = 0; i < XCBFT_RUN_CACHE_SLOTS; i++) {
+		if (runs->slots[i].text != NULL) {
+			xcbft_memory_shrink(&runs->bytes,
+				xcbft_itemized_size(&runs->slots[i]));
+		}
+		free(runs->slots[i].text);
+		free(runs->slots[i].runs);
+		memset(&runs->slots[i], 0, sizeof(struct xcbft_itemized));
+	}
+	pthread_mutex_unlock(&runs->lock);
+}
+
+static void
+xcbft_run_cache_destroy(struct xcbft_run_cache *runs)
+{
+	xcbft_run_cache_clear(runs);
+	pthread_mutex_destroy(&runs->lock);
+	free(runs);
+}
+
+/* FNV-1a of the characters */
+static uint64_t
+xcbft_text_hash(struct utf_holder text)
+{
+	uint64_t hash = 14695981039346656037ull;
+	unsigned int i;
+
+	for (i = 0; i < text.length; i++) {
+		hash = (hash ^ text.str[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+/*
+ * Split text in runs of characters of the same script that are found in
+ * the same face, the first of faces that has them, XCBFT_FACE_FALLBACK
+ * if none. Common characters (spaces, punctuation, digits) and marks stay
+ * in the run they are in. The runs of a text are cached, the faces are
+ * only asked for the coverage of new texts: faces can be the holder's or
+ * a copy of them, with the same fonts.
+ *
+ * Returns the runs, to free, and their number in runs_length
+ */
+static struct xcbft_font_run *
+xcbft_itemize_faces(struct xcbft_run_cache *cache, FT_Face *faces,
+	uint8_t faces_length, struct utf_holder text,
+	unsigned int *runs_length)
+{
+	struct xcbft_itemized *slot;
+	struct xcbft_font_run *runs, *run;
+	enum xcbft_script script;
+	uint64_t hash;
+	unsigned int i, length;
+	uint8_t face;
+
+	hash = xcbft_text_hash(text);
+	slot = &cache->slots[hash & (XCBFT_RUN_CACHE_SLOTS - 1)];
+	pthread_mutex_lock(&cache->lock);
+	if (slot->text != NULL && slot->hash == hash &&
+			slot->length == text.length &&
+			memcmp(slot->text, text.str,
+				sizeof(FcChar32) * text.length) == 0) {
+		length = slot->runs_length;
+		runs = malloc(sizeof(struct xcbft_font_run) * (length ? length : 1));
+		memcpy(runs, slot->runs, sizeof(struct xcbft_font_run) * length);
+		pthread_mutex_unlock(&cache->lock);
+		*runs_length = length;
+		return runs;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	/* at most one run per character */
+	runs = malloc(sizeof(struct xcbft_font_run) *
+		(text.length ? text.length : 1));
+	run = NULL;
+	length = 0;
+	for (i = 0; i < text.length; i++) {
+		for (face = 0; face < faces_length; face++) {
+			if (FT_Get_Char_Index(faces[face], text.str[i]) != 0) {
+				break;
+			}
+		}
+		if (face == faces_length) {
+			face = XCBFT_FACE_FALLBACK;
+		}
+		script = xcbft_char_script(text.str[i]);
+
+		if (run != NULL && run->face == face &&
+				(!xcbft_script_is_real(script) ||
+				!xcbft_script_is_real(run->script) ||
+				run->script == script)) {
+			/* the run gets the script of its first real character */
+			if (!xcbft_script_is_real(run->script)) {
+				run->script = script;
+			}
+			run->length++;
+			continue;
+		}
+		/* a common character out of the face keeps the script around */
+		if (run != NULL && !xcbft_script_is_real(script)) {
+			script = run->script;
+		}
+		run = &runs[length++];
+		run->start = i;
+		run->length = 1;
+		run->face = face;
+		run->script = script;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	if (slot->text != NULL) {
+		xcbft_memory_shrink(&cache->bytes, xcbft_itemized_size(slot));
+	}
+	free(slot->text);
+	free(slot->runs);
+	slot->hash = hash;
+	slot->length = text.length;
+	slot->text = malloc(sizeof(FcChar32) * (text.length ? text.length : 1));
+	memcpy(slot->text, text.str, sizeof(FcChar32) * text.length);
+	slot->runs_length = length;
+	slot->runs = malloc(sizeof(struct xcbft_font_run) * (length ? length : 1));
+	memcpy(slot->runs, runs, sizeof(struct xcbft_font_run) * length);
+	xcbft_memory_grow(&cache->bytes, xcbft_itemized_size(slot));
+	pthread_mutex_unlock(&cache->lock);
+
+	*runs_length = length;
+	return runs;
+}
+
+static struct xcbft_async_query *xcbft_async_query_start(
+	struct xcbft_async_query *);
+
+static struct xcbft_fallbacks *
+xcbft_fallbacks_create(void)
+{
+	struct xcbft_fallbacks *fallbacks;
+
+	fallbacks = calloc(1, sizeof(struct xcbft_fallbacks));
+	pthread_mutex_init(&fallbacks->lock, NULL);
+	fallbacks->fd = -1;
+	fallbacks->missing = FcCharSetCreate();
+	return fallbacks;
+}
+
+/* take the lookups that finished, fallbacks must be locked */
+static void
+xcbft_fallbacks_collect(struct xcbft_fallbacks *fallbacks)
+{
+	struct xcbft_fallback_lookup **link, *lookup;
+	struct xcbft_face_holder faces;
+
+	link = &fallbacks->lookups;
+	while ((lookup = *link) != NULL) {
+		if (!xcbft_async_query_done(lookup->query)) {
+			link = &lookup->next;
+			continue;
+		}
+		/* done, doesn't wait */
+		faces = xcbft_async_query_finish(lookup->query);
+		if (faces.length > 0) {
+			fallbacks->found = realloc(fallbacks->found,
+				sizeof(struct xcbft_face_holder)*
+				(fallbacks->found_length + 1));
+			fallbacks->found[fallbacks->found_length++] = faces;
+		} else {
+			fprintf(stderr,
+				"No faces found supporting character: %02x\n",
+				lookup->charcode);
+			FcCharSetAddChar(fallbacks->missing, lookup->charcode);
+			if (faces.cache != NULL) {
+				xcbft_face_holder_destroy(faces);
+			}
+		}
+		*link = lookup->next;
+		free(lookup);
+		fallbacks->finished++;
+	}
+}
+
+/*
+ * The fallback font found for a character, fallbacks must be locked.
+ * If there is none yet a lookup is started, waiting is set while one
+ * is running for it.
+ *
+ * Returns NULL if there is no font for it, yet or at all
+ */
+static struct xcbft_face_holder *
+xcbft_fallbacks_find(struct xcbft_fallbacks *fallbacks, uint32_t charcode,
+	long dpi, uint8_t *waiting)
+{
+	struct xcbft_fallback_lookup *lookup;
+	struct xcbft_async_query *query;
+	unsigned int i;
+
+	*waiting = 0;
+	xcbft_fallbacks_collect(fallbacks);
+	for (i = 0; i < fallbacks->found_length; i++) {
+		if (FT_Get_Char_Index(fallbacks->found[i].faces[0], charcode) != 0) {
+			return &fallbacks->found[i];
+		}
+	}
+	if (FcCharSetHasChar(fallbacks->missing, charcode)) {
+		return NULL;
+	}
+	for (lookup = fallbacks->lookups; lookup != NULL; lookup = lookup->next) {
+		if (lookup->charcode == charcode) {
+			*waiting = 1;
+			return NULL;
+		}
+	}
+
+	if (fallbacks->fd < 0) {
+		fallbacks->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	}
+	query = calloc(1, sizeof(struct xcbft_async_query));
+	query->dpi = dpi;
+	query->character = charcode;
+	query->notify_fd = fallbacks->fd;
+	query = xcbft_async_query_start(query);
+	if (query == NULL) {
+		return NULL;
+	}
+	lookup = malloc(sizeof(struct xcbft_fallback_lookup));
+	lookup->charcode = charcode;
+	lookup->query = query;
+	lookup->next = fallbacks->lookups;
+	fallbacks->lookups = lookup;
+	*waiting = 1;
+	return NULL;
+}
+
+/*
+ * Flag the stand-ins of the characters whose lookup finished since the
+ * last time, to be dropped when a font was found. Called from the thread
+ * loading the glyphs.
+ *
+ * Returns 1 if some are to be dropped
+ */
+static int
+xcbft_fallbacks_replace(struct xcbft_glyph_cache *cache)
+{
+	struct xcbft_fallbacks *fallbacks = cache->fallbacks;
+	struct xcbft_glyph_entry *entry;
+	uint64_t value;
+	uint32_t i;
+	unsigned int j;
+	int found;
+
+	found = 0;
+	pthread_mutex_lock(&fallbacks->lock);
+	/* the drawing thread was told, it's drawing */
+	if (fallbacks->fd >= 0 &&
+			read(fallbacks->fd, &value, sizeof(value)) < 0 &&
+			errno != EAGAIN) {
+		perror(NULL);
+	}
+	xcbft_fallbacks_collect(fallbacks);
+	if (fallbacks->finished == fallbacks->replaced) {
+		pthread_mutex_unlock(&fallbacks->lock);
+		return 0;
+	}
+	fallbacks->replaced = fallbacks->finished;
+	for (i = 0; i < cache->size; i++) {
+		entry = &cache->entries[i];
+		if (!entry->used || entry->fallback != XCBFT_FALLBACK_WAITING) {
+			continue;
+		}
+		for (j = 0; j < fallbacks->found_length; j++) {
+			if (FT_Get_Char_Index(fallbacks->found[j].faces[0],
+					entry->charcode) != 0) {
+				entry->fallback = XCBFT_FALLBACK_FOUND;
+				found = 1;
+				break;
+			}
+		}
+		/* no font has it, the stand-in stays */
+		if (entry->fallback == XCBFT_FALLBACK_WAITING &&
+				FcCharSetHasChar(fallbacks->missing, entry->charcode)) {
+			entry->fallback = XCBFT_FALLBACK_NONE;
+		}
+	}
+	pthread_mutex_unlock(&fallbacks->lock);
+	return found;
+}
+
+/* forget the fonts found, the new configuration may have better ones */
+static void
+xcbft_fallbacks_clear(struct xcbft_fallbacks *fallbacks)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&fallbacks->lock);
+	for (i = 0; i < fallbacks->found_length; i++) {
+		xcbft_face_holder_destroy(fallbacks->found[i]);
+	}
+	free(fallbacks->found);
+	fallbacks->found = NULL;
+	fallbacks->found_length = 0;
+	FcCharSetDestroy(fallbacks->missing);
+	fallbacks->missing = FcCharSetCreate();
+	pthread_mutex_unlock(&fallbacks->lock);
+}
+
+/* the lookups still running are left to finish on their own */
+static void
+xcbft_fallbacks_destroy(struct xcbft_fallbacks *fallbacks)
+{
+	struct xcbft_fallback_lookup *lookup, *next;
+
+	for (lookup = fallbacks->lookups; lookup != NULL; lookup = next) {
+		next = lookup->next;
+		xcbft_async_query_cancel(lookup->query);
+		free(lookup);
+	}
+	fallbacks->lookups = NULL;
+	xcbft_fallbacks_clear(fallbacks);
+	FcCharSetDestroy(fallbacks->missing);
+	if (fallbacks->fd >= 0) {
+		close(fallbacks->fd);
+	}
+	pthread_mutex_destroy(&fallbacks->lock);
+	free(fallbacks);
+}
+
+static void xcbft_raster_pool_destroy(struct xcbft_raster_pool *);
+static void xcbft_atlas_destroy(struct xcbft_atlas *);
+
+static void
+xcbft_glyph_cache_destroy(struct xcbft_glyph_cache *cache)
+{
+	enum xcbft_glyph_format format;
+	uint32_t i;
+
+	if (cache->pool != NULL) {
+		xcbft_raster_pool_destroy(cache->pool);
+	}
+	if (cache->atlas != NULL) {
+		xcbft_atlas_destroy(cache->atlas);
+	}
+	if (cache->metrics != NULL) {
+		xcbft_metric_cache_destroy(cache->metrics);
+	}
+	if (cache->fallbacks != NULL) {
+		xcbft_fallbacks_destroy(cache->fallbacks);
+	}
+	if (cache->runs != NULL) {
+		xcbft_run_cache_destroy(cache->runs);
+	}
+	for (i = 0; i < cache->size; i++) {
+		if (cache->entries[i].used) {
+			xcbft_glyph_image_release(cache, cache->entries[i].image);
+		}
+	}
+	xcbft_memory_shrink(&cache->client_bytes,
+		sizeof(struct xcbft_glyph_entry)*cache->size);
+	for (format = 0; format < XCBFT_FORMATS; format++) {
+		if (cache->glyphsets[format].id != 0) {
+			xcb_render_free_glyph_set(cache->c, cache->glyphsets[format].id);
+		}
+		free(cache->glyphsets[format].free_gids);
+	}
+	free(cache->entries);
+	for (i = 0; i < cache->borrowed_length; i++) {
+		xcb_render_free_glyph_set(cache->c, cache->borrowed[i]);
+	}
+	free(cache->modes);
+	free(cache->infos);
+	free(cache->borrowed);
+	free(cache->published);
+	free(cache->sizes);
+	free(cache->owns_sizes);
+	free(cache);
+}
+
+/* returns 0 if the file of the pattern can't be reached */
+static int
+xcbft_file_stamp_get(FcPattern *pattern, struct xcbft_file_stamp *stamp)
+{
+	FcValue fc_file;
+	struct stat st;
+
+	memset(stamp, 0, sizeof(struct xcbft_file_stamp));
+	if (FcPatternGet(pattern, FC_FILE, 0, &fc_file) != FcResultMatch ||
+			stat((const char *)fc_file.u.s, &st) != 0) {
+		return 0;
+	}
+	stamp->dev = st.st_dev;
+	stamp->ino = st.st_ino;
+	stamp->size = st.st_size;
+	stamp->mtime = st.st_mtime;
+	return 1;
+}
+
+/*
+ * Turn a subpixel bitmap (three samples per pixel, side by side or on
+ * three rows) into ARGB32 where each channel is the coverage of its
+ * subpixel, used as component alpha by the server.
+ */
+static void
+xcbft_lcd_to_argb(const FT_Bitmap *bitmap, uint8_t mode,
+	struct xcbft_glyph_bitmap *glyph)
+{
+	int x, y, vertical, bgr;
+	const uint8_t *sample;
+	uint32_t r, g, b, *pixel;
+
+	vertical = bitmap->pixel_mode == FT_PIXEL_MODE_LCD_V;
+	bgr = (mode & XCBFT_SUBPIXEL_MASK) == XCBFT_SUBPIXEL_BGR ||
+		(mode & XCBFT_SUBPIXEL_MASK) == XCBFT_SUBPIXEL_VBGR;
+
+	glyph->info.width = vertical ? bitmap->width : bitmap->width/3;
+	glyph->info.height = vertical ? bitmap->rows/3 : bitmap->rows;
+	glyph->data_len = 4*glyph->info.width*glyph->info.height;
+	glyph->data = calloc(sizeof(uint8_t), glyph->data_len ? glyph->data_len : 1);
+
+	for (y = 0; y < glyph->info.height; y++) {
+		pixel = (uint32_t *)glyph->data + y*glyph->info.width;
+		for (x = 0; x < glyph->info.width; x++) {
+			if (vertical) {
+				sample = bitmap->buffer + 3*y*bitmap->pitch + x;
+				r = sample[0];
+				g = sample[bitmap->pitch];
+				b = sample[2*bitmap->pitch];
+			} else {
+				sample = bitmap->buffer + y*bitmap->pitch + 3*x;
+				r = sample[0];
+				g = sample[1];
+				b = sample[2];
+			}
+			if (bgr) {
+				uint32_t t = r; r = b; b = t;
+			}
+			/* green as alpha, for operators not using component alpha */
+			pixel[x] = g << 24 | r << 16 | g << 8 | b;
+		}
+	}
+}
+
+/*
+ * Copy a bitmap as 1 bit per pixel, most significant bit first, with
+ * the rows padded to 32 bits. Gray bitmaps (embedded ones) are cut at
+ * half coverage.
+ */
+static void
+xcbft_bitmap_to_a1(const FT_Bitmap *bitmap, struct xcbft_glyph_bitmap *glyph)
+{
+	int x, y, stride;
+	const uint8_t *row;
+	uint8_t *out;
+
+	stride = ((glyph->info.width+31)/32)*4;
+	glyph->data_len = stride*glyph->info.height;
+	glyph->data = calloc(sizeof(uint8_t), glyph->data_len ? glyph->data_len : 1);
+
+	for (y = 0; y < glyph->info.height; y++) {
+		row = bitmap->buffer+y*bitmap->pitch;
+		out = glyph->data+y*stride;
+		if (bitmap->pixel_mode == FT_PIXEL_MODE_MONO) {
+			memcpy(out, row, (glyph->info.width+7)/8);
+			continue;
+		}
+		for (x = 0; x < glyph->info.width; x++) {
+			if (row[x] >= 0x80) {
+				out[x >> 3] |= 0x80 >> (x & 7);
+			}
+		}
+	}
+}
+
+/*
+ * Shrink a premultiplied ARGB32 image averaging the source pixels
+ * covered by each destination pixel (box filter)
+ */
+static void
+xcbft_downscale_argb(const uint32_t *src, int src_width, int src_height,
+	int src_pitch, uint32_t *dst, int dst_width, int dst_height)
+{
+	int x, y, sx, sy, sx0, sx1, sy0, sy1;
+	uint32_t a, r, g, b, n, pixel;
+
+	for (y = 0; y < dst_height; y++) {
+		sy0 = y*src_height/dst_height;
+		sy1 = (y+1)*src_height/dst_height;
+		if (sy1 <= sy0) sy1 = sy0+1;
+		for (x = 0; x < dst_width; x++) {
+			sx0 = x*src_width/dst_width;
+			sx1 = (x+1)*src_width/dst_width;
+			if (sx1 <= sx0) sx1 = sx0+1;
+			a = r = g = b = 0;
+			for (sy = sy0; sy < sy1; sy++) {
+				for (sx = sx0; sx < sx1; sx++) {
+					pixel = src[sy*src_pitch+sx];
+					a += pixel >> 24;
+					r += (pixel >> 16) & 0xff;
+					g += (pixel >> 8) & 0xff;
+					b += pixel & 0xff;
+				}
+			}
+			n = (sy1-sy0)*(sx1-sx0);
+			dst[y*dst_width+x] = (a/n) << 24 | (r/n) << 16 |
+				(g/n) << 8 | (b/n);
+		}
+	}
+}
+
+/*
+ * Store a color bitmap (BGRA, already premultiplied by freetype) as
+ * ARGB32, scaled from the strike of the face to the wanted size once
+ * here so it's never scaled again when drawn
+ */
+static void
+xcbft_color_to_argb(const FT_GlyphSlot slot, double scale,
+	struct xcbft_glyph_bitmap *glyph)
+{
+	int x, y, width, height;
+	const FT_Bitmap *bitmap = &slot->bitmap;
+	const uint8_t *bgra;
+	uint32_t *pixels;
+
+	width = bitmap->width;
+	height = bitmap->rows;
+	pixels = malloc(sizeof(uint32_t)*width*height + 1);
+	for (y = 0; y < height; y++) {
+		/* B, G, R, A bytes to ARGB32 words, whatever the host order */
+		bgra = bitmap->buffer + y*bitmap->pitch;
+		for (x = 0; x < width; x++, bgra += 4) {
+			pixels[y*width + x] = (uint32_t)bgra[3] << 24 |
+				(uint32_t)bgra[2] << 16 | (uint32_t)bgra[1] << 8 |
+				bgra[0];
+		}
+	}
+
+	if (scale < 1.0) {
+		glyph->info.width = width*scale + 0.5;
+		glyph->info.height = height*scale + 0.5;
+		if (glyph->info.width == 0 && width > 0) glyph->info.width = 1;
+		if (glyph->info.height == 0 && height > 0) glyph->info.height = 1;
+		glyph->info.x = lround(-slot->bitmap_left*scale);
+		glyph->info.y = lround(slot->bitmap_top*scale);
+		glyph->info.x_off = lround(slot->advance.x/64.0*scale);
+		glyph->info.y_off = lround(slot->advance.y/64.0*scale);
+	}
+
+	glyph->data_len = 4*glyph->info.width*glyph->info.height;
+	glyph->data = calloc(sizeof(uint8_t), glyph->data_len ? glyph->data_len : 1);
+	if (glyph->info.width == width && glyph->info.height == height) {
+		memcpy(glyph->data, pixels, glyph->data_len);
+	} else {
+		xcbft_downscale_argb(pixels, width, height, width,
+			(uint32_t *)glyph->data, glyph->info.width, glyph->info.height);
+	}
+	free(pixels);
+}
+
+/* the same coverage on every channel */
+static void
+xcbft_gray_to_argb(struct xcbft_glyph_bitmap *glyph, int stride)
+{
+	int x, y;
+	uint8_t *gray;
+	uint32_t a, *pixel;
+
+	gray = glyph->data;
+	glyph->data_len = 4*glyph->info.width*glyph->info.height;
+	glyph->data = calloc(sizeof(uint8_t), glyph->data_len ? glyph->data_len : 1);
+	for (y = 0; y < glyph->info.height; y++) {
+		pixel = (uint32_t *)glyph->data + y*glyph->info.width;
+		for (x = 0; x < glyph->info.width; x++) {
+			a = gray[y*stride+x];
+			pixel[x] = a << 24 | a << 16 | a << 8 | a;
+		}
+	}
+	free(gray);
+}
+
+/*
+ * Copy the glyph rendered in the slot in the layout expected by
+ * AddGlyphs (rows padded to 4 bytes)
+ */
+static void
+xcbft_stage_bitmap(FT_GlyphSlot slot, const struct xcbft_face_info *info,
+	struct xcbft_glyph_bitmap *glyph)
+{
+	FT_Bitmap *bitmap = &slot->bitmap;
+	int stride, x, y;
+	uint8_t *row;
+
+	if (bitmap->pixel_mode == FT_PIXEL_MODE_BGRA) {
+		/* in the color glyphset, whatever the face renders otherwise */
+		glyph->mode = (info->mode & XCBFT_HINT_MASK) | XCBFT_RENDER_COLOR;
+		xcbft_color_to_argb(slot, info->scale, glyph);
+		return;
+	}
+	if (bitmap->pixel_mode == FT_PIXEL_MODE_LCD ||
+			bitmap->pixel_mode == FT_PIXEL_MODE_LCD_V) {
+		xcbft_lcd_to_argb(bitmap, info->mode, glyph);
+		return;
+	}
+	if ((info->mode & XCBFT_RENDER_MASK) == XCBFT_RENDER_MONO) {
+		xcbft_bitmap_to_a1(bitmap, glyph);
+		return;
+	}
+	stride = (glyph->info.width+3)&~3;
+	glyph->data_len = stride*glyph->info.height;
+	glyph->data = calloc(sizeof(uint8_t), glyph->data_len ? glyph->data_len : 1);
+
+	for (y = 0; y < glyph->info.height; y++) {
+		row = bitmap->buffer+y*bitmap->pitch;
+		if (bitmap->pixel_mode == FT_PIXEL_MODE_MONO) {
+			/* one bit per pixel, most significant first */
+			for (x = 0; x < glyph->info.width; x++) {
+				if (row[x >> 3] & (0x80 >> (x & 7))) {
+					glyph->data[y*stride+x] = 0xff;
+				}
+			}
+		} else {
+			memcpy(glyph->data+y*stride, row, glyph->info.width);
+		}
+	}
+
+	if ((info->mode & XCBFT_RENDER_MASK) == XCBFT_RENDER_LCD) {
+		/* embedded bitmaps aren't subpixel but go in the ARGB glyphset */
+		xcbft_gray_to_argb(glyph, stride);
+	}
+}
+
+/*
+ * Render a glyph with freetype, with the flags of the face, and stage it
+ * for AddGlyphs.
+ *
+ * Returns 0 if the glyph could not be loaded
+ */
+static int
+xcbft_rasterize_glyph(FT_Face face, uint32_t charcode,
+	const struct xcbft_face_info *info, struct xcbft_glyph_bitmap *glyph)
+{
+	int glyph_index;
+	FT_Error error;
+
+	glyph_index = FT_Get_Char_Index(face, charcode);
+
+	if ((info->mode & XCBFT_RENDER_MASK) == XCBFT_RENDER_LCD) {
+		/* the filter is per library, each worker has its own */
+		FT_Library_SetLcdFilter(face->glyph->library, info->lcd_filter);
+	}
+
+	XCBFT_TRACE_BEGIN(loading);
+	error = FT_Load_Glyph(face, glyph_index,
+		info->load_flags | FT_LOAD_RENDER);
+	XCBFT_TRACE_END("FT_Load_Glyph", loading);
+	if (error != FT_Err_Ok) {
+		return 0;
+	}
+	xcbft_count(XCBFT_COUNT_GLYPHS_RASTERIZED, 1);
+
+	glyph->charcode = charcode;
+	glyph->mode = info->mode;
+	glyph->info.x = -face->glyph->bitmap_left;
+	glyph->info.y = face->glyph->bitmap_top;
+	glyph->info.width = face->glyph->bitmap.width;
+	glyph->info.height = face->glyph->bitmap.rows;
+	glyph->info.x_off = face->glyph->advance.x/64;
+	glyph->info.y_off = face->glyph->advance.y/64;
+	glyph->next = NULL;
+
+	XCBFT_TRACE_BEGIN(staging);
+	xcbft_stage_bitmap(face->glyph, info, glyph);
+	XCBFT_TRACE_END("stage_bitmap", staging);
+
+	return 1;
+}
+
+/*
+ * Send the glyphs to the server packing as many of them as possible
+ * in each AddGlyphs request
+ */
+static void
+xcbft_upload_glyphs(xcb_connection_t *c, xcb_render_glyphset_t gs,
+	struct xcbft_glyph_bitmap **glyphs, unsigned int count)
+{
+	unsigned int i, start, n;
+	uint32_t max_bytes, bytes, data_len;
+	uint32_t *gids;
+	xcb_render_glyphinfo_t *infos;
+	uint8_t *data;
+
+	/* the maximum request length is in units of 4 bytes */
+	max_bytes = c ? xcb_get_maximum_request_length(c) * 4 :
+		XCBFT_UPLOAD_BATCH_BYTES;
+	if (max_bytes > XCBFT_UPLOAD_BATCH_BYTES) {
+		max_bytes = XCBFT_UPLOAD_BATCH_BYTES;
+	}
+
+	gids = malloc(sizeof(uint32_t)*count);
+	infos = malloc(sizeof(xcb_render_glyphinfo_t)*count);
+	data = malloc(max_bytes);
+
+	start = 0;
+	while (start < count) {
+		/* 12 bytes of request header */
+		bytes = 12;
+		data_len = 0;
+		n = 0;
+		for (i = start; i < count; i++) {
+			if (n > 0 && bytes + 4 + sizeof(xcb_render_glyphinfo_t)
+					+ glyphs[i]->data_len > max_bytes) {
+				break;
+			}
+			gids[n] = glyphs[i]->gid;
+			infos[n] = glyphs[i]->info;
+			if (data_len + glyphs[i]->data_len > max_bytes) {
+				/* single glyph bigger than the batch */
+				data = realloc(data, data_len + glyphs[i]->data_len);
+			}
+			memcpy(data+data_len, glyphs[i]->data, glyphs[i]->data_len);
+			data_len += glyphs[i]->data_len;
+			bytes += 4 + sizeof(xcb_render_glyphinfo_t)
+				+ glyphs[i]->data_len;
+			n++;
+		}
+		/* counted all the same without a connection */
+		if (c != NULL) {
+			XCBFT_TRACE_BEGIN(request);
+			xcb_render_add_glyphs(c, gs, n, gids, infos, data_len, data);
+			XCBFT_TRACE_END("AddGlyphs", request);
+		}
+		xcbft_count(XCBFT_COUNT_ADD_GLYPHS_REQUESTS, 1);
+		xcbft_count(XCBFT_COUNT_ADD_GLYPHS_BYTES, bytes);
+		start += n;
+	}
+
+	free(gids);
+	free(infos);
+	free(data);
+}
+
+/* 1 bit images are sent in the bit order of the server */
+static void
+xcbft_reverse_bits(uint8_t *data, uint32_t length)
+{
+	uint32_t i;
+	uint8_t b;
+
+	for (i = 0; i < length; i++) {
+		b = data[i];
+		b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+		b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+		b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+		data[i] = b;
+	}
+}
+
+/* rows of 8 bits images are padded to the scanline pad of the server */
+static uint32_t
+xcbft_atlas_stride(xcb_connection_t *c, uint16_t width)
+{
+	xcb_format_iterator_t formats;
+	uint32_t pad;
+
+	pad = 32;
+	for (formats = xcb_setup_pixmap_formats_iterator(xcb_get_setup(c));
+			formats.rem; xcb_format_next(&formats)) {
+		if (formats.data->depth == 8) {
+			pad = formats.data->scanline_pad;
+		}
+	}
+	pad /= 8;
+	return (width + pad - 1)/pad*pad;
+}
+
+/* a new empty pixmap for the atlas, the shelves are reset */
+static void
+xcbft_atlas_create_pixmap(xcb_connection_t *c, struct xcbft_atlas *atlas)
+{
+	xcb_render_pictforminfo_t *fmt;
+	xcb_drawable_t root;
+
+	fmt = xcb_render_util_find_standard_format(
+		xcb_render_util_query_formats(c),
+		XCB_PICT_STANDARD_A_8);
+	root = xcb_setup_roots_iterator(xcb_get_setup(c)).data->root;
+
+	atlas->c = c;
+	atlas->pixmap = xcb_generate_id(c);
+	xcb_create_pixmap(c, 8, atlas->pixmap, root, atlas->width, atlas->height);
+	atlas->picture = xcb_generate_id(c);
+	xcb_render_create_picture(c, atlas->picture, atlas->pixmap, fmt->id,
+		0, NULL);
+	if (atlas->gc == 0) {
+		atlas->gc = xcb_generate_id(c);
+		xcb_create_gc(c, atlas->gc, atlas->pixmap, 0, NULL);
+	}
+	/* only glyph rectangles are read, the rest can stay undefined */
+	atlas->shelves_length = 0;
+	atlas->bottom = 0;
+}
+
+static void
+xcbft_atlas_destroy(struct xcbft_atlas *atlas)
+{
+	if (atlas->pixmap != 0) {
+		xcb_render_free_picture(atlas->c, atlas->picture);
+		xcb_free_pixmap(atlas->c, atlas->pixmap);
+		xcb_free_gc(atlas->c, atlas->gc);
+	}
+	free(atlas->shelves);
+	free(atlas);
+}
+
+/*
+ * Find room for a glyph, in the lowest shelf it fits in or a new one
+ * when the shelves that fit are much taller than the glyph.
+ *
+ * Returns 0 if the atlas is full
+ */
+static int
+xcbft_atlas_alloc(struct xcbft_atlas *atlas, uint16_t width, uint16_t height,
+	uint16_t *x, uint16_t *y)
+{
+	unsigned int i, best;
+	struct xcbft_atlas_shelf *shelf;
+
+	/* a pixel between glyphs */
+	width++;
+	height++;
+	if (width > atlas->width) {
+		return 0;
+	}
+
+	best = atlas->shelves_length;
+	for (i = 0; i < atlas->shelves_length; i++) {
+		shelf = &atlas->shelves[i];
+		if (shelf->height >= height && shelf->x + width <= atlas->width &&
+				(best == atlas->shelves_length ||
+				shelf->height < atlas->shelves[best].height)) {
+			best = i;
+		}
+	}
+	if ((best == atlas->shelves_length ||
+			atlas->shelves[best].height > 2*height) &&
+			atlas->bottom + height <= atlas->height) {
+		if (atlas->shelves_length == atlas->shelves_allocated) {
+			atlas->shelves_allocated = atlas->shelves_allocated ?
+				2*atlas->shelves_allocated : 16;
+			atlas->shelves = realloc(atlas->shelves,
+				sizeof(struct xcbft_atlas_shelf)*atlas->shelves_allocated);
+		}
+		best = atlas->shelves_length++;
+		shelf = &atlas->shelves[best];
+		shelf->y = atlas->bottom;
+		shelf->height = height;
+		shelf->x = shelf->uploaded_x = 0;
+		atlas->bottom += height;
+	}
+	if (best == atlas->shelves_length) {
+		return 0;
+	}
+
+	shelf = &atlas->shelves[best];
+	*x = shelf->x;
+	*y = shelf->y;
+	shelf->x += width;
+	return 1;
+}
+
+/* put an image in the atlas, split in requests of at most a batch */
+static void
+xcbft_atlas_put_image(xcb_connection_t *c, struct xcbft_atlas *atlas,
+	uint16_t x, uint16_t y, uint16_t width, uint16_t height,
+	const uint8_t *data, uint32_t stride)
+{
+	uint32_t max_bytes, step;
+	uint16_t row, rows;
+
+	/* in units of 4 bytes, less the 24 bytes of PutImage header */
+	max_bytes = xcb_get_maximum_request_length(c) * 4 - 24;
+	if (max_bytes > XCBFT_UPLOAD_BATCH_BYTES) {
+		max_bytes = XCBFT_UPLOAD_BATCH_BYTES;
+	}
+	step = max_bytes/stride;
+	if (step == 0) {
+		step = 1;
+	}
+	for (row = 0; row < height; row += rows) {
+		rows = height - row < step ? height - row : step;
+		XCBFT_TRACE_BEGIN(request);
+		xcb_put_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP, atlas->pixmap,
+			atlas->gc, width, rows, x, y + row, 0, 8,
+			stride*rows, data + stride*row);
+		XCBFT_TRACE_END("PutImage", request);
+	}
+}
+
+/* copy an A8 glyph (rows padded to 4 bytes) at x, y of a tile */
+static void
+xcbft_atlas_blit(uint8_t *tile, uint32_t stride, uint16_t x, uint16_t y,
+	const struct xcbft_glyph_bitmap *glyph)
+{
+	uint16_t row;
+	uint32_t glyph_stride;
+
+	glyph_stride = (glyph->info.width+3)&~3;
+	for (row = 0; row < glyph->info.height; row++) {
+		memcpy(tile + (y + row)*stride + x,
+			glyph->data + row*glyph_stride, glyph->info.width);
+	}
+}
+
+/*
+ * Send what was placed right of the uploaded part of each shelf, one
+ * tile per shelf
+ */
+static void
+xcbft_atlas_upload(xcb_connection_t *c, struct xcbft_glyph_cache *cache,
+	struct xcbft_glyph_bitmap **glyphs, unsigned int count)
+{
+	struct xcbft_atlas *atlas = cache->atlas;
+	struct xcbft_atlas_shelf *shelf;
+	struct xcbft_glyph_entry *entry;
+	unsigned int i, j;
+	uint32_t stride;
+	uint16_t width;
+	uint8_t *tile;
+
+	for (i = 0; i < atlas->shelves_length; i++) {
+		shelf = &atlas->shelves[i];
+		if (shelf->x == shelf->uploaded_x) {
+			continue;
+		}
+		width = shelf->x - shelf->uploaded_x;
+		stride = xcbft_atlas_stride(c, width);
+		tile = calloc(stride, shelf->height);
+		for (j = 0; j < count; j++) {
+			entry = xcbft_glyph_cache_lookup(cache, glyphs[j]->charcode,
+				glyphs[j]->mode);
+			if (entry->slot.y == shelf->y &&
+					entry->slot.x >= shelf->uploaded_x) {
+				xcbft_atlas_blit(tile, stride,
+					entry->slot.x - shelf->uploaded_x, 0, glyphs[j]);
+			}
+		}
+		xcbft_atlas_put_image(c, atlas, shelf->uploaded_x, shelf->y,
+			width, shelf->height, tile, stride);
+		free(tile);
+		shelf->uploaded_x = shelf->x;
+	}
+}
+
+static int
+xcbft_slot_compare_height(const void *a, const void *b)
+{
+	const struct xcbft_glyph_entry *entry_a =
+		*(struct xcbft_glyph_entry * const *)a;
+	const struct xcbft_glyph_entry *entry_b =
+		*(struct xcbft_glyph_entry * const *)b;
+
+	return entry_b->slot.height - entry_a->slot.height;
+}
+
+/*
+ * Read glyphs of the atlas back from pixmap and upload them to the A8
+ * glyphset instead, for the glyphs of the frame being drawn that didn't
+ * fit back: the runs already loaded draw them. The reads are a single
+ * round trip, only when a frame alone needs more than the atlas.
+ */
+static void
+xcbft_atlas_evict(xcb_connection_t *c, struct xcbft_glyph_cache *cache,
+	xcb_pixmap_t pixmap, struct xcbft_glyph_entry **entries,
+	unsigned int length)
+{
+	struct xcbft_glyphset *glyphset = &cache->glyphsets[XCBFT_FORMAT_A8];
+	struct xcbft_glyph_bitmap *glyphs, **upload;
+	xcb_get_image_cookie_t *cookies;
+	xcb_get_image_reply_t *reply;
+	struct xcbft_glyph_entry *entry;
+	uint32_t stride, glyph_stride;
+	unsigned int i;
+	uint16_t row;
+
+	glyphs = calloc(length, sizeof(struct xcbft_glyph_bitmap));
+	upload = malloc(sizeof(struct xcbft_glyph_bitmap *)*length);
+	cookies = malloc(sizeof(xcb_get_image_cookie_t)*length);
+	for (i = 0; i < length; i++) {
+		cookies[i] = xcb_get_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP, pixmap,
+			entries[i]->slot.x, entries[i]->slot.y,
+			entries[i]->slot.width, entries[i]->slot.height, ~0u);
+	}
+	for (i = 0; i < length; i++) {
+		entry = entries[i];
+		glyphs[i].charcode = entry->charcode;
+		glyphs[i].mode = entry->mode;
+		glyphs[i].face = entry->face;
+		glyphs[i].info.width = entry->slot.width;
+		glyphs[i].info.height = entry->slot.height;
+		glyphs[i].info.x = entry->slot.origin_x;
+		glyphs[i].info.y = entry->slot.origin_y;
+		glyphs[i].info.x_off = entry->advance.x;
+		glyphs[i].info.y_off = entry->advance.y;
+		/* rows of glyphs are padded to 4 bytes */
+		glyph_stride = (entry->slot.width + 3) & ~3u;
+		glyphs[i].data_len = glyph_stride*entry->slot.height;
+		glyphs[i].data = calloc(1, glyphs[i].data_len ?
+			glyphs[i].data_len : 1);
+		reply = xcb_get_image_reply(c, cookies[i], NULL);
+		if (reply != NULL) {
+			stride = xcbft_atlas_stride(c, entry->slot.width);
+			for (row = 0; row < entry->slot.height &&
+					(row + 1)*stride <=
+					(uint32_t)xcb_get_image_data_length(reply); row++) {
+				memcpy(glyphs[i].data + row*glyph_stride,
+					xcb_get_image_data(reply) + row*stride,
+					entry->slot.width);
+			}
+			free(reply);
+		} else {
+			fprintf(stderr, "could not read a glyph back from the atlas\n");
+		}
+
+		entry->atlas = XCBFT_ATLAS_NONE;
+		entry->gid = xcbft_glyphset_new_gid(glyphset);
+		entry->bytes = 4 + sizeof(xcb_render_glyphinfo_t) +
+			glyphs[i].data_len;
+		glyphset->bytes += entry->bytes;
+		glyphs[i].gid = entry->gid;
+		upload[i] = &glyphs[i];
+	}
+	xcbft_upload_glyphs(c, xcbft_glyph_cache_glyphset(c, cache,
+		XCBFT_FORMAT_A8), upload, length);
+
+	for (i = 0; i < length; i++) {
+		free(glyphs[i].data);
+	}
+	free(cookies);
+	free(upload);
+	free(glyphs);
+}
+
+/*
+ * Move the glyphs of the atlas to a new pixmap, copied on the server
+ * tallest first, which takes back the space of dropped glyphs. The
+ * glyphs drawn at the current tick are placed first, those that still
+ * don't fit go to the A8 glyphset.
+ *
+ * Returns how many glyphs didn't fit anymore, they are removed from
+ * the cache and loaded again when needed
+ */
+static unsigned int
+xcbft_atlas_repack_cache(xcb_connection_t *c, struct xcbft_glyph_cache *cache)
+{
+	struct xcbft_atlas *atlas = cache->atlas;
+	struct xcbft_glyph_entry **placed, **evicted, *swap;
+	xcb_pixmap_t old_pixmap;
+	xcb_render_picture_t old_picture;
+	unsigned int i, length, current, lost, evicted_length;
+	uint16_t x, y;
+	uint8_t drop[256];
+
+	if (atlas->pixmap == 0) {
+		return 0;
+	}
+
+	placed = malloc(sizeof(struct xcbft_glyph_entry *)*(cache->count+1));
+	length = current = 0;
+	for (i = 0; i < cache->size; i++) {
+		if (cache->entries[i].used &&
+				cache->entries[i].atlas == XCBFT_ATLAS_PLACED) {
+			placed[length] = &cache->entries[i];
+			/* the glyphs of this frame first */
+			if (placed[length]->last_use == cache->clock) {
+				swap = placed[current];
+				placed[current++] = placed[length];
+				placed[length] = swap;
+			}
+			length++;
+		}
+	}
+	qsort(placed, current, sizeof(struct xcbft_glyph_entry *),
+		xcbft_slot_compare_height);
+	qsort(placed + current, length - current,
+		sizeof(struct xcbft_glyph_entry *), xcbft_slot_compare_height);
+
+	old_pixmap = atlas->pixmap;
+	old_picture = atlas->picture;
+	xcbft_atlas_create_pixmap(c, atlas);
+	evicted = malloc(sizeof(struct xcbft_glyph_entry *)*(current+1));
+	lost = evicted_length = 0;
+	for (i = 0; i < length; i++) {
+		if (!xcbft_atlas_alloc(atlas, placed[i]->slot.width,
+				placed[i]->slot.height, &x, &y)) {
+			if (i < current) {
+				evicted[evicted_length++] = placed[i];
+				continue;
+			}
+			placed[i]->atlas = XCBFT_ATLAS_LOST;
+			lost++;
+			continue;
+		}
+		XCBFT_TRACE_BEGIN(request);
+		xcb_copy_area(c, old_pixmap, atlas->pixmap, atlas->gc,
+			placed[i]->slot.x, placed[i]->slot.y, x, y,
+			placed[i]->slot.width, placed[i]->slot.height);
+		XCBFT_TRACE_END("CopyArea", request);
+		placed[i]->slot.x = x;
+		placed[i]->slot.y = y;
+	}
+	for (i = 0; i < atlas->shelves_length; i++) {
+		atlas->shelves[i].uploaded_x = atlas->shelves[i].x;
+	}
+	if (evicted_length > 0) {
+		xcbft_atlas_evict(c, cache, old_pixmap, evicted, evicted_length);
+	}
+	xcb_render_free_picture(c, old_picture);
+	xcb_free_pixmap(c, old_pixmap);
+	free(evicted);
+	free(placed);
+
+	if (lost > 0) {
+		memset(drop, 0, sizeof(drop));
+		xcbft_glyph_cache_drop(cache, drop, 0);
+	}
+	return lost;
+}
+
+/*
+ * Place the A8 glyphs in the atlas and upload them, repacking it once
+ * when full. The glyphs that aren't placed are moved to the start of
+ * glyphs, for the glyphsets.
+ *
+ * Returns how many glyphs are left
+ */
+static unsigned int
+xcbft_atlas_add(xcb_connection_t *c, struct xcbft_glyph_cache *cache,
+	struct xcbft_glyph_bitmap **glyphs, unsigned int count)
+{
+	struct xcbft_atlas *atlas = cache->atlas;
+	struct xcbft_glyph_entry *entry;
+	struct xcbft_glyph_bitmap **placed;
+	unsigned int i, left, placed_length, repacked;
+	uint32_t stride;
+	uint16_t x, y;
+	uint8_t *tile;
+
+	if (atlas->pixmap == 0) {
+		xcbft_atlas_create_pixmap(c, atlas);
+		/* repacking keeps the size */
+		atomic_store(&cache->atlas_bytes,
+			(size_t)atlas->height * xcbft_atlas_stride(c, atlas->width));
+	}
+
+	placed = malloc(sizeof(struct xcbft_glyph_bitmap *)*count);
+	placed_length = left = 0;
+	repacked = 0;
+	for (i = 0; i < count; i++) {
+		entry = xcbft_glyph_cache_lookup(cache, glyphs[i]->charcode,
+			glyphs[i]->mode);
+		/* blanks aren't worth a composite, uploaded glyphs stay */
+		if (entry == NULL || entry->bytes > 0 ||
+				xcbft_mode_format(glyphs[i]->mode) != XCBFT_FORMAT_A8 ||
+				glyphs[i]->info.width == 0 || glyphs[i]->info.height == 0) {
+			glyphs[left++] = glyphs[i];
+			continue;
+		}
+		if (entry->atlas == XCBFT_ATLAS_PLACED) {
+			/* loaded again, in the same place */
+			stride = xcbft_atlas_stride(c, glyphs[i]->info.width);
+			tile = calloc(stride, glyphs[i]->info.height);
+			xcbft_atlas_blit(tile, stride, 0, 0, glyphs[i]);
+			xcbft_atlas_put_image(c, atlas, entry->slot.x, entry->slot.y,
+				glyphs[i]->info.width, glyphs[i]->info.height,
+				tile, stride);
+			free(tile);
+			continue;
+		}
+
+		if (!xcbft_atlas_alloc(atlas, glyphs[i]->info.width,
+				glyphs[i]->info.height, &x, &y)) {
+			if (repacked) {
+				glyphs[left++] = glyphs[i];
+				continue;
+			}
+			/* what was placed must be there before it moves */
+			xcbft_atlas_upload(c, cache, placed, placed_length);
+			placed_length = 0;
+			xcbft_atlas_repack_cache(c, cache);
+			repacked = 1;
+			entry = xcbft_glyph_cache_lookup(cache, glyphs[i]->charcode,
+				glyphs[i]->mode);
+			if (!xcbft_atlas_alloc(atlas, glyphs[i]->info.width,
+					glyphs[i]->info.height, &x, &y)) {
+				glyphs[left++] = glyphs[i];
+				continue;
+			}
+		}
+
+		/* its glyph id was never used on the server */
+		xcbft_glyphset_release_gids(&cache->glyphsets[XCBFT_FORMAT_A8],
+			&entry->gid, 1);
+		entry->gid = 0;
+		entry->atlas = XCBFT_ATLAS_PLACED;
+		entry->slot.x = x;
+		entry->slot.y = y;
+		entry->slot.width = glyphs[i]->info.width;
+		entry->slot.height = glyphs[i]->info.height;
+		entry->slot.origin_x = glyphs[i]->info.x;
+		entry->slot.origin_y = glyphs[i]->info.y;
+		placed[placed_length++] = glyphs[i];
+	}
+	xcbft_atlas_upload(c, cache, placed, placed_length);
+
+	free(placed);
+	return left;
+}
+
+/*
+ * Keep the new A8 glyphs of the faces in an atlas pixmap of that size
+ * instead of a glyphset. The server memory used for them is then the
+ * size of the atlas, the glyphs already uploaded stay in the glyphset.
+ *
+ * Returns 0 if the faces already have an atlas
+ */
+int
+xcbft_atlas_start(struct xcbft_face_holder faces,
+	uint16_t width, uint16_t height)
+{
+	struct xcbft_atlas *atlas;
+
+	if (faces.cache->atlas != NULL) {
+		return 0;
+	}
+	atlas = calloc(1, sizeof(struct xcbft_atlas));
+	atlas->width = width;
+	atlas->height = height;
+	faces.cache->atlas = atlas;
+	return 1;
+}
+
+/*
+ * Defragment the atlas of the faces, taking back the space of the
+ * glyphs dropped since (font files that changed). It's also done when
+ * the atlas gets full.
+ *
+ * Returns the number of glyphs that didn't fit anymore
+ */
+int
+xcbft_atlas_repack(xcb_connection_t *c, struct xcbft_face_holder faces)
+{
+	if (faces.cache->atlas == NULL) {
+		return 0;
+	}
+	return xcbft_atlas_repack_cache(c, faces.cache);
+}
+
+/* copy the glyphs to their cache entries before they are uploaded */
+static void
+xcbft_glyph_cache_keep_images(struct xcbft_glyph_cache *cache,
+	struct xcbft_glyph_bitmap **glyphs, unsigned int count)
+{
+	unsigned int i;
+	struct xcbft_glyph_entry *entry;
+	struct xcbft_glyph_image *image;
+
+	for (i = 0; i < count; i++) {
+		entry = xcbft_glyph_cache_lookup(cache, glyphs[i]->charcode,
+			glyphs[i]->mode);
+		if (entry == NULL) {
+			continue;
+		}
+		image = malloc(sizeof(struct xcbft_glyph_image));
+		image->info = glyphs[i]->info;
+		image->format = xcbft_mode_format(glyphs[i]->mode);
+		image->stride = glyphs[i]->info.height ?
+			glyphs[i]->data_len/glyphs[i]->info.height : 0;
+		image->data = malloc(glyphs[i]->data_len ? glyphs[i]->data_len : 1);
+		memcpy(image->data, glyphs[i]->data, glyphs[i]->data_len);
+		xcbft_glyph_image_release(cache, entry->image);
+		xcbft_memory_grow(&cache->client_bytes,
+			xcbft_glyph_image_size(image));
+		entry->image = image;
+	}
+}
+
+/* what the glyphs will take in their glyphset, with their id and info */
+static void
+xcbft_glyph_cache_account(struct xcbft_glyph_cache *cache,
+	struct xcbft_glyph_bitmap **glyphs, unsigned int count)
+{
+	unsigned int i;
+	struct xcbft_glyph_entry *entry;
+	struct xcbft_glyphset *glyphset;
+
+	for (i = 0; i < count; i++) {
+		entry = xcbft_glyph_cache_lookup(cache, glyphs[i]->charcode,
+			glyphs[i]->mode);
+		if (entry == NULL) {
+			continue;
+		}
+		glyphset = &cache->glyphsets[xcbft_mode_format(entry->mode)];
+		/* loaded again, replaces the old one */
+		glyphset->bytes -= entry->bytes;
+		entry->bytes = 4 + sizeof(xcb_render_glyphinfo_t) +
+			glyphs[i]->data_len;
+		glyphset->bytes += entry->bytes;
+	}
+}
+
+/*
+ * Free the least recently drawn glyphs on the server once the glyphsets
+ * are over the budget, in whole clock ticks, oldest first. What was
+ * drawn at the current tick is kept even when over budget.
+ */
+static void
+xcbft_glyph_cache_trim(struct xcbft_glyph_cache *cache)
+{
+	static const uint8_t no_drop[256];
+	uint64_t *stamps;
+	uint32_t i, length, before;
+	size_t total, target;
+	enum xcbft_glyph_format format;
+
+	total = 0;
+	for (format = 0; format < XCBFT_FORMATS; format++) {
+		total += cache->glyphsets[format].bytes;
+	}
+	if (cache->budget == 0 || total <= cache->budget ||
+			cache->published != NULL) {
+		return;
+	}
+
+	/* last use in the high bits, sorting them sorts by age */
+	stamps = malloc(sizeof(uint64_t)*(cache->count+1));
+	length = 0;
+	for (i = 0; i < cache->size; i++) {
+		if (cache->entries[i].used && cache->entries[i].bytes > 0 &&
+				cache->entries[i].last_use < cache->clock) {
+			stamps[length++] =
+				(uint64_t)cache->entries[i].last_use << 32 |
+				cache->entries[i].bytes;
+		}
+	}
+	qsort(stamps, length, sizeof(uint64_t), xcbft_stamp_compare);
+
+	target = XCBFT_BUDGET_TRIM(cache->budget);
+	before = 0;
+	for (i = 0; i < length && total > target; i++) {
+		total -= (uint32_t)stamps[i];
+		before = (uint32_t)(stamps[i] >> 32) + 1;
+	}
+	free(stamps);
+
+	if (before > 0) {
+		xcbft_glyph_cache_drop(cache, no_drop, before);
+	}
+}
+
+/*
+ * The root window property the glyphs of a face are published under,
+ * named after everything that makes two faces give the same glyphs.
+ * check is another hash of it, to tell collisions of the name apart.
+ */
+static xcb_atom_t
+xcbft_share_atom(xcb_connection_t *c, FcPattern *pattern,
+	const struct xcbft_face_info *info, uint8_t only_if_exists,
+	uint32_t *check)
+{
+	FcValue fc_file;
+	int index;
+	struct xcbft_file_stamp stamp;
+	char key[1024], name[32];
+	const char *p;
+	uint32_t hash;
+	xcb_intern_atom_reply_t *reply;
+	xcb_atom_t atom;
+
+	if (FcPatternGet(pattern, FC_FILE, 0, &fc_file) != FcResultMatch) {
+		return XCB_ATOM_NONE;
+	}
+	if (FcPatternGetInteger(pattern, FC_INDEX, 0, &index) != FcResultMatch) {
+		index = 0;
+	}
+	xcbft_file_stamp_get(pattern, &stamp);
+	snprintf(key, sizeof(key), "%s:%d:%lld:%lld:%.3f:%u",
+		(const char *)fc_file.u.s, index, (long long)stamp.size,
+		(long long)stamp.mtime, info->pixel_size, info->mode);
+
+	/* FNV-1a for the name, djb2 for the check */
+	hash = 2166136261u;
+	*check = 5381;
+	for (p = key; *p != '\0'; p++) {
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+		*check = *check * 33 + (uint8_t)*p;
+	}
+	snprintf(name, sizeof(name), "_XCBFT_GLYPHS_%08X", hash);
+
+	reply = xcb_intern_atom_reply(c,
+		xcb_intern_atom(c, only_if_exists, strlen(name), name), NULL);
+	if (reply == NULL) {
+		return XCB_ATOM_NONE;
+	}
+	atom = reply->atom;
+	free(reply);
+	return atom;
+}
+
+/* set or append to a published map, in as many requests as needed */
+static void
+xcbft_share_put(xcb_connection_t *c, xcb_atom_t atom, uint8_t mode,
+	const uint32_t *words, uint32_t length)
+{
+	xcb_window_t root = xcb_setup_roots_iterator(xcb_get_setup(c)).data->root;
+	uint32_t max_words, sent, n;
+
+	/* 6 words of request header */
+	max_words = xcb_get_maximum_request_length(c) - 6;
+	if (max_words > XCBFT_UPLOAD_BATCH_BYTES/4) {
+		max_words = XCBFT_UPLOAD_BATCH_BYTES/4;
+	}
+	for (sent = 0; sent < length; sent += n) {
+		n = length - sent < max_words ? length - sent : max_words;
+		xcb_change_property(c, sent == 0 ? mode : XCB_PROP_MODE_APPEND,
+			root, atom, XCB_ATOM_CARDINAL, 32, n, words + sent);
+	}
+}
+
+/* the record of a glyph in a published map */
+static uint32_t
+xcbft_share_record(const struct xcbft_glyph_entry *entry, uint32_t *words)
+{
+	words[0] = entry->charcode;
+	words[1] = entry->mode;
+	words[2] = entry->gid;
+	words[3] = (uint32_t)entry->advance.x;
+	words[4] = (uint32_t)entry->advance.y;
+	return XCBFT_SHARE_GLYPH;
+}
+
+/* add the glyphs just uploaded to the maps of their faces */
+static void
+xcbft_share_append(xcb_connection_t *c, struct xcbft_glyph_cache *cache,
+	struct xcbft_glyph_bitmap **glyphs, unsigned int count)
+{
+	struct xcbft_glyph_entry *entry;
+	uint32_t *words, length;
+	unsigned int i, j;
+	uint8_t face, *done;
+
+	words = malloc(sizeof(uint32_t)*XCBFT_SHARE_GLYPH*(count+1));
+	done = calloc(count+1, 1);
+	/* one request per face, usually there is only one */
+	for (i = 0; i < count; i++) {
+		if (done[i]) {
+			continue;
+		}
+		face = glyphs[i]->face;
+		length = 0;
+		for (j = i; j < count; j++) {
+			if (done[j] || glyphs[j]->face != face) {
+				continue;
+			}
+			done[j] = 1;
+			entry = xcbft_glyph_cache_lookup(cache, glyphs[j]->charcode,
+				glyphs[j]->mode);
+			if (entry != NULL && !entry->borrowed) {
+				length += xcbft_share_record(entry, words + length);
+			}
+		}
+		if (face != XCBFT_FACE_FALLBACK && length > 0 &&
+				cache->published[face] != XCB_ATOM_NONE) {
+			xcbft_share_put(c, cache->published[face],
+				XCB_PROP_MODE_APPEND, words, length);
+		}
+	}
+	free(done);
+	free(words);
+}
+
+/*
+ * Upload to the glyphset of each glyph's format, then trim the cache to
+ * its budget: every way of loading glyphs ends here, the raster workers
+ * and the prewarm included.
+ */
+static void
+xcbft_glyph_cache_upload(xcb_connection_t *c, struct xcbft_glyph_cache *cache,
+	struct xcbft_glyph_bitmap **glyphs, unsigned int count)
+{
+	unsigned int i, n;
+	enum xcbft_glyph_format format;
+	struct xcbft_glyph_bitmap **same_format;
+	struct xcbft_glyph_entry *entry;
+
+	for (i = 0; i < count && c != NULL; i++) {
+		entry = xcbft_glyph_cache_lookup(cache, glyphs[i]->charcode,
+			glyphs[i]->mode);
+		if (entry != NULL) {
+			entry->offline = 0;
+		}
+	}
+	if (cache->keep_images) {
+		xcbft_glyph_cache_keep_images(cache, glyphs, count);
+	}
+	if (cache->raster != NULL && cache->raster->refs > 1) {
+		xcbft_raster_cache_store(cache, glyphs, count);
+	}
+	if (cache->atlas != NULL && c != NULL) {
+		count = xcbft_atlas_add(c, cache, glyphs, count);
+	}
+
+	same_format = malloc(sizeof(struct xcbft_glyph_bitmap *)*count);
+	for (format = 0; format < XCBFT_FORMATS; format++) {
+		n = 0;
+		for (i = 0; i < count; i++) {
+			if (xcbft_mode_format(glyphs[i]->mode) == format) {
+				same_format[n++] = glyphs[i];
+			}
+		}
+		if (n == 0) {
+			continue;
+		}
+		xcbft_glyph_cache_account(cache, same_format, n);
+		if (format == XCBFT_FORMAT_A1 && c != NULL &&
+				xcb_get_setup(c)->bitmap_format_bit_order ==
+				XCB_IMAGE_ORDER_LSB_FIRST) {
+			for (i = 0; i < n; i++) {
+				xcbft_reverse_bits(same_format[i]->data,
+					same_format[i]->data_len);
+			}
+		}
+		xcbft_upload_glyphs(c,
+			xcbft_glyph_cache_glyphset(c, cache, format),
+			same_format, n);
+	}
+	/* after the glyphs, the other clients never see a missing id */
+	if (cache->published != NULL) {
+		xcbft_share_append(c, cache, glyphs, count);
+	}
+	free(same_format);
+
+	xcbft_glyph_cache_trim(cache);
+}
+
+/* what gets cached for glyphs that freetype failed to load */
+static void
+xcbft_empty_glyph(uint32_t charcode, struct xcbft_glyph_bitmap *glyph)
+{
+	memset(glyph, 0, sizeof(struct xcbft_glyph_bitmap));
+	glyph->charcode = charcode;
+	glyph->data = calloc(1, 1);
+}
+
+static void
+xcbft_glyph_bitmap_free_list(struct xcbft_glyph_bitmap *glyph)
+{
+	struct xcbft_glyph_bitmap *next;
+
+	while (glyph != NULL) {
+		next = glyph->next;
+		free(glyph->data);
+		free(glyph);
+		glyph = next;
+	}
+}
+
+static int xcbft_set_face_size(FT_Face, double, long,
+	struct xcbft_face_info *);
+
+/* the pixel size of each face, the ones of a view may not be the pattern's */
+static double *
+xcbft_pixel_sizes(struct xcbft_face_holder faces)
+{
+	double *pixel_sizes;
+	uint8_t i;
+
+	pixel_sizes = malloc(sizeof(double)*(faces.length+1));
+	for (i = 0; i < faces.length; i++) {
+		pixel_sizes[i] = faces.cache->infos[i].pixel_size;
+	}
+	return pixel_sizes;
+}
+
+/* size private copies of faces like the face holder they copy */
+static void
+xcbft_face_holder_resize(struct xcbft_face_holder faces,
+	const double *pixel_sizes, uint8_t length, long dpi)
+{
+	uint8_t i;
+
+	for (i = 0; i < faces.length && i < length; i++) {
+		if (faces.cache->infos[i].pixel_size != pixel_sizes[i]) {
+			xcbft_set_face_size(faces.faces[i], pixel_sizes[i], dpi,
+				&faces.cache->infos[i]);
+		}
+	}
+}
+
+/*
+ * Private copies of the faces of patterns for another thread, sized
+ * like the face holder they copy: face i of the copy is face i of the
+ * holder.
+ *
+ * Returns an empty face holder (length 0) if one of them can't be opened
+ * anymore, the faces of the holder are used on its thread instead
+ */
+static struct xcbft_face_holder
+xcbft_face_holder_copy(struct xcbft_patterns_holder patterns,
+	const double *pixel_sizes, long dpi)
+{
+	struct xcbft_face_holder faces;
+
+	faces = xcbft_load_faces(patterns, dpi);
+	if (faces.length != patterns.length) {
+		fprintf(stderr, "could not open a copy of the faces\n");
+		if (faces.cache != NULL) {
+			xcbft_face_holder_destroy(faces);
+		}
+		memset(&faces, 0, sizeof(faces));
+		return faces;
+	}
+	xcbft_face_holder_resize(faces, pixel_sizes, patterns.length, dpi);
+	return faces;
+}
+
+static void *
+xcbft_raster_pool_worker(void *arg)
+{
+	struct xcbft_raster_pool *pool = arg;
+	struct xcbft_face_holder faces;
+	struct xcbft_glyph_bitmap *glyph;
+	const struct xcbft_raster_job *job;
+	unsigned long generation;
+	unsigned int i;
+
+	/* faces private to this worker */
+	faces = xcbft_face_holder_copy(pool->patterns, pool->pixel_sizes,
+		pool->dpi);
+
+	generation = 0;
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->quit && pool->generation == generation) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		if (pool->quit) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		while ((i = atomic_fetch_add(&pool->next_job, 1))
+				< pool->jobs_length) {
+			job = &pool->jobs[i];
+			glyph = malloc(sizeof(struct xcbft_glyph_bitmap));
+			if (job->face >= faces.length) {
+				/* no copy of the face, left to the caller */
+				memset(glyph, 0, sizeof(struct xcbft_glyph_bitmap));
+				glyph->charcode = job->charcode;
+				glyph->mode = job->mode;
+			} else if (!xcbft_rasterize_glyph(faces.faces[job->face],
+					job->charcode, &faces.cache->infos[job->face],
+					glyph)) {
+				xcbft_empty_glyph(job->charcode, glyph);
+				glyph->mode = job->mode;
+			}
+			glyph->face = job->face;
+			/* lock-free push */
+			glyph->next = atomic_load(&pool->done);
+			while (!atomic_compare_exchange_weak(&pool->done,
+					&glyph->next, glyph));
+			sem_post(&pool->ready);
+		}
+
+		/* the jobs belong to the caller, it must wait for everyone */
+		pthread_mutex_lock(&pool->lock);
+		pool->idle++;
+		pthread_cond_signal(&pool->finished);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (faces.cache != NULL) {
+		xcbft_face_holder_destroy(faces);
+	}
+	return NULL;
+}
+
+/*
+ * Start workers that rasterize glyphs in parallel for the faces, used
+ * by xcbft_load_glyphset when many glyphs are missing at once (opening
+ * a large CJK document for example).
+ * The workers are stopped when the face holder is destroyed.
+ *
+ * Returns the number of workers started.
+ */
+int
+xcbft_raster_pool_start(struct xcbft_face_holder faces,
+	unsigned int workers, long dpi)
+{
+	struct xcbft_raster_pool *pool;
+	unsigned int i;
+
+	if (faces.cache == NULL || faces.cache->pool != NULL || workers == 0) {
+		return 0;
+	}
+
+	pool = calloc(1, sizeof(struct xcbft_raster_pool));
+	pool->threads = malloc(sizeof(pthread_t)*workers);
+	pool->dpi = dpi;
+	pool->pixel_sizes = xcbft_pixel_sizes(faces);
+	pool->patterns.length = faces.length;
+	pool->patterns.patterns = malloc(sizeof(FcPattern *)*faces.length);
+	for (i = 0; i < faces.length; i++) {
+		FcPatternReference(faces.patterns[i]);
+		pool->patterns.patterns[i] = faces.patterns[i];
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->finished, NULL);
+	sem_init(&pool->ready, 0, 0);
+	atomic_init(&pool->next_job, 0);
+	atomic_init(&pool->done, NULL);
+
+	for (i = 0; i < workers; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				xcbft_raster_pool_worker, pool) != 0) {
+			fprintf(stderr, "could not start a rasterization worker");
+			break;
+		}
+	}
+	pool->length = i;
+	if (pool->length == 0) {
+		xcbft_raster_pool_destroy(pool);
+		return 0;
+	}
+
+	faces.cache->pool = pool;
+	return pool->length;
+}
+
+static void
+xcbft_raster_pool_destroy(struct xcbft_raster_pool *pool)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->length; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	xcbft_glyph_bitmap_free_list(atomic_load(&pool->done));
+	sem_destroy(&pool->ready);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->finished);
+	pthread_mutex_destroy(&pool->lock);
+	xcbft_patterns_holder_destroy(pool->patterns);
+	free(pool->pixel_sizes);
+	free(pool->threads);
+	free(pool);
+}
+
+/*
+ * Rasterize the jobs on the workers while uploading the results
+ * as they come on this thread, the only one talking to X. The glyphs a
+ * worker has no copy of the face for are rasterized here.
+ */
+static void
+xcbft_raster_pool_run(xcb_connection_t *c, struct xcbft_face_holder faces,
+	const struct xcbft_raster_job *jobs, unsigned int length)
+{
+	struct xcbft_glyph_cache *cache = faces.cache;
+	struct xcbft_raster_pool *pool = cache->pool;
+	struct xcbft_glyph_bitmap *done, *glyph, *uploaded, **pending;
+	unsigned int received, pending_length;
+	FT_Vector advance;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->jobs = jobs;
+	pool->jobs_length = length;
+	atomic_store(&pool->next_job, 0);
+	pool->idle = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	pending = malloc(sizeof(struct xcbft_glyph_bitmap *)*length);
+	pending_length = 0;
+	uploaded = NULL;
+	received = 0;
+	while (received < length) {
+		sem_wait(&pool->ready);
+		done = atomic_exchange(&pool->done, NULL);
+		while (done != NULL) {
+			glyph = done;
+			done = done->next;
+
+			if (glyph->data == NULL &&
+					!xcbft_rasterize_glyph(faces.faces[glyph->face],
+						glyph->charcode, &cache->infos[glyph->face],
+						glyph)) {
+				xcbft_empty_glyph(glyph->charcode, glyph);
+				glyph->mode = cache->infos[glyph->face].mode;
+			}
+			advance.x = glyph->info.x_off;
+			advance.y = glyph->info.y_off;
+			glyph->gid = xcbft_glyph_cache_insert(cache,
+				glyph->charcode, glyph->mode, advance, glyph->face);
+			pending[pending_length++] = glyph;
+			glyph->next = uploaded;
+			uploaded = glyph;
+			received++;
+		}
+		if (pending_length >= XCBFT_POOL_UPLOAD_GLYPHS ||
+				(received == length && pending_length > 0)) {
+			xcbft_glyph_cache_upload(c, cache,
+				pending, pending_length);
+			pending_length = 0;
+		}
+	}
+	pthread_mutex_lock(&pool->lock);
+	while (pool->idle < pool->length) {
+		pthread_cond_wait(&pool->finished, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	/* one post per glyph, some may still be counted */
+	while (sem_trywait(&pool->ready) == 0);
+
+	free(pending);
+	xcbft_glyph_bitmap_free_list(uploaded);
+}
+
+static void
+xcbft_query_cache_clear(void)
+{
+	struct xcbft_query_entry *entry, *next;
+
+	pthread_mutex_lock(&xcbft_query_cache_lock);
+	for (entry = xcbft_query_cache; entry != NULL; entry = next) {
+		next = entry->next;
+		FcStrFree(entry->fontquery);
+		FcPatternDestroy(entry->pattern);
+		free(entry);
+	}
+	xcbft_query_cache = NULL;
+	pthread_mutex_unlock(&xcbft_query_cache_lock);
+}
+
+void
+xcbft_done(void)
+{
+	xcbft_query_cache_clear();
+	if (xcbft_xrm_settings != NULL) {
+		FcPatternDestroy(xcbft_xrm_settings);
+		xcbft_xrm_settings = NULL;
+	}
+	FcFini();
+}
+
+int
+xcbft_init(void)
+{
+	FcBool status;
+
+	status = FcInit();
+	if (status == FcFalse) {
+		fprintf(stderr, "Could not initialize fontconfig");
+	}
+
+	return status == FcTrue;
+}
+
+/* Xft.<name> holding a fontconfig constant such as hintslight or rgb */
+static void
+xcbft_xrm_get_constant(xcb_xrm_database_t *xrm, const char *resource,
+	FcPattern *settings, const char *object)
+{
+	char *value;
+	int constant;
+
+	if (xcb_xrm_resource_get_string(xrm, resource, NULL, &value) < 0) {
+		return;
+	}
+	if (FcNameConstant((FcChar8 *)value, &constant)) {
+		FcPatternAddInteger(settings, object, constant);
+	} else {
+		fprintf(stderr, "unknown value for %s: %s\n", resource, value);
+	}
+	free(value);
+}
+
+static void
+xcbft_xrm_get_bool(xcb_xrm_database_t *xrm, const char *resource,
+	FcPattern *settings, const char *object)
+{
+	bool value;
+
+	if (xcb_xrm_resource_get_bool(xrm, resource, NULL, &value) == 0) {
+		FcPatternAddBool(settings, object, value ? FcTrue : FcFalse);
+	}
+}
+
+/*
+ * Read the rendering settings (antialias, hinting, subpixel, etc..)
+ * from the Xresources, the way Xft does.
+ * They apply to the queries that don't specify them, so the cached
+ * query results are dropped.
+ *
+ * Returns 0 if the resources couldn't be read
+ */
+int
+xcbft_load_xrm_settings(xcb_connection_t *c)
+{
+	xcb_xrm_database_t *xrm;
+	FcPattern *settings;
+
+	xrm = xcb_xrm_database_from_default(c);
+	if (xrm == NULL) {
+		fprintf(stderr, "could not load the Xresources");
+		return 0;
+	}
+
+	settings = FcPatternCreate();
+	xcbft_xrm_get_bool(xrm, "Xft.antialias", settings, FC_ANTIALIAS);
+	xcbft_xrm_get_bool(xrm, "Xft.hinting", settings, FC_HINTING);
+	xcbft_xrm_get_bool(xrm, "Xft.autohint", settings, FC_AUTOHINT);
+	xcbft_xrm_get_bool(xrm, "Xft.embeddedbitmap", settings, FC_EMBEDDED_BITMAP);
+	xcbft_xrm_get_constant(xrm, "Xft.hintstyle", settings, FC_HINT_STYLE);
+	xcbft_xrm_get_constant(xrm, "Xft.rgba", settings, FC_RGBA);
+	xcbft_xrm_get_constant(xrm, "Xft.lcdfilter", settings, FC_LCD_FILTER);
+	xcb_xrm_database_free(xrm);
+
+	xcbft_query_cache_clear();
+	pthread_mutex_lock(&xcbft_xrm_lock);
+	if (xcbft_xrm_settings != NULL) {
+		FcPatternDestroy(xcbft_xrm_settings);
+	}
+	xcbft_xrm_settings = settings;
+	pthread_mutex_unlock(&xcbft_xrm_lock);
+
+	return 1;
+}
+
+/* add the Xresources settings the pattern doesn't have */
+static void
+xcbft_xrm_substitute(FcPattern *pattern)
+{
+	static const char *objects[] = {
+		FC_ANTIALIAS, FC_HINTING, FC_AUTOHINT, FC_EMBEDDED_BITMAP,
+		FC_HINT_STYLE, FC_RGBA, FC_LCD_FILTER
+	};
+	FcValue value, existing;
+	unsigned int i;
+
+	/* not the query cache lock, xcbft_rescan queries while holding it */
+	pthread_mutex_lock(&xcbft_xrm_lock);
+	for (i = 0; xcbft_xrm_settings != NULL &&
+			i < sizeof(objects)/sizeof(objects[0]); i++) {
+		if (FcPatternGet(xcbft_xrm_settings, objects[i], 0, &value) ==
+				FcResultMatch &&
+				FcPatternGet(pattern, objects[i], 0, &existing) !=
+				FcResultMatch) {
+			FcPatternAdd(pattern, objects[i], value, FcTrue);
+		}
+	}
+	pthread_mutex_unlock(&xcbft_xrm_lock);
+}
+
+static FcPattern*
+xcbft_query_fontsearch_uncached(FcChar8 *fontquery)
+{
+	FcBool status;
+	FcPattern *fc_finding_pattern, *pat_output;
+	FcResult result;
+
+	fc_finding_pattern = FcNameParse(fontquery);
+
+	/* to match we need to fix the pattern (fill unspecified info) */
+	xcbft_xrm_substitute(fc_finding_pattern);
+	FcDefaultSubstitute(fc_finding_pattern);
+	status = FcConfigSubstitute(NULL, fc_finding_pattern, FcMatchPattern);
+	if (status == FcFalse) {
+		fprintf(stderr, "could not perform config font substitution");
+		return NULL;
+	}
+
+	XCBFT_TRACE_BEGIN(matching);
+	pat_output = FcFontMatch(NULL, fc_finding_pattern, &result);
+	XCBFT_TRACE_END("FcFontMatch", matching);
+	xcbft_count(XCBFT_COUNT_FC_MATCHES, 1);
+
+	FcPatternDestroy(fc_finding_pattern);
+	if (result == FcResultMatch) {
+		return pat_output;
+	} else if (result == FcResultNoMatch) {
+		fprintf(stderr, "there wasn't a match");
+	} else {
+		fprintf(stderr, "the match wasn't as good as it should be");
+	}
+	return NULL;
+}
+
+/*
+ * Do the font queries through fontconfig and return the info
+ * The results are cached until the configuration changes (see xcbft_rescan)
+ *
+ * Assumes:
+ *	Fontconfig is already init & cleaned outside
+ *	the FcPattern return needs to be cleaned outside
+ */
+FcPattern*
+xcbft_query_fontsearch(FcChar8 *fontquery)
+{
+	FcPattern *pat_output;
+	struct xcbft_query_entry *entry;
+
+	pthread_mutex_lock(&xcbft_query_cache_lock);
+	for (entry = xcbft_query_cache; entry != NULL; entry = entry->next) {
+		if (FcStrCmp(entry->fontquery, fontquery) == 0) {
+			pat_output = FcPatternDuplicate(entry->pattern);
+			pthread_mutex_unlock(&xcbft_query_cache_lock);
+			return pat_output;
+		}
+	}
+	pthread_mutex_unlock(&xcbft_query_cache_lock);
+
+	pat_output = xcbft_query_fontsearch_uncached(fontquery);
+	if (pat_output == NULL) {
+		return NULL;
+	}
+
+	entry = malloc(sizeof(struct xcbft_query_entry));
+	entry->fontquery = FcStrCopy(fontquery);
+	entry->pattern = FcPatternDuplicate(pat_output);
+	pthread_mutex_lock(&xcbft_query_cache_lock);
+	entry->next = xcbft_query_cache;
+	xcbft_query_cache = entry;
+	pthread_mutex_unlock(&xcbft_query_cache_lock);
+
+	return pat_output;
+}
+
+
+/*
+ * Query a font based on character support
+ * Optionally pass a pattern that it'll use as the base for the search
+ *
+ * fallback of font added to the list or somehow done when drawing,
+ * to do that we need to search by the charset we want to draw
+ * and if they are in one of the font already specified, thus need to
+ * know what the users want to insert as text. This needs more thinking
+ * to be decoupled.
+
+	Assumes the ft2 library is already loaded
+	Assumes the face will be cleaned outside
+ */
+struct xcbft_face_holder
+xcbft_query_by_char_support(FcChar32 character,
+		const FcPattern *copy_pattern, long dpi)
+{
+	FcBool status;
+	FcResult result;
+	FcCharSet *charset;
+	FcPattern *charset_pattern, *pat_output;
+	struct xcbft_patterns_holder patterns;
+	struct xcbft_face_holder faces = {0};
+
+	/* add characters we need to a charset */
+	charset = FcCharSetCreate();
+	FcCharSetAddChar(charset, character);
+
+	/* if we pass a pattern then copy it to get something close */
+	if (copy_pattern != NULL) {
+		charset_pattern = FcPatternDuplicate(copy_pattern);
+	} else {
+		charset_pattern = FcPatternCreate();
+	}
+
+	/* use the charset for the pattern search */
+	FcPatternAddCharSet(charset_pattern, FC_CHARSET, charset);
+	/* also force it to be scalable */
+	FcPatternAddBool(charset_pattern, FC_SCALABLE, FcTrue);
+
+	/* default & config substitutions, the usual */
+	xcbft_xrm_substitute(charset_pattern);
+	FcDefaultSubstitute(charset_pattern);
+	status = FcConfigSubstitute(NULL, charset_pattern, FcMatchPattern);
+	if (status == FcFalse) {
+		fprintf(stderr, "could not perform config font substitution");
+		FcCharSetDestroy(charset);
+		return faces;
+	}
+
+	XCBFT_TRACE_BEGIN(matching);
+	pat_output = FcFontMatch(NULL, charset_pattern, &result);
+	XCBFT_TRACE_END("FcFontMatch fallback", matching);
+	xcbft_count(XCBFT_COUNT_FC_MATCHES, 1);
+	xcbft_count(XCBFT_COUNT_FALLBACK_LOOKUPS, 1);
+
+	FcPatternDestroy(charset_pattern);
+
+	if (result != FcResultMatch) {
+		fprintf(stderr, "there wasn't a match");
+		FcCharSetDestroy(charset);
+		return faces;
+	}
+
+	patterns.patterns = malloc(sizeof(FcPattern *));
+	patterns.length = 1;
+	patterns.patterns[0] = pat_output;
+
+	faces = xcbft_load_faces(patterns, dpi);
+
+	/* cleanup */
+	xcbft_patterns_holder_destroy(patterns);
+	FcCharSetDestroy(charset);
+
+	return faces;
+}
+
+struct xcbft_patterns_holder
+xcbft_query_fontsearch_all(FcStrSet *queries)
+{
+	struct xcbft_patterns_holder font_patterns;
+	FcPattern *font_pattern;
+    FcStrList *iterator;
+    FcChar8 *fontquery = NULL;
+	uint8_t current_allocated;
+
+	font_patterns.patterns = NULL;
+	font_patterns.length = 0;
+
+	/* start with 5, expand if needed */
+	current_allocated = 5;
+	font_patterns.patterns = malloc(sizeof(FcPattern *)*current_allocated);
+
+	/* safely iterate over set */
+	iterator = FcStrListCreate(queries);
+	FcStrListFirst(iterator);
+	while ((fontquery = FcStrListNext(iterator)) != NULL) {
+		font_pattern = xcbft_query_fontsearch(fontquery);
+		if (font_pattern != NULL) {
+			if (font_patterns.length + 1 > current_allocated) {
+				current_allocated += 5;
+				font_patterns.patterns = realloc(
+					font_patterns.patterns,
+					sizeof(FcPattern*) * current_allocated);
+			}
+			font_patterns.patterns[font_patterns.length] = font_pattern;
+			font_patterns.length++;
+		}
+	}
+	FcStrListDone(iterator);
+	/* end of safely iterate over set */
+
+	return font_patterns;
+}
+
+/* There's no way to predict the width and height of every characters */
+/* as they can go outside the em, so let's just use whatever we have as */
+/* the biggest pixel size so far in all the loaded patterns */
+double
+xcbft_get_pixel_size(struct xcbft_patterns_holder patterns)
+{
+	int i;
+	double maximum_pix_size;
+	FcValue fc_pixel_size;
+	FcResult result;
+
+	maximum_pix_size = 0;
+	for (i = 0; i < patterns.length; i++) {
+		result = FcPatternGet(patterns.patterns[i], FC_PIXEL_SIZE, 0, &fc_pixel_size);
+		if (result != FcResultMatch || fc_pixel_size.u.d == 0) {
+			fprintf(stderr, "font has no pixel size, using 12 by default");
+			fc_pixel_size.type = FcTypeInteger;
+			fc_pixel_size.u.d = 12.0;
+		}
+		if (fc_pixel_size.u.d > maximum_pix_size) {
+			maximum_pix_size = fc_pixel_size.u.d;
+		}
+	}
+
+	return maximum_pix_size;
+}
+
+/*
+ * Translate the rendering properties of a pattern (usually coming from
+ * fonts.conf or Xresources) into freetype load flags
+ */
+static void
+xcbft_render_settings(FcPattern *pattern, struct xcbft_face_info *info)
+{
+	FcBool antialias, hinting, autohint, embedded_bitmap;
+	int hint_style, rgba, lcd_filter;
+
+	if (FcPatternGetBool(pattern, FC_ANTIALIAS, 0, &antialias) != FcResultMatch)
+		antialias = FcTrue;
+	if (FcPatternGetBool(pattern, FC_HINTING, 0, &hinting) != FcResultMatch)
+		hinting = FcTrue;
+	if (FcPatternGetInteger(pattern, FC_HINT_STYLE, 0, &hint_style) != FcResultMatch)
+		hint_style = FC_HINT_FULL;
+	if (FcPatternGetBool(pattern, FC_AUTOHINT, 0, &autohint) != FcResultMatch)
+		autohint = FcFalse;
+	if (FcPatternGetBool(pattern, FC_EMBEDDED_BITMAP, 0, &embedded_bitmap) != FcResultMatch)
+		embedded_bitmap = FcTrue;
+	if (FcPatternGetInteger(pattern, FC_RGBA, 0, &rgba) != FcResultMatch)
+		rgba = FC_RGBA_UNKNOWN;
+	if (FcPatternGetInteger(pattern, FC_LCD_FILTER, 0, &lcd_filter) != FcResultMatch)
+		lcd_filter = FC_LCD_DEFAULT;
+
+	info->load_flags = FT_LOAD_DEFAULT;
+	info->lcd_filter = FT_LCD_FILTER_NONE;
+	if (!hinting || hint_style == FC_HINT_NONE) {
+		/* fast path, the hinter isn't run at all */
+		info->load_flags |= FT_LOAD_NO_HINTING | FT_LOAD_NO_AUTOHINT;
+		info->mode = XCBFT_HINT_NONE;
+	} else if (autohint) {
+		info->load_flags |= FT_LOAD_FORCE_AUTOHINT;
+		info->mode = XCBFT_HINT_AUTO;
+	} else if (hint_style == FC_HINT_SLIGHT) {
+		info->load_flags |= FT_LOAD_TARGET_LIGHT;
+		info->mode = XCBFT_HINT_LIGHT;
+	} else {
+		info->mode = XCBFT_HINT_NATIVE;
+	}
+
+	if (!antialias) {
+		/* rendered to 1 bit, hinted for monochrome too */
+		info->load_flags &= ~FT_LOAD_TARGET_LIGHT;
+		info->load_flags |= FT_LOAD_TARGET_MONO;
+		info->mode |= XCBFT_RENDER_MONO;
+	} else if (rgba == FC_RGBA_RGB || rgba == FC_RGBA_BGR ||
+			rgba == FC_RGBA_VRGB || rgba == FC_RGBA_VBGR) {
+		/* subpixel, rendered at three times the resolution */
+		info->load_flags &= ~FT_LOAD_TARGET_LIGHT;
+		if (rgba == FC_RGBA_RGB || rgba == FC_RGBA_BGR) {
+			info->load_flags |= FT_LOAD_TARGET_LCD;
+		} else {
+			info->load_flags |= FT_LOAD_TARGET_LCD_V;
+		}
+		switch (rgba) {
+		case FC_RGBA_BGR:
+			info->mode |= XCBFT_SUBPIXEL_BGR;
+			break;
+		case FC_RGBA_VRGB:
+			info->mode |= XCBFT_SUBPIXEL_VRGB;
+			break;
+		case FC_RGBA_VBGR:
+			info->mode |= XCBFT_SUBPIXEL_VBGR;
+			break;
+		default:
+			info->mode |= XCBFT_SUBPIXEL_RGB;
+			break;
+		}
+		switch (lcd_filter) {
+		case FC_LCD_NONE:
+			info->lcd_filter = FT_LCD_FILTER_NONE;
+			break;
+		case FC_LCD_LIGHT:
+			info->lcd_filter = FT_LCD_FILTER_LIGHT;
+			break;
+		case FC_LCD_LEGACY:
+			info->lcd_filter = FT_LCD_FILTER_LEGACY;
+			break;
+		default:
+			lcd_filter = FC_LCD_DEFAULT;
+			info->lcd_filter = FT_LCD_FILTER_DEFAULT;
+			break;
+		}
+		info->mode |= XCBFT_RENDER_LCD
+			| lcd_filter << XCBFT_LCD_FILTER_SHIFT;
+	} else {
+		info->mode |= XCBFT_RENDER_GRAY;
+	}
+	if (!embedded_bitmap) {
+		info->load_flags |= FT_LOAD_NO_BITMAP;
+	}
+}
+
+/*
+ * Set the size of a face, faces with only bitmaps (color emoji) get
+ * the closest strike not smaller than the size, their color glyphs are
+ * scaled down when rasterized.
+ *
+ * Returns 0 if the size couldn't be set
+ */
+static int
+xcbft_set_face_size(FT_Face face, double pixel_size, long dpi,
+	struct xcbft_face_info *info)
+{
+	int i, best;
+	double strike, best_strike;
+
+	info->pixel_size = pixel_size;
+	info->scale = 1.0;
+	if (FT_IS_SCALABLE(face) || face->num_fixed_sizes == 0) {
+		/* pixel_size/ (dpi/72.0) */
+		return FT_Set_Char_Size(face, 0,
+			(pixel_size/((double)dpi/72.0))*64,
+			dpi, dpi) == FT_Err_Ok;
+	}
+
+	best = 0;
+	best_strike = face->available_sizes[0].y_ppem/64.0;
+	for (i = 1; i < face->num_fixed_sizes; i++) {
+		strike = face->available_sizes[i].y_ppem/64.0;
+		if ((best_strike < pixel_size && strike > best_strike) ||
+				(strike >= pixel_size && strike < best_strike)) {
+			best = i;
+			best_strike = strike;
+		}
+	}
+	if (FT_Select_Size(face, best) != FT_Err_Ok) {
+		return 0;
+	}
+	if (best_strike > pixel_size) {
+		info->scale = pixel_size/best_strike;
+	}
+	return 1;
+}
+
+/*
+ * Open the face described by a pattern and set it up (matrix, size)
+ *
+ * Returns 0 if the face couldn't be loaded
+ */
+static int
+xcbft_open_face(FT_Library library, FcPattern *pattern, long dpi,
+	FT_Face *face, struct xcbft_face_info *info)
+{
+	FcResult result;
+	FcValue fc_file, fc_index, fc_matrix, fc_pixel_size;
+	FT_Matrix ft_matrix;
+	FT_Error error;
+
+	/* get the information needed from the pattern */
+	result = FcPatternGet(pattern, FC_FILE, 0, &fc_file);
+	if (result != FcResultMatch) {
+		fprintf(stderr, "font has not file location");
+		return 0;
+	}
+	result = FcPatternGet(pattern, FC_INDEX, 0, &fc_index);
+	if (result != FcResultMatch) {
+		fprintf(stderr, "font has no index, using 0 by default");
+		fc_index.type = FcTypeInteger;
+		fc_index.u.i = 0;
+	}
+	/* TODO: load more info like */
+	/*	verticallayout */
+
+	/* load the face */
+	XCBFT_TRACE_BEGIN(opening);
+	error = FT_New_Face(
+			library,
+			(const char *) fc_file.u.s,
+			fc_index.u.i,
+			face);
+	XCBFT_TRACE_END("FT_New_Face", opening);
+	if (error == FT_Err_Unknown_File_Format) {
+		fprintf(stderr, "wrong file format");
+		return 0;
+	} else if (error == FT_Err_Cannot_Open_Resource) {
+		fprintf(stderr, "could not open resource");
+		return 0;
+	} else if (error) {
+		fprintf(stderr, "another sort of error");
+		return 0;
+	}
+	if (*face == NULL) {
+		fprintf(stderr, "face was empty");
+		return 0;
+	}
+	xcbft_count(XCBFT_COUNT_FACES_OPENED, 1);
+
+	result = FcPatternGet(pattern, FC_MATRIX, 0, &fc_matrix);
+	if (result == FcResultMatch) {
+		ft_matrix.xx = (FT_Fixed)(fc_matrix.u.m->xx * 0x10000L);
+		ft_matrix.xy = (FT_Fixed)(fc_matrix.u.m->xy * 0x10000L);
+		ft_matrix.yx = (FT_Fixed)(fc_matrix.u.m->yx * 0x10000L);
+		ft_matrix.yy = (FT_Fixed)(fc_matrix.u.m->yy * 0x10000L);
+
+		/* apply the matrix */
+		FT_Set_Transform(
+			*face,
+			&ft_matrix,
+			NULL);
+	}
+
+	result = FcPatternGet(pattern, FC_PIXEL_SIZE, 0, &fc_pixel_size);
+	if (result != FcResultMatch || fc_pixel_size.u.d == 0) {
+		fprintf(stderr, "font has no pixel size, using 12 by default");
+		fc_pixel_size.type = FcTypeInteger;
+		fc_pixel_size.u.d = 12;
+	}
+	/*error = FT_Set_Pixel_Sizes( */
+	/*	*face, */
+	/*	0, // width */
+	/*	fc_pixel_size.u.d); // height */
+
+	if (!xcbft_set_face_size(*face, fc_pixel_size.u.d, dpi, info)) {
+		perror(NULL);
+		fprintf(stderr, "could not char size");
+		FT_Done_Face(*face);
+		return 0;
+	}
+
+	FT_Select_Charmap(*face, ft_encoding_unicode);
+	xcbft_render_settings(pattern, info);
+	if (FT_HAS_COLOR(*face)) {
+		info->load_flags |= FT_LOAD_COLOR;
+	}
+
+	return 1;
+}
+
+/* FreeType blocks have their size in front, to count what is freed */
+#define XCBFT_FT_HEADER _Alignof(max_align_t)
+
+static void *
+xcbft_ft_alloc(FT_Memory memory, long size)
+{
+	struct xcbft_ft_memory *counted = memory->user;
+	unsigned char *block;
+
+	block = malloc(XCBFT_FT_HEADER + size);
+	if (block == NULL) {
+		return NULL;
+	}
+	*(size_t *)block = size;
+	atomic_fetch_add_explicit(&counted->bytes, size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&xcbft_ft_bytes, size, memory_order_relaxed);
+	return block + XCBFT_FT_HEADER;
+}
+
+static void
+xcbft_ft_free(FT_Memory memory, void *pointer)
+{
+	struct xcbft_ft_memory *counted = memory->user;
+	unsigned char *block;
+	size_t size;
+
+	if (pointer == NULL) {
+		return;
+	}
+	block = (unsigned char *)pointer - XCBFT_FT_HEADER;
+	size = *(size_t *)block;
+	atomic_fetch_sub_explicit(&counted->bytes, size, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&xcbft_ft_bytes, size, memory_order_relaxed);
+	free(block);
+}
+
+static void *
+xcbft_ft_realloc(FT_Memory memory, long cur_size, long new_size,
+	void *pointer)
+{
+	struct xcbft_ft_memory *counted = memory->user;
+	unsigned char *block;
+	size_t size;
+
+	(void)cur_size;
+	if (pointer == NULL) {
+		return xcbft_ft_alloc(memory, new_size);
+	}
+	block = (unsigned char *)pointer - XCBFT_FT_HEADER;
+	size = *(size_t *)block;
+	block = realloc(block, XCBFT_FT_HEADER + new_size);
+	if (block == NULL) {
+		return NULL;
+	}
+	*(size_t *)block = new_size;
+	atomic_fetch_add_explicit(&counted->bytes, new_size - size,
+		memory_order_relaxed);
+	atomic_fetch_add_explicit(&xcbft_ft_bytes, new_size - size,
+		memory_order_relaxed);
+	return block + XCBFT_FT_HEADER;
+}
+
+/* a FreeType library allocating through counted */
+static FT_Error
+xcbft_ft_library(struct xcbft_ft_memory *counted, FT_Library *library)
+{
+	FT_Error error;
+
+	counted->memory.user = counted;
+	counted->memory.alloc = xcbft_ft_alloc;
+	counted->memory.free = xcbft_ft_free;
+	counted->memory.realloc = xcbft_ft_realloc;
+	atomic_init(&counted->bytes, 0);
+	error = FT_New_Library(&counted->memory, library);
+	if (error != FT_Err_Ok) {
+		return error;
+	}
+	FT_Add_Default_Modules(*library);
+	FT_Set_Default_Properties(*library);
+	return FT_Err_Ok;
+}
+
+/* make the cache part of the totals and of the memory budget */
+static void
+xcbft_memory_register(struct xcbft_glyph_cache *cache)
+{
+	pthread_mutex_lock(&xcbft_caches_lock);
+	cache->next = xcbft_caches;
+	xcbft_caches = cache;
+	pthread_mutex_unlock(&xcbft_caches_lock);
+}
+
+static void
+xcbft_memory_unregister(struct xcbft_glyph_cache *cache)
+{
+	struct xcbft_glyph_cache **link;
+
+	pthread_mutex_lock(&xcbft_caches_lock);
+	for (link = &xcbft_caches; *link != NULL; link = &(*link)->next) {
+		if (*link == cache) {
+			*link = cache->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&xcbft_caches_lock);
+}
+
+/*
+ * Bring the client caches of every face holder back under 3/4 of the
+ * budget. What is cheapest to get back goes first: the runs of the texts,
+ * the glyphs kept for the views, the advances. The glyph images belong
+ * to the thread of their face holder, it frees the old ones at its next
+ * load.
+ */
+static void
+xcbft_memory_trim(size_t budget)
+{
+	struct xcbft_glyph_cache *cache;
+	size_t target;
+	int step;
+
+	target = XCBFT_BUDGET_TRIM(budget);
+	pthread_mutex_lock(&xcbft_caches_lock);
+	for (step = 0; step < 4 && atomic_load(&xcbft_cache_bytes) > target;
+			step++) {
+		for (cache = xcbft_caches; cache != NULL; cache = cache->next) {
+			if (step == 0 && cache->runs != NULL) {
+				xcbft_run_cache_clear(cache->runs);
+			} else if (step == 1 && cache->raster != NULL) {
+				xcbft_raster_cache_clear(cache->raster);
+			} else if (step == 2 && cache->metrics != NULL) {
+				xcbft_metric_cache_clear(cache->metrics);
+			} else if (step == 3) {
+				atomic_store(&cache->drop_images, 1);
+			}
+		}
+	}
+	pthread_mutex_unlock(&xcbft_caches_lock);
+}
+
+/* trim when over the memory budget, one thread at a time */
+static void
+xcbft_memory_check(void)
+{
+	size_t budget;
+
+	budget = atomic_load_explicit(&xcbft_cache_budget, memory_order_relaxed);
+	if (budget == 0 || atomic_load_explicit(&xcbft_cache_bytes,
+			memory_order_relaxed) <= budget) {
+		return;
+	}
+	if (atomic_flag_test_and_set(&xcbft_trimming)) {
+		return;
+	}
+	xcbft_memory_trim(budget);
+	atomic_flag_clear(&xcbft_trimming);
+}
+
+struct xcbft_face_holder
+xcbft_load_faces(struct xcbft_patterns_holder patterns, long dpi)
+{
+	int i;
+	struct xcbft_face_holder faces;
+	FT_Error error;
+	FT_Library library;
+	struct xcbft_ft_memory *ft_memory;
+
+	faces.length = 0;
+	faces.library = NULL;
+	faces.faces = NULL;
+	faces.patterns = NULL;
+	faces.cache = NULL;
+	ft_memory = malloc(sizeof(struct xcbft_ft_memory));
+	error = xcbft_ft_library(ft_memory, &library);
+	if (error != FT_Err_Ok) {
+		perror(NULL);
+		free(ft_memory);
+		return faces;
+	}
+
+	/* allocate the same size as patterns as it should be <= its length */
+	faces.faces = malloc(sizeof(FT_Face)*patterns.length);
+	faces.patterns = malloc(sizeof(FcPattern *)*patterns.length);
+	faces.cache = calloc(1, sizeof(struct xcbft_glyph_cache));
+	faces.cache->infos = malloc(
+		sizeof(struct xcbft_face_info)*patterns.length);
+	faces.cache->generation = xcbft_config_generation;
+	faces.cache->dpi = dpi;
+	faces.cache->sizes = malloc(sizeof(FT_Size)*patterns.length);
+	faces.cache->raster = calloc(1, sizeof(struct xcbft_raster_cache));
+	faces.cache->raster->refs = 1;
+	pthread_mutex_init(&faces.cache->raster->lock, NULL);
+	faces.cache->metrics = xcbft_metric_cache_create();
+	faces.cache->fallbacks = xcbft_fallbacks_create();
+	faces.cache->runs = xcbft_run_cache_create();
+	faces.cache->ft_memory = ft_memory;
+	xcbft_memory_register(faces.cache);
+
+	for (i = 0; i < patterns.length; i++) {
+		if (!xcbft_open_face(library, patterns.patterns[i], dpi,
+				&(faces.faces[faces.length]),
+				&faces.cache->infos[faces.length])) {
+			continue;
+		}
+
+		/* keep the pattern so the face can be opened again elsewhere */
+		FcPatternReference(patterns.patterns[i]);
+		faces.patterns[faces.length] = patterns.patterns[i];
+		xcbft_file_stamp_get(patterns.patterns[i],
+			&faces.cache->infos[faces.length].stamp);
+		/* the size the face came with, owned by the face */
+		faces.cache->sizes[faces.length] = faces.faces[faces.length]->size;
+		faces.length++;
+	}
+
+	faces.library = library;
+
+	return faces;
+}
+
+/*
+ * Another face holder with the same faces, for another connection or
+ * another dpi. The pixel sizes are scaled by dpi over the dpi faces was
+ * made for, without opening the fonts again: each view has its own
+ * FT_Size per face. Views have their own glyphsets, a glyph rasterized
+ * by one is only uploaded by the others.
+ *
+ * The faces are freed with the last of the holder and its views.
+ */
+struct xcbft_face_holder
+xcbft_face_holder_view(struct xcbft_face_holder faces, long dpi)
+{
+	struct xcbft_face_holder view;
+	struct xcbft_glyph_cache *cache;
+	uint8_t i;
+
+	view = faces;
+	cache = calloc(1, sizeof(struct xcbft_glyph_cache));
+	cache->infos = malloc(sizeof(struct xcbft_face_info)*(faces.length+1));
+	memcpy(cache->infos, faces.cache->infos,
+		sizeof(struct xcbft_face_info)*faces.length);
+	cache->generation = faces.cache->generation;
+	cache->dpi = dpi;
+	cache->sizes = malloc(sizeof(FT_Size)*(faces.length+1));
+	cache->owns_sizes = calloc(faces.length+1, 1);
+	cache->raster = faces.cache->raster;
+	cache->metrics = xcbft_metric_cache_create();
+	cache->fallbacks = xcbft_fallbacks_create();
+	cache->runs = xcbft_run_cache_create();
+	cache->ft_memory = faces.cache->ft_memory;
+	xcbft_memory_register(cache);
+	pthread_mutex_lock(&cache->raster->lock);
+	cache->raster->refs++;
+	pthread_mutex_unlock(&cache->raster->lock);
+
+	for (i = 0; i < faces.length; i++) {
+		if (FT_New_Size(faces.faces[i], &cache->sizes[i]) != FT_Err_Ok) {
+			fprintf(stderr, "could not add a size to a face, "
+				"the view keeps the one of the face holder\n");
+			cache->sizes[i] = faces.cache->sizes[i];
+			continue;
+		}
+		cache->owns_sizes[i] = 1;
+		FT_Activate_Size(cache->sizes[i]);
+		xcbft_set_face_size(faces.faces[i],
+			faces.cache->infos[i].pixel_size * dpi / faces.cache->dpi,
+			dpi, &cache->infos[i]);
+	}
+	view.cache = cache;
+
+	return view;
+}
+
+FcStrSet*
+xcbft_extract_fontsearch_list(char *string)
+{
+	FcStrSet *fontsearch = NULL;
+	FcChar8 *fontquery;
+	FcBool result = FcFalse;
+	char *r = strdup(string);
+	char *p_to_r = r;
+	char *token = NULL;
+	char *saveptr = NULL;
+
+	fontsearch = FcStrSetCreate();
+
+	token = strtok_r(r, ",", &saveptr);
+	while (token != NULL) {
+		fontquery = (FcChar8*)token;
+		result = FcStrSetAdd(fontsearch, fontquery);
+		if (result == FcFalse) {
+			fprintf(stderr,
+				"Couldn't add fontquery to fontsearch set");
+		}
+		token = strtok_r(NULL, ",", &saveptr);
+	}
+
+	free(p_to_r);
+
+	return fontsearch;
+}
+
+
+
+void
+xcbft_patterns_holder_destroy(struct xcbft_patterns_holder patterns)
+{
+	int i = 0;
+
+	for (; i < patterns.length; i++) {
+		FcPatternDestroy(patterns.patterns[i]);
+	}
+	free(patterns.patterns);
+}
+
+void
+xcbft_face_holder_destroy(struct xcbft_face_holder faces)
+{
+	struct xcbft_ft_memory *ft_memory = NULL;
+	int i = 0;
+
+	if (faces.cache) {
+		xcbft_memory_unregister(faces.cache);
+		ft_memory = faces.cache->ft_memory;
+	}
+	if (faces.cache && faces.cache->published) {
+		for (i = 0; i < faces.length; i++) {
+			if (faces.cache->published[i] != XCB_ATOM_NONE) {
+				xcb_delete_property(faces.cache->c,
+					xcb_setup_roots_iterator(
+					xcb_get_setup(faces.cache->c)).data->root,
+					faces.cache->published[i]);
+			}
+		}
+		xcbft_flush(faces.cache->c);
+	}
+	/* other views still use the faces */
+	if (faces.cache && faces.cache->raster &&
+			xcbft_raster_cache_unref(faces.cache->raster) > 0) {
+		for (i = 0; faces.cache->owns_sizes && i < faces.length; i++) {
+			if (faces.cache->owns_sizes[i]) {
+				FT_Done_Size(faces.cache->sizes[i]);
+			}
+		}
+		xcbft_glyph_cache_destroy(faces.cache);
+		return;
+	}
+	for (i = 0; i < faces.length; i++) {
+		FT_Done_Face(faces.faces[i]);
+		FcPatternDestroy(faces.patterns[i]);
+	}
+	if (faces.faces) {
+		free(faces.faces);
+	}
+	if (faces.patterns) {
+		free(faces.patterns);
+	}
+	if (faces.cache) {
+		xcbft_glyph_cache_destroy(faces.cache);
+	}
+	FT_Done_Library(faces.library);
+	free(ft_memory);
+}
+
+/* same font file at the same index */
+static int
+xcbft_pattern_same_file(FcPattern *a, FcPattern *b)
+{
+	FcValue file_a, file_b, index_a, index_b;
+
+	if (FcPatternGet(a, FC_FILE, 0, &file_a) != FcResultMatch ||
+			FcPatternGet(b, FC_FILE, 0, &file_b) != FcResultMatch) {
+		return 0;
+	}
+	if (FcPatternGet(a, FC_INDEX, 0, &index_a) != FcResultMatch) {
+		index_a.u.i = 0;
+	}
+	if (FcPatternGet(b, FC_INDEX, 0, &index_b) != FcResultMatch) {
+		index_b.u.i = 0;
+	}
+	return FcStrCmp(file_a.u.s, file_b.u.s) == 0 &&
+		index_a.u.i == index_b.u.i;
+}
+
+/*
+ * Check if fonts were installed, removed or changed since the
+ * configuration was loaded and bring it up to date if so.
+ * Only the cached queries whose result moved to another font file are
+ * replaced, face holders are updated with xcbft_face_holder_refresh.
+ *
+ * Meant to be called from time to time by long running processes.
+ * moved, if not NULL, is set to the number of cached queries that now
+ * match another font.
+ *
+ * Returns 1 if the configuration changed
+ */
+int
+xcbft_rescan(unsigned int *moved)
+{
+	struct xcbft_query_entry *first, *entry;
+	FcPattern **patterns, *old;
+	unsigned int changed, length, i;
+
+	if (moved != NULL) {
+		*moved = 0;
+	}
+	if (FcConfigUptoDate(NULL) == FcTrue) {
+		return 0;
+	}
+	if (FcInitBringUptoDate() == FcFalse) {
+		fprintf(stderr, "Could not bring fontconfig up to date");
+		return 0;
+	}
+
+	/*
+	 * entries are only ever added in front and freed by xcbft_done, the
+	 * ones from first on can be matched again without holding the lock
+	 */
+	pthread_mutex_lock(&xcbft_query_cache_lock);
+	first = xcbft_query_cache;
+	pthread_mutex_unlock(&xcbft_query_cache_lock);
+	length = 0;
+	for (entry = first; entry != NULL; entry = entry->next) {
+		length++;
+	}
+	patterns = malloc(sizeof(FcPattern *)*(length ? length : 1));
+	for (entry = first, i = 0; entry != NULL; entry = entry->next, i++) {
+		patterns[i] = xcbft_query_fontsearch_uncached(entry->fontquery);
+	}
+
+	changed = 0;
+	pthread_mutex_lock(&xcbft_query_cache_lock);
+	for (entry = first, i = 0; entry != NULL; entry = entry->next, i++) {
+		if (patterns[i] == NULL ||
+				xcbft_pattern_same_file(patterns[i], entry->pattern)) {
+			continue;
+		}
+		/* the old one is destroyed outside of the lock */
+		old = entry->pattern;
+		entry->pattern = patterns[i];
+		patterns[i] = old;
+		changed++;
+	}
+	pthread_mutex_unlock(&xcbft_query_cache_lock);
+	for (i = 0; i < length; i++) {
+		if (patterns[i] != NULL) {
+			FcPatternDestroy(patterns[i]);
+		}
+	}
+	free(patterns);
+	if (moved != NULL) {
+		*moved = changed;
+	}
+
+	atomic_fetch_add(&xcbft_config_generation, 1);
+	return 1;
+}
+
+/*
+ * After the configuration changed (xcbft_rescan), reopen the faces whose
+ * font file changed and forget their glyphs, the others stay cached.
+ * Glyphs from fallback fonts are dropped too as the new fonts may be the
+ * better match for them. Faces that have views aren't reopened, make
+ * new views from a new face holder instead. The faces are reopened at
+ * the dpi they were loaded with, dpi is only kept for compatibility.
+ *
+ * Returns the number of faces reopened
+ */
+int
+xcbft_face_holder_refresh(struct xcbft_face_holder faces, long dpi)
+{
+	struct xcbft_glyph_cache *cache = faces.cache;
+	struct xcbft_file_stamp stamp;
+	struct xcbft_face_info info;
+	uint8_t drop[256];
+	unsigned int i, workers;
+	unsigned long generation;
+	int reopened;
+	FT_Face face;
+
+	generation = atomic_load(&xcbft_config_generation);
+	if (cache == NULL || cache->generation == generation ||
+			cache->raster->refs > 1) {
+		return 0;
+	}
+
+	memset(drop, 0, sizeof(drop));
+	reopened = 0;
+	for (i = 0; i < faces.length; i++) {
+		xcbft_file_stamp_get(faces.patterns[i], &stamp);
+		if (memcmp(&stamp, &cache->infos[i].stamp, sizeof(stamp)) == 0) {
+			continue;
+		}
+		/*
+		 * at the dpi the holder was loaded with, if it can't be opened
+		 * anymore keep the old one (still mapped) and its info
+		 */
+		if (xcbft_open_face(faces.library, faces.patterns[i], cache->dpi,
+				&face, &info)) {
+			FT_Done_Face(faces.faces[i]);
+			faces.faces[i] = face;
+			cache->sizes[i] = face->size;
+			cache->infos[i] = info;
+		}
+		cache->infos[i].stamp = stamp;
+		drop[i] = 1;
+		reopened++;
+	}
+	drop[XCBFT_FACE_FALLBACK] = 1;
+	xcbft_glyph_cache_drop(cache, drop, 0);
+	if (reopened > 0) {
+		xcbft_run_cache_clear(cache->runs);
+	}
+	/* the new configuration may have better fallback fonts */
+	xcbft_fallbacks_clear(cache->fallbacks);
+	/* the advances too, and the copies of the measuring threads */
+	if (reopened > 0) {
+		xcbft_metric_cache_clear(cache->metrics);
+		atomic_fetch_add(&cache->metrics->generation, 1);
+	} else {
+		xcbft_metric_cache_drop(cache->metrics, drop);
+	}
+	/* the maps still have the dropped glyphs */
+	if (reopened > 0 && cache->published != NULL) {
+		xcbft_share_publish(cache->c, faces);
+	}
+
+	/* the workers have their own copies of the faces */
+	if (reopened > 0 && cache->pool != NULL) {
+		workers = cache->pool->length;
+		dpi = cache->pool->dpi;
+		xcbft_raster_pool_destroy(cache->pool);
+		cache->pool = NULL;
+		xcbft_raster_pool_start(faces, workers, dpi);
+	}
+
+	cache->generation = generation;
+	return reopened;
+}
+
+xcb_render_picture_t
+xcbft_create_pen(xcb_connection_t *c, xcb_render_color_t color)
+{
+	const xcb_render_query_pict_formats_reply_t *fmt_rep = xcb_render_util_query_formats(c);
+	/* alpha can only be used with a picture containing a pixmap */
+	xcb_render_pictforminfo_t *fmt = xcb_render_util_find_standard_format(
+		fmt_rep,
+		XCB_PICT_STANDARD_ARGB_32
+	);
+
+	xcb_drawable_t root = xcb_setup_roots_iterator(
+			xcb_get_setup(c)
+		).data->root;
+
+	xcb_pixmap_t pm = xcb_generate_id(c);
+    xcb_rectangle_t rect = {0, 0, 1, 1};
+	xcb_render_picture_t picture = xcb_generate_id(c);
+
+	uint32_t values[1];
+	values[0] = XCB_RENDER_REPEAT_NORMAL;
+
+	xcb_create_pixmap(c, 32, pm, root, 1, 1);
+	xcb_render_create_picture(c,
+		picture,
+		pm,
+		fmt->id,
+		XCB_RENDER_CP_REPEAT,
+		values);
+
+	xcb_render_fill_rectangles(c,
+		XCB_RENDER_PICT_OP_OVER,
+		picture,
+		color, 1, &rect);
+
+	xcb_free_pixmap(c, pm);
+	return picture;
+}
+
+/* the faces may be shared by views of other sizes, use ours */
+static void
+xcbft_face_holder_activate(struct xcbft_face_holder faces)
+{
+	uint8_t i;
+
+	for (i = 0; i < faces.length; i++) {
+		if (faces.faces[i]->size != faces.cache->sizes[i]) {
+			FT_Activate_Size(faces.cache->sizes[i]);
+		}
+	}
+}
+
+/*
+ * Load text at the current tick of the clock of the cache, the glyphs
+ * loaded at the same tick are kept when trimming to the budget.
+ */
+static struct xcbft_glyphset_and_advance
+xcbft_load_glyphset_tick(
+	xcb_connection_t *c,
+	struct xcbft_face_holder faces,
+	struct utf_holder text,
+	long dpi)
+{
+	unsigned int i, j, r, jobs_length, glyphs_length, runs_length, misses;
+	xcb_render_glyphset_t gs;
+	struct xcbft_face_holder *fallback;
+	struct xcbft_font_run *runs;
+	struct xcbft_glyph_entry *entry;
+	struct xcbft_raster_job *jobs;
+	struct xcbft_glyph_bitmap *glyphs, **to_upload;
+	FcCharSet *queued, *waiting;
+	FT_Face face;
+	const struct xcbft_face_info *info;
+	FT_Vector total_advance, glyph_advance;
+	struct xcbft_glyphset_and_advance glyphset_advance;
+	uint8_t lookup_running;
+	static const uint8_t no_drop[256];
+
+	XCBFT_TRACE_BEGIN(loading);
+	/* fallback fonts found since, once per tick for the runs of a frame */
+	if (faces.cache->fallbacks_clock != faces.cache->clock) {
+		faces.cache->fallbacks_clock = faces.cache->clock;
+		if (xcbft_fallbacks_replace(faces.cache)) {
+			xcbft_glyph_cache_drop(faces.cache, no_drop, 0);
+		}
+	}
+	/* over the memory budget, the images not drawn since the last tick */
+	if (atomic_exchange(&faces.cache->drop_images, 0)) {
+		for (i = 0; i < faces.cache->size; i++) {
+			entry = &faces.cache->entries[i];
+			if (entry->used && entry->last_use < faces.cache->clock) {
+				xcbft_glyph_image_release(faces.cache, entry->image);
+				entry->image = NULL;
+			}
+		}
+	}
+	total_advance.x = total_advance.y = 0;
+	/* the glyphset of the first face, glyphs of other formats are elsewhere */
+	gs = xcbft_glyph_cache_glyphset(c, faces.cache,
+		xcbft_mode_format(faces.cache->infos[0].mode));
+
+	/* nothing allocated when every glyph is there already */
+	for (i = 0; i < text.length; i++) {
+		entry = xcbft_glyph_cache_find(faces.cache, text.str[i]);
+		if (entry == NULL ||
+				(entry->image == NULL && faces.cache->keep_images) ||
+				(entry->offline && c != NULL)) {
+			break;
+		}
+		entry->last_use = faces.cache->clock;
+		total_advance.x += entry->advance.x;
+		total_advance.y += entry->advance.y;
+	}
+	if (i == text.length) {
+		xcbft_count(XCBFT_COUNT_CACHE_HITS, text.length);
+		glyphset_advance.advance = total_advance;
+		glyphset_advance.glyphset = gs;
+		XCBFT_TRACE_END("load_glyphset", loading);
+		return glyphset_advance;
+	}
+	total_advance.x = total_advance.y = 0;
+
+	jobs = malloc(sizeof(struct xcbft_raster_job)*text.length);
+	glyphs = malloc(sizeof(struct xcbft_glyph_bitmap)*text.length);
+	jobs_length = glyphs_length = 0;
+	queued = FcCharSetCreate();
+	waiting = NULL;
+	xcbft_face_holder_activate(faces);
+	runs = xcbft_itemize_faces(faces.cache->runs, faces.faces, faces.length,
+		text, &runs_length);
+	r = misses = 0;
+
+	/* find what is missing, the runs say which face has it */
+	for (i = 0; i < text.length; i++) {
+		while (i >= runs[r].start + runs[r].length) {
+			r++;
+		}
+		entry = xcbft_glyph_cache_find(faces.cache, text.str[i]);
+		if (entry != NULL) {
+			entry->last_use = faces.cache->clock;
+		}
+		/*
+		 * the shm backend needs the image, loaded again if not kept, and
+		 * what was only drawn in memory is loaded again to be sent
+		 */
+		if ((entry != NULL &&
+				(entry->image != NULL || !faces.cache->keep_images) &&
+				(!entry->offline || c == NULL)) ||
+				FcCharSetHasChar(queued, text.str[i])) {
+			continue;
+		}
+		FcCharSetAddChar(queued, text.str[i]);
+		misses++;
+
+		/* here use face at index j, maybe already rasterized by a view */
+		j = runs[r].face;
+		if (j != XCBFT_FACE_FALLBACK && faces.cache->raster->refs > 1 &&
+				xcbft_raster_cache_get(faces.cache, text.str[i], j,
+					&glyphs[glyphs_length])) {
+			glyphs[glyphs_length].face = j;
+			glyphs_length++;
+			continue;
+		}
+		if (j != XCBFT_FACE_FALLBACK) {
+			jobs[jobs_length].charcode = text.str[i];
+			jobs[jobs_length].face = j;
+			jobs[jobs_length].mode = faces.cache->infos[j].mode;
+			jobs_length++;
+			continue;
+		}
+
+		/* fallback, looked up without waiting */
+		/* TODO pass at least some of the query (font size, italic, etc..) */
+		pthread_mutex_lock(&faces.cache->fallbacks->lock);
+		fallback = xcbft_fallbacks_find(faces.cache->fallbacks,
+			text.str[i], dpi, &lookup_running);
+		if (fallback == NULL) {
+			/* draw a block using whatever font */
+			face = faces.faces[0];
+			info = &faces.cache->infos[0];
+			j = 0;
+			/* until the font is found */
+			if (lookup_running) {
+				if (waiting == NULL) {
+					waiting = FcCharSetCreate();
+				}
+				FcCharSetAddChar(waiting, text.str[i]);
+				j = XCBFT_FACE_FALLBACK;
+			}
+		} else {
+			xcbft_set_face_size(fallback->faces[0],
+				faces.cache->infos[0].pixel_size, dpi,
+				&fallback->cache->infos[0]);
+			face = fallback->faces[0];
+			info = &fallback->cache->infos[0];
+			j = XCBFT_FACE_FALLBACK;
+		}
+		if (!xcbft_rasterize_glyph(face, text.str[i], info,
+				&glyphs[glyphs_length])) {
+			xcbft_empty_glyph(text.str[i], &glyphs[glyphs_length]);
+			glyphs[glyphs_length].mode = info->mode;
+		}
+		pthread_mutex_unlock(&faces.cache->fallbacks->lock);
+		glyphs[glyphs_length].face = j;
+		glyphs_length++;
+	}
+	FcCharSetDestroy(queued);
+	free(runs);
+	xcbft_count(XCBFT_COUNT_CACHE_HITS, text.length - misses);
+	xcbft_count(XCBFT_COUNT_CACHE_MISSES, misses);
+
+	if (faces.cache->pool != NULL && jobs_length >= XCBFT_POOL_MIN_GLYPHS) {
+		xcbft_raster_pool_run(c, faces, jobs, jobs_length);
+	} else {
+		for (i = 0; i < jobs_length; i++) {
+			if (!xcbft_rasterize_glyph(faces.faces[jobs[i].face],
+					jobs[i].charcode,
+					&faces.cache->infos[jobs[i].face],
+					&glyphs[glyphs_length])) {
+				xcbft_empty_glyph(jobs[i].charcode,
+					&glyphs[glyphs_length]);
+				glyphs[glyphs_length].mode = jobs[i].mode;
+			}
+			glyphs[glyphs_length].face = jobs[i].face;
+			glyphs_length++;
+		}
+	}
+
+	/* everything rasterized here goes in one go */
+	if (glyphs_length > 0) {
+		to_upload = malloc(sizeof(struct xcbft_glyph_bitmap *)*glyphs_length);
+		for (i = 0; i < glyphs_length; i++) {
+			glyph_advance.x = glyphs[i].info.x_off;
+			glyph_advance.y = glyphs[i].info.y_off;
+			glyphs[i].gid = xcbft_glyph_cache_insert(faces.cache,
+				glyphs[i].charcode, glyphs[i].mode, glyph_advance,
+				glyphs[i].face);
+			to_upload[i] = &glyphs[i];
+			if (waiting != NULL &&
+					FcCharSetHasChar(waiting, glyphs[i].charcode)) {
+				xcbft_glyph_cache_lookup(faces.cache, glyphs[i].charcode,
+					glyphs[i].mode)->fallback = XCBFT_FALLBACK_WAITING;
+			}
+		}
+		xcbft_glyph_cache_upload(c, faces.cache, to_upload, glyphs_length);
+		for (i = 0; i < glyphs_length; i++) {
+			free(glyphs[i].data);
+		}
+		free(to_upload);
+	}
+	if (waiting != NULL) {
+		FcCharSetDestroy(waiting);
+	}
+	free(glyphs);
+	free(jobs);
+
+	for (i = 0; i < text.length; i++) {
+		entry = xcbft_glyph_cache_find(faces.cache, text.str[i]);
+		if (entry != NULL) {
+			total_advance.x += entry->advance.x;
+			total_advance.y += entry->advance.y;
+		}
+	}
+	xcbft_memory_check();
+
+	glyphset_advance.advance = total_advance;
+	glyphset_advance.glyphset = gs;
+	XCBFT_TRACE_END("load_glyphset", loading);
+	return glyphset_advance;
+}
+
+/*
+ * Make sure every character of text is in the glyphset of the faces
+ * and return it with the total advance of the text.
+ *
+ * The glyphset belongs to the face holder and is kept between calls,
+ * glyphs that were already uploaded (or prewarmed) aren't loaded again.
+ * It is freed with the face holder, don't free it outside. With a
+ * budget, glyphs not in text may be freed from it by the call.
+ * Without a connection (c NULL) the glyphs are rasterized and counted
+ * but go nowhere, and the glyphset is 0.
+ * Characters needing a fallback font get a glyph of the first face until
+ * it is found (see xcbft_fallback_fd).
+ */
+struct xcbft_glyphset_and_advance
+xcbft_load_glyphset(
+	xcb_connection_t *c,
+	struct xcbft_face_holder faces,
+	struct utf_holder text,
+	long dpi)
+{
+	faces.cache->clock++;
+	return xcbft_load_glyphset_tick(c, faces, text, dpi);
+}
+
+/*
+ * Keep the glyphs uploaded for the faces under that many bytes of
+ * server memory, 0 for no limit. When over it, the glyphs that haven't
+ * been drawn for the longest time are freed, they are loaded again if
+ * needed. The atlas isn't counted, its size is fixed.
+ */
+void
+xcbft_glyph_budget(struct xcbft_face_holder faces, size_t bytes)
+{
+	faces.cache->budget = bytes;
+	faces.cache->clock++;
+	xcbft_glyph_cache_trim(faces.cache);
+}
+
+/* bytes taken by the glyphs of the faces on the server, atlas included */
+size_t
+xcbft_glyph_memory(struct xcbft_face_holder faces)
+{
+	enum xcbft_glyph_format format;
+	size_t bytes = 0;
+
+	for (format = 0; format < XCBFT_FORMATS; format++) {
+		bytes += faces.cache->glyphsets[format].bytes;
+	}
+	return bytes + faces.cache->atlas_bytes;
+}
+
+/*
+ * Publish the glyphs of the faces on the root window, for the other
+ * xcbft clients of the server to draw with them without uploading
+ * anything (see xcbft_share_attach). One property per face, holding the
+ * glyphset ids and, for each glyph, its charcode, mode, id and advance.
+ * Glyphs loaded afterwards are appended as they're uploaded, the
+ * properties are deleted with the face holder.
+ *
+ * Glyphs in an atlas aren't published. A published face holder isn't
+ * trimmed to its budget since the other clients may be drawing any of
+ * its glyphs.
+ *
+ * Returns the number of glyphs published
+ */
+int
+xcbft_share_publish(xcb_connection_t *c, struct xcbft_face_holder faces)
+{
+	struct xcbft_glyph_cache *cache = faces.cache;
+	xcb_window_t root = xcb_setup_roots_iterator(xcb_get_setup(c)).data->root;
+	enum xcbft_glyph_format format;
+	xcb_atom_t atom;
+	uint32_t *words, length, check, i;
+	uint8_t j;
+	int published;
+
+	if (faces.patterns == NULL) {
+		return 0;
+	}
+	if (cache->published == NULL) {
+		cache->published = calloc(faces.length, sizeof(xcb_atom_t));
+	}
+	cache->c = c;
+
+	words = malloc(sizeof(uint32_t)*
+		(XCBFT_SHARE_HEADER + XCBFT_SHARE_GLYPH*cache->count));
+	published = 0;
+	for (j = 0; j < faces.length; j++) {
+		atom = xcbft_share_atom(c, faces.patterns[j], &cache->infos[j], 0,
+			&check);
+		/* the file changed since the last time */
+		if (cache->published[j] != XCB_ATOM_NONE &&
+				cache->published[j] != atom) {
+			xcb_delete_property(c, root, cache->published[j]);
+		}
+		cache->published[j] = atom;
+		if (atom == XCB_ATOM_NONE) {
+			continue;
+		}
+
+		/* create the glyphsets the face may use, for the header */
+		xcbft_glyph_cache_glyphset(c, cache,
+			xcbft_mode_format(cache->infos[j].mode));
+		if (FT_HAS_COLOR(faces.faces[j])) {
+			xcbft_glyph_cache_glyphset(c, cache, XCBFT_FORMAT_COLOR);
+		}
+		words[0] = XCBFT_SHARE_MAGIC;
+		words[1] = XCBFT_SHARE_VERSION;
+		words[2] = check;
+		words[3] = (uint32_t)(cache->infos[j].pixel_size * 64);
+		words[4] = cache->infos[j].mode;
+		for (format = 0; format < XCBFT_FORMATS; format++) {
+			words[5 + format] = cache->glyphsets[format].id;
+		}
+		length = XCBFT_SHARE_HEADER;
+		for (i = 0; i < cache->size; i++) {
+			if (cache->entries[i].used && cache->entries[i].face == j &&
+					cache->entries[i].atlas == XCBFT_ATLAS_NONE &&
+					!cache->entries[i].borrowed) {
+				length += xcbft_share_record(&cache->entries[i],
+					words + length);
+			}
+		}
+		xcbft_share_put(c, atom, XCB_PROP_MODE_REPLACE, words, length);
+		published += (length - XCBFT_SHARE_HEADER) / XCBFT_SHARE_GLYPH;
+	}
+	free(words);
+	xcbft_flush(c);
+
+	return published;
+}
+
+/*
+ * index + 1 of a glyphset of another client in the cache, sources holds
+ * the ids of the other clients. The cache keeps a reference of its own,
+ * taken in a checked request: a glyphset that doesn't exist anymore
+ * (the client exited before its properties were deleted) gives 0.
+ */
+static uint8_t
+xcbft_glyph_cache_borrow(xcb_connection_t *c, struct xcbft_glyph_cache *cache,
+	xcb_render_glyphset_t *sources, xcb_render_glyphset_t glyphset)
+{
+	xcb_render_glyphset_t reference;
+	xcb_generic_error_t *error;
+	uint8_t i;
+
+	for (i = 0; i < cache->borrowed_length; i++) {
+		if (sources[i] == glyphset) {
+			return i + 1;
+		}
+	}
+	if (cache->borrowed_length == UINT8_MAX) {
+		return 0;
+	}
+	reference = xcb_generate_id(c);
+	error = xcb_request_check(c,
+		xcb_render_reference_glyph_set_checked(c, reference, glyphset));
+	if (error != NULL) {
+		free(error);
+		return 0;
+	}
+	cache->borrowed = realloc(cache->borrowed,
+		sizeof(xcb_render_glyphset_t)*(cache->borrowed_length + 1));
+	sources[cache->borrowed_length] = glyphset;
+	cache->borrowed[cache->borrowed_length++] = reference;
+	return cache->borrowed_length;
+}
+
+/*
+ * Draw with the glyphs another client published for the same faces
+ * (same files, size and render mode) instead of loading them. What
+ * isn't published is still loaded as usual.
+ *
+ * The glyphsets are referenced, checking that the other client is still
+ * there, and stay until the face holder is destroyed or this is called
+ * again. The glyphs in them are freed when the other client reloads its
+ * fonts: watch PropertyNotify on the root window and call this again
+ * when one of the _XCBFT_GLYPHS_ properties changes, it replaces what
+ * was taken before.
+ *
+ * Returns the number of glyphs taken
+ */
+int
+xcbft_share_attach(xcb_connection_t *c, struct xcbft_face_holder faces)
+{
+	static const uint8_t no_drop[256];
+	struct xcbft_glyph_cache *cache = faces.cache;
+	xcb_window_t root = xcb_setup_roots_iterator(xcb_get_setup(c)).data->root;
+	xcb_get_property_reply_t *reply;
+	struct xcbft_glyph_entry entry;
+	enum xcbft_glyph_format format;
+	xcb_render_glyphset_t sources[UINT8_MAX];
+	const uint32_t *words;
+	uint32_t length, check, i;
+	uint8_t borrowed[XCBFT_FORMATS], j, k;
+	xcb_atom_t atom;
+	int taken;
+
+	if (faces.patterns == NULL) {
+		return 0;
+	}
+	/* forget what was taken before */
+	for (j = 0; j < cache->borrowed_length; j++) {
+		xcb_render_free_glyph_set(c, cache->borrowed[j]);
+	}
+	cache->borrowed_length = 0;
+	cache->c = c;
+	xcbft_glyph_cache_drop(cache, no_drop, 0);
+
+	taken = 0;
+	for (j = 0; j < faces.length; j++) {
+		atom = xcbft_share_atom(c, faces.patterns[j], &cache->infos[j], 1,
+			&check);
+		if (atom == XCB_ATOM_NONE) {
+			continue;
+		}
+		reply = xcb_get_property_reply(c, xcb_get_property(c, 0, root,
+			atom, XCB_ATOM_CARDINAL, 0, UINT32_MAX/4), NULL);
+		if (reply == NULL) {
+			continue;
+		}
+		words = xcb_get_property_value(reply);
+		length = xcb_get_property_value_length(reply) / 4;
+		if (reply->format != 32 || length < XCBFT_SHARE_HEADER ||
+				words[0] != XCBFT_SHARE_MAGIC ||
+				words[1] != XCBFT_SHARE_VERSION ||
+				words[2] != check ||
+				words[3] != (uint32_t)(cache->infos[j].pixel_size * 64) ||
+				words[4] != cache->infos[j].mode) {
+			free(reply);
+			continue;
+		}
+		for (format = 0; format < XCBFT_FORMATS; format++) {
+			borrowed[format] = words[5 + format] == 0 ? 0 :
+				xcbft_glyph_cache_borrow(c, cache, sources,
+				words[5 + format]);
+		}
+
+		/* an incomplete last record is still being written */
+		for (i = XCBFT_SHARE_HEADER; i + XCBFT_SHARE_GLYPH <= length;
+				i += XCBFT_SHARE_GLYPH) {
+			/* the mode we would render it with, nothing else */
+			if (words[i + 1] != cache->infos[j].mode ||
+					borrowed[xcbft_mode_format(words[i + 1])] == 0 ||
+					xcbft_glyph_cache_find(cache, words[i]) != NULL) {
+				continue;
+			}
+			/* an earlier face of ours would have it */
+			for (k = 0; k < j; k++) {
+				if (FT_Get_Char_Index(faces.faces[k], words[i]) != 0) {
+					break;
+				}
+			}
+			if (k < j) {
+				continue;
+			}
+
+			memset(&entry, 0, sizeof(entry));
+			entry.charcode = words[i];
+			entry.mode = words[i + 1];
+			entry.gid = words[i + 2];
+			entry.advance.x = (int32_t)words[i + 3];
+			entry.advance.y = (int32_t)words[i + 4];
+			entry.face = j;
+			entry.last_use = cache->clock;
+			entry.borrowed = borrowed[xcbft_mode_format(entry.mode)];
+			xcbft_glyph_cache_add_mode(cache, entry.mode);
+			xcbft_glyph_cache_put(cache, &entry);
+			taken++;
+		}
+		free(reply);
+	}
+
+	return taken;
+}
+
+/* the advance xcbft_rasterize_glyph would give, without rendering */
+static FT_Vector
+xcbft_glyph_advance(FT_Face face, uint32_t charcode,
+	const struct xcbft_face_info *info)
+{
+	FT_Vector advance;
+	FT_Error error;
+
+	advance.x = advance.y = 0;
+	XCBFT_TRACE_BEGIN(loading);
+	error = FT_Load_Glyph(face, FT_Get_Char_Index(face, charcode),
+		info->load_flags);
+	XCBFT_TRACE_END("FT_Load_Glyph metrics", loading);
+	if (error != FT_Err_Ok) {
+		return advance;
+	}
+	/* color bitmaps are scaled when rasterized */
+	if (info->scale < 1.0 &&
+			face->glyph->format == FT_GLYPH_FORMAT_BITMAP &&
+			face->glyph->bitmap.pixel_mode == FT_PIXEL_MODE_BGRA) {
+		advance.x = lround(face->glyph->advance.x/64.0*info->scale);
+		advance.y = lround(face->glyph->advance.y/64.0*info->scale);
+	} else {
+		advance.x = face->glyph->advance.x/64;
+		advance.y = face->glyph->advance.y/64;
+	}
+	return advance;
+}
+
+/*
+ * The copy of the faces for the calling thread, made on first use and
+ * again after the faces were reopened (xcbft_face_holder_refresh).
+ *
+ * It's empty (length 0) if the faces couldn't all be opened again
+ */
+static struct xcbft_face_holder
+xcbft_thread_faces(struct xcbft_face_holder faces, long dpi)
+{
+	struct xcbft_metric_cache *metrics = faces.cache->metrics;
+	struct xcbft_thread_faces *thread, **link;
+	struct xcbft_patterns_holder patterns;
+	double *pixel_sizes;
+	unsigned int generation;
+
+	generation = atomic_load(&metrics->generation);
+	pthread_mutex_lock(&metrics->threads_lock);
+	for (link = &metrics->threads; *link != NULL; link = &(*link)->next) {
+		if (pthread_equal((*link)->thread, pthread_self())) {
+			break;
+		}
+	}
+	thread = *link;
+	if (thread != NULL && thread->generation != generation) {
+		/* only this thread uses it */
+		*link = thread->next;
+		pthread_mutex_unlock(&metrics->threads_lock);
+		if (thread->faces.cache != NULL) {
+			xcbft_face_holder_destroy(thread->faces);
+		}
+		free(thread);
+		thread = NULL;
+	} else {
+		pthread_mutex_unlock(&metrics->threads_lock);
+	}
+	if (thread != NULL) {
+		return thread->faces;
+	}
+
+	/* opened outside of the lock, only this thread adds its own */
+	patterns.patterns = faces.patterns;
+	patterns.length = faces.length;
+	thread = malloc(sizeof(struct xcbft_thread_faces));
+	thread->thread = pthread_self();
+	thread->generation = generation;
+	pixel_sizes = xcbft_pixel_sizes(faces);
+	thread->faces = xcbft_face_holder_copy(patterns, pixel_sizes, dpi);
+	free(pixel_sizes);
+
+	pthread_mutex_lock(&metrics->threads_lock);
+	thread->next = metrics->threads;
+	metrics->threads = thread;
+	pthread_mutex_unlock(&metrics->threads_lock);
+
+	return thread->faces;
+}
+
+/*
+ * Find the advance of a character that isn't in the metric cache yet,
+ * from face of own (the faces of the thread) as given by its run
+ *
+ * Returns 0 if it's the advance in the first face while its fallback
+ * font is being looked up, not to be kept
+ */
+static int
+xcbft_measure_char(struct xcbft_face_holder faces,
+	struct xcbft_face_holder own, uint8_t face, uint32_t charcode,
+	long dpi, struct xcbft_metric *metric)
+{
+	struct xcbft_face_holder *fallback;
+	uint8_t waiting;
+
+	memset(metric, 0, sizeof(struct xcbft_metric));
+	metric->charcode = charcode;
+	if (face < own.length) {
+		metric->face = face;
+		metric->advance = xcbft_glyph_advance(own.faces[face], charcode,
+			&own.cache->infos[face]);
+		return 1;
+	}
+
+	/* the same fallback as xcbft_load_glyphset, shared with it */
+	pthread_mutex_lock(&faces.cache->fallbacks->lock);
+	fallback = xcbft_fallbacks_find(faces.cache->fallbacks, charcode, dpi,
+		&waiting);
+	if (fallback != NULL) {
+		xcbft_set_face_size(fallback->faces[0],
+			faces.cache->infos[0].pixel_size, dpi,
+			&fallback->cache->infos[0]);
+		metric->face = XCBFT_FACE_FALLBACK;
+		metric->advance = xcbft_glyph_advance(fallback->faces[0], charcode,
+			&fallback->cache->infos[0]);
+	}
+	pthread_mutex_unlock(&faces.cache->fallbacks->lock);
+	if (fallback != NULL) {
+		return 1;
+	}
+
+	metric->face = 0;
+	if (own.length > 0) {
+		metric->advance = xcbft_glyph_advance(own.faces[0], charcode,
+			&own.cache->infos[0]);
+	}
+	return !waiting;
+}
+
+/*
+ * The advance of text drawn with the faces, without loading or uploading
+ * anything. It can be called from any thread, at the same time as other
+ * measures and as drawing with the faces: each thread measures with its
+ * own copy of the faces and the advances are kept in a sharded cache.
+ * A thread that can't open its copy anymore only counts the advances
+ * already in the cache.
+ */
+FT_Vector
+xcbft_measure_text(struct xcbft_face_holder faces, struct utf_holder text,
+	long dpi)
+{
+	struct xcbft_metric_shard *shard;
+	struct xcbft_metric *found, metric;
+	struct xcbft_face_holder own;
+	struct xcbft_font_run *runs;
+	FT_Vector total;
+	unsigned int i, r, runs_length;
+
+	total.x = total.y = 0;
+	runs = NULL;
+	r = 0;
+	for (i = 0; i < text.length; i++) {
+		shard = xcbft_metric_cache_shard(faces.cache->metrics, text.str[i]);
+		pthread_rwlock_rdlock(&shard->lock);
+		found = xcbft_metric_shard_lookup(shard, text.str[i]);
+		if (found != NULL) {
+			metric = *found;
+		}
+		pthread_rwlock_unlock(&shard->lock);
+
+		if (found == NULL) {
+			/* the runs are only needed for what isn't measured yet */
+			if (runs == NULL) {
+				own = xcbft_thread_faces(faces, dpi);
+				if (own.length != faces.length) {
+					/* no faces to measure with, only the cached count */
+					continue;
+				}
+				runs = xcbft_itemize_faces(faces.cache->runs, own.faces,
+					own.length, text, &runs_length);
+			}
+			while (i >= runs[r].start + runs[r].length) {
+				r++;
+			}
+			if (!xcbft_measure_char(faces, own, runs[r].face,
+					text.str[i], dpi, &metric)) {
+				total.x += metric.advance.x;
+				total.y += metric.advance.y;
+				continue;
+			}
+			pthread_rwlock_wrlock(&shard->lock);
+			/* another thread may have measured it meanwhile */
+			if (xcbft_metric_shard_lookup(shard, text.str[i]) == NULL) {
+				xcbft_metric_shard_put(faces.cache->metrics, shard,
+					&metric);
+			}
+			pthread_rwlock_unlock(&shard->lock);
+		}
+		total.x += metric.advance.x;
+		total.y += metric.advance.y;
+	}
+	if (runs != NULL) {
+		free(runs);
+		xcbft_memory_check();
+	}
+
+	return total;
+}
+
+/*
+ * The runs of characters of text that are drawn with the same face and
+ * of the same script, in order, for callers shaping text themselves.
+ * They are cached by text, drawing and measuring it again doesn't look
+ * for the faces covering its characters. Call it from the thread that
+ * draws with the faces.
+ *
+ * Returns the runs, to free, and their number in runs_length
+ */
+struct xcbft_font_run *
+xcbft_itemize(struct xcbft_face_holder faces, struct utf_holder text,
+	unsigned int *runs_length)
+{
+	return xcbft_itemize_faces(faces.cache->runs, faces.faces,
+		faces.length, text, runs_length);
+}
+
+/*
+ * Decode the next characters of bytes in chars, XCBFT_UTF8_CHUNK of
+ * them at most, and move past them.
+ *
+ * Returns the number of characters, 0 at the end
+ */
+static unsigned int
+xcbft_utf8_chunk(struct utf_decoder *decoder, const char **bytes,
+	size_t *length, FcChar32 *chars)
+{
+	size_t used, decoded;
+
+	decoded = utf_decode(decoder, *bytes, *length, &used,
+		chars, XCBFT_UTF8_CHUNK);
+	*bytes += used;
+	*length -= used;
+	if (*length == 0 && decoded < XCBFT_UTF8_CHUNK) {
+		decoded += utf_decode_end(decoder, chars + decoded);
+	}
+	return decoded;
+}
+
+/* xcbft_measure_text of length bytes of UTF-8, decoded on the stack */
+FT_Vector
+xcbft_measure_utf8(struct xcbft_face_holder faces, const char *bytes,
+	size_t length, long dpi)
+{
+	FcChar32 chars[XCBFT_UTF8_CHUNK];
+	struct utf_decoder decoder;
+	struct utf_holder text;
+	FT_Vector total, advance;
+
+	total.x = total.y = 0;
+	utf_decoder_init(&decoder);
+	text.str = chars;
+	while ((text.length = xcbft_utf8_chunk(&decoder, &bytes, &length,
+			chars)) > 0) {
+		advance = xcbft_measure_text(faces, text, dpi);
+		total.x += advance.x;
+		total.y += advance.y;
+	}
+
+	return total;
+}
+
+FT_Vector
+xcbft_load_glyph(
+	xcb_connection_t *c, xcb_render_glyphset_t gs, FT_Face face, int charcode)
+{
+	FT_Vector glyph_advance;
+	struct xcbft_glyph_bitmap glyph;
+	struct xcbft_glyph_bitmap *glyphs[1];
+	/* no pattern to get the settings from here */
+	struct xcbft_face_info info = {
+		.load_flags = FT_LOAD_DEFAULT,
+		.mode = XCBFT_HINT_NATIVE | XCBFT_RENDER_GRAY,
+		.scale = 1.0
+	};
+
+	glyph_advance.x = glyph_advance.y = 0;
+	if (!xcbft_rasterize_glyph(face, charcode, &info, &glyph)) {
+		fprintf(stderr, "could not load glyph: %02x\n", charcode);
+		return glyph_advance;
+	}
+
+    /*
+	 * keep track of the max horiBearingY (yMax) and yMin
+	 * 26.6 fractional pixel format
+	 * yMax = face->glyph->metrics.horiBearingY/64; (yMax);
+	 * yMin = -(face->glyph->metrics.height -
+	 *		face->glyph->metrics.horiBearingY)/64;
+     */
+
+	glyph_advance.x = glyph.info.x_off;
+	glyph_advance.y = glyph.info.y_off;
+
+	/* outside of the cache the glyph id is the charcode */
+	glyph.gid = charcode;
+	glyphs[0] = &glyph;
+	xcbft_upload_glyphs(c, gs, glyphs, 1);
+	free(glyph.data);
+
+	xcbft_flush(c);
+	return glyph_advance;
+}
+
+void
+xcbft_charset_add_range(FcCharSet *charset, FcChar32 first, FcChar32 last)
+{
+	FcChar32 ucs4;
+
+	for (ucs4 = first; ucs4 <= last; ucs4++) {
+		FcCharSetAddChar(charset, ucs4);
+	}
+}
+
+void
+xcbft_charset_add_text(FcCharSet *charset, struct utf_holder text)
+{
+	unsigned int i;
+
+	for (i = 0; i < text.length; i++) {
+		FcCharSetAddChar(charset, text.str[i]);
+	}
+}
+
+/*
+ * Hand a chunk of rasterized glyphs to the uploader.
+ * Returns 0 if the prewarm got cancelled in the meantime.
+ */
+static int
+xcbft_prewarm_push(struct xcbft_prewarm *prewarm,
+	struct xcbft_glyph_bitmap *first, struct xcbft_glyph_bitmap *last)
+{
+	int cancel;
+
+	pthread_mutex_lock(&prewarm->lock);
+	if (first != NULL) {
+		last->next = prewarm->ready;
+		prewarm->ready = first;
+	}
+	cancel = prewarm->cancel;
+	pthread_mutex_unlock(&prewarm->lock);
+
+	return !cancel;
+}
+
+/*
+ * Background rasterization of the prewarm charset.
+ * FT faces can't be shared between threads so the worker opens its own
+ * faces from the patterns of the face holder.
+ */
+static void *
+xcbft_prewarm_worker(void *arg)
+{
+	struct xcbft_prewarm *prewarm = arg;
+	struct xcbft_patterns_holder patterns;
+	struct xcbft_face_holder faces;
+	struct xcbft_glyph_bitmap *glyph, *first, *last;
+	FcChar32 base, ucs4, map[FC_CHARSET_MAP_SIZE], next;
+	unsigned int i, j, count;
+	uint32_t bits;
+
+	patterns.patterns = prewarm->faces.patterns;
+	patterns.length = prewarm->faces.length;
+	/* glyph->face indexes the holder, so does the copy */
+	faces = xcbft_face_holder_copy(patterns, prewarm->pixel_sizes,
+		prewarm->dpi);
+
+	first = last = NULL;
+	count = 0;
+	for (base = FcCharSetFirstPage(prewarm->charset, map, &next);
+			base != FC_CHARSET_DONE;
+			base = FcCharSetNextPage(prewarm->charset, map, &next)) {
+		for (i = 0; i < FC_CHARSET_MAP_SIZE; i++) {
+			for (bits = map[i]; bits != 0; bits &= bits - 1) {
+				ucs4 = base + i*32 + __builtin_ctz(bits);
+
+				for (j = 0; j < faces.length; j++) {
+					if (FT_Get_Char_Index(faces.faces[j], ucs4) != 0)
+						break;
+				}
+				/* uncovered characters are left to the fallback */
+				if (j == faces.length) {
+					continue;
+				}
+
+				glyph = malloc(sizeof(struct xcbft_glyph_bitmap));
+				if (!xcbft_rasterize_glyph(faces.faces[j], ucs4,
+						&faces.cache->infos[j], glyph)) {
+					free(glyph);
+					continue;
+				}
+				glyph->face = j;
+				if (first == NULL) {
+					last = glyph;
+				}
+				glyph->next = first;
+				first = glyph;
+
+				if (++count == XCBFT_PREWARM_CHUNK) {
+					if (!xcbft_prewarm_push(prewarm, first, last)) {
+						goto done;
+					}
+					first = last = NULL;
+					count = 0;
+				}
+			}
+		}
+	}
+	xcbft_prewarm_push(prewarm, first, last);
+
+done:
+	pthread_mutex_lock(&prewarm->lock);
+	prewarm->finished = 1;
+	pthread_mutex_unlock(&prewarm->lock);
+
+	if (faces.cache != NULL) {
+		xcbft_face_holder_destroy(faces);
+	}
+	return NULL;
+}
+
+/*
+ * Start rasterizing the characters of charset for the faces in the
+ * background. The glyphs are only sent to the X server when calling
+ * xcbft_prewarm_upload, typically when the event loop is idle.
+ *
+ * The face holder must outlive the prewarm.
+ */
+struct xcbft_prewarm*
+xcbft_prewarm_start(struct xcbft_face_holder faces,
+	const FcCharSet *charset, long dpi)
+{
+	struct xcbft_prewarm *prewarm;
+	FcCharSet *cached;
+	uint32_t i;
+
+	prewarm = calloc(1, sizeof(struct xcbft_prewarm));
+	prewarm->faces = faces;
+	prewarm->dpi = dpi;
+	prewarm->pixel_sizes = xcbft_pixel_sizes(faces);
+
+	/* no need to rasterize what's already uploaded */
+	cached = FcCharSetCreate();
+	for (i = 0; i < faces.cache->size; i++) {
+		if (faces.cache->entries[i].used) {
+			FcCharSetAddChar(cached, faces.cache->entries[i].charcode);
+		}
+	}
+	prewarm->charset = FcCharSetSubtract(charset, cached);
+	FcCharSetDestroy(cached);
+
+	pthread_mutex_init(&prewarm->lock, NULL);
+	if (pthread_create(&prewarm->thread, NULL,
+			xcbft_prewarm_worker, prewarm) != 0) {
+		fprintf(stderr, "could not start the prewarm thread");
+		pthread_mutex_destroy(&prewarm->lock);
+		FcCharSetDestroy(prewarm->charset);
+		free(prewarm->pixel_sizes);
+		free(prewarm);
+		return NULL;
+	}
+
+	return prewarm;
+}
+
+/*
+ * Upload the glyphs rasterized so far in as few requests as possible.
+ * Returns 1 once everything has been rasterized and uploaded.
+ */
+int
+xcbft_prewarm_upload(xcb_connection_t *c, struct xcbft_prewarm *prewarm)
+{
+	struct xcbft_glyph_bitmap *ready, *glyph, **glyphs;
+	struct xcbft_glyph_cache *cache;
+	unsigned int count;
+	int finished;
+	FT_Vector advance;
+
+	pthread_mutex_lock(&prewarm->lock);
+	ready = prewarm->ready;
+	prewarm->ready = NULL;
+	finished = prewarm->finished;
+	pthread_mutex_unlock(&prewarm->lock);
+
+	if (ready == NULL) {
+		return finished;
+	}
+
+	cache = prewarm->faces.cache;
+	count = 0;
+	for (glyph = ready; glyph != NULL; glyph = glyph->next) {
+		count++;
+	}
+	glyphs = malloc(sizeof(struct xcbft_glyph_bitmap *)*count);
+
+	/* skip what got loaded on demand since the prewarm started */
+	count = 0;
+	for (glyph = ready; glyph != NULL; glyph = glyph->next) {
+		if (xcbft_glyph_cache_find(cache, glyph->charcode) == NULL) {
+			advance.x = glyph->info.x_off;
+			advance.y = glyph->info.y_off;
+			glyph->gid = xcbft_glyph_cache_insert(cache,
+				glyph->charcode, glyph->mode, advance, glyph->face);
+			glyphs[count++] = glyph;
+		}
+	}
+
+	if (count > 0) {
+		xcbft_glyph_cache_upload(c, cache, glyphs, count);
+		xcbft_flush(c);
+	}
+
+	free(glyphs);
+	xcbft_glyph_bitmap_free_list(ready);
+
+	return finished;
+}
+
+/* stops the worker if it's still running, drops what wasn't uploaded */
+void
+xcbft_prewarm_destroy(struct xcbft_prewarm *prewarm)
+{
+	pthread_mutex_lock(&prewarm->lock);
+	prewarm->cancel = 1;
+	pthread_mutex_unlock(&prewarm->lock);
+
+	pthread_join(prewarm->thread, NULL);
+
+	xcbft_glyph_bitmap_free_list(prewarm->ready);
+	FcCharSetDestroy(prewarm->charset);
+	pthread_mutex_destroy(&prewarm->lock);
+	free(prewarm->pixel_sizes);
+	free(prewarm);
+}
+
+/* with its faces, for a query nobody takes them from */
+static void
+xcbft_async_query_free(struct xcbft_async_query *query)
+{
+	if (query->faces.cache != NULL) {
+		xcbft_face_holder_destroy(query->faces);
+	}
+	close(query->fd);
+	if (query->queries) {
+		FcStrSetDestroy(query->queries);
+	}
+	if (query->copy_pattern) {
+		FcPatternDestroy(query->copy_pattern);
+	}
+	pthread_mutex_destroy(&query->lock);
+	free(query);
+}
+
+static void *
+xcbft_async_query_worker(void *arg)
+{
+	struct xcbft_async_query *query = arg;
+	struct xcbft_patterns_holder patterns;
+	uint64_t one = 1;
+
+	if (query->queries != NULL) {
+		patterns = xcbft_query_fontsearch_all(query->queries);
+		query->faces = xcbft_load_faces(patterns, query->dpi);
+		xcbft_patterns_holder_destroy(patterns);
+	} else {
+		query->faces = xcbft_query_by_char_support(query->character,
+			query->copy_pattern, query->dpi);
+	}
+
+	pthread_mutex_lock(&query->lock);
+	if (query->canceled) {
+		pthread_mutex_unlock(&query->lock);
+		xcbft_async_query_free(query);
+		return NULL;
+	}
+	if (write(query->fd, &one, sizeof(one)) != sizeof(one)) {
+		perror(NULL);
+	}
+	if (query->notify_fd >= 0 &&
+			write(query->notify_fd, &one, sizeof(one)) != sizeof(one)) {
+		perror(NULL);
+	}
+	query->finished = 1;
+	pthread_mutex_unlock(&query->lock);
+	return NULL;
+}
+
+static struct xcbft_async_query*
+xcbft_async_query_start(struct xcbft_async_query *query)
+{
+	query->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (query->fd < 0) {
+		perror(NULL);
+		goto error;
+	}
+	pthread_mutex_init(&query->lock, NULL);
+	if (pthread_create(&query->thread, NULL,
+			xcbft_async_query_worker, query) != 0) {
+		fprintf(stderr, "could not start the font query thread");
+		pthread_mutex_destroy(&query->lock);
+		close(query->fd);
+		goto error;
+	}
+	return query;
+
+error:
+	if (query->queries) {
+		FcStrSetDestroy(query->queries);
+	}
+	if (query->copy_pattern) {
+		FcPatternDestroy(query->copy_pattern);
+	}
+	free(query);
+	return NULL;
+}
+
+/*
+ * Same as xcbft_query_fontsearch_all followed by xcbft_load_faces but
+ * done on a helper thread. The fd of the query becomes readable when
+ * the faces are ready to be taken with xcbft_async_query_finish.
+ */
+struct xcbft_async_query*
+xcbft_query_fontsearch_async(FcStrSet *queries, long dpi)
+{
+	struct xcbft_async_query *query;
+	FcStrList *iterator;
+	FcChar8 *fontquery;
+
+	query = calloc(1, sizeof(struct xcbft_async_query));
+	query->dpi = dpi;
+	query->notify_fd = -1;
+
+	/* the caller is free to destroy its set meanwhile */
+	query->queries = FcStrSetCreate();
+	iterator = FcStrListCreate(queries);
+	FcStrListFirst(iterator);
+	while ((fontquery = FcStrListNext(iterator)) != NULL) {
+		FcStrSetAdd(query->queries, fontquery);
+	}
+	FcStrListDone(iterator);
+
+	return xcbft_async_query_start(query);
+}
+
+/* asynchronous version of xcbft_query_by_char_support */
+struct xcbft_async_query*
+xcbft_query_by_char_support_async(FcChar32 character,
+	const FcPattern *copy_pattern, long dpi)
+{
+	struct xcbft_async_query *query;
+
+	query = calloc(1, sizeof(struct xcbft_async_query));
+	query->dpi = dpi;
+	query->notify_fd = -1;
+	query->character = character;
+	if (copy_pattern != NULL) {
+		query->copy_pattern = FcPatternDuplicate(copy_pattern);
+	}
+
+	return xcbft_async_query_start(query);
+}
+
+/* pollable (POLLIN) file descriptor signaling the end of the query */
+int
+xcbft_async_query_fd(struct xcbft_async_query *query)
+{
+	return query->fd;
+}
+
+/* non-blocking check, returns 1 if the faces are ready */
+int
+xcbft_async_query_done(struct xcbft_async_query *query)
+{
+	struct pollfd pfd;
+
+	pfd.fd = query->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+/*
+ * Take the faces of the query and free it, blocks if it isn't done yet.
+ * The face holder is empty (length 0) if nothing matched.
+ */
+struct xcbft_face_holder
+xcbft_async_query_finish(struct xcbft_async_query *query)
+{
+	struct xcbft_face_holder faces;
+
+	pthread_join(query->thread, NULL);
+	faces = query->faces;
+	query->faces.cache = NULL;
+	xcbft_async_query_free(query);
+
+	return faces;
+}
+
+/*
+ * Characters none of the faces has are drawn with the first face while
+ * their font is looked up on a helper thread. The fd becomes readable
+ * (POLLIN) when a lookup finished, the next draw replaces their glyphs:
+ * draw again then.
+ *
+ * Returns -1 if no lookup was started yet
+ */
+int
+xcbft_fallback_fd(struct xcbft_face_holder faces)
+{
+	int fd;
+
+	pthread_mutex_lock(&faces.cache->fallbacks->lock);
+	fd = faces.cache->fallbacks->fd;
+	pthread_mutex_unlock(&faces.cache->fallbacks->lock);
+	return fd;
+}
+
+/*
+ * Give up on a query without waiting for it: the helper thread goes on
+ * and frees the query and its faces when it's done.
+ */
+void
+xcbft_async_query_cancel(struct xcbft_async_query *query)
+{
+	pthread_mutex_lock(&query->lock);
+	pthread_detach(query->thread);
+	if (query->finished) {
+		pthread_mutex_unlock(&query->lock);
+		xcbft_async_query_free(query);
+		return;
+	}
+	query->canceled = 1;
+	pthread_mutex_unlock(&query->lock);
+}
+
+struct xcbft_draw_list*
+xcbft_draw_list_create(void)
+{
+	return calloc(1, sizeof(struct xcbft_draw_list));
+}
+
+/*
+ * Queue text to draw at (x, y) with a color and faces, nothing is sent
+ * before xcbft_draw_list_render. The text is copied.
+ */
+void
+xcbft_draw_list_add(struct xcbft_draw_list *list, int x, int y,
+	struct utf_holder text, xcb_render_color_t color,
+	struct xcbft_face_holder faces)
+{
+	struct xcbft_draw_run *run;
+
+	if (list->length + 1 > list->allocated) {
+		list->allocated = list->allocated ? list->allocated * 2 : 16;
+		list->runs = realloc(list->runs,
+			sizeof(struct xcbft_draw_run) * list->allocated);
+	}
+
+	run = &list->runs[list->length];
+	run->x = x;
+	run->y = y;
+	run->text.length = text.length;
+	run->text.str = malloc(sizeof(FcChar32) * (text.length ? text.length : 1));
+	memcpy(run->text.str, text.str, sizeof(FcChar32) * text.length);
+	run->color = color;
+	run->faces = faces;
+	run->advance.x = run->advance.y = 0;
+	run->gids = NULL;
+	run->glyphsets = NULL;
+	run->advances = NULL;
+	run->passes = NULL;
+	run->drawn = 0;
+	list->length++;
+}
+
+/* forget the runs, keeps the memory for the next frame */
+void
+xcbft_draw_list_clear(struct xcbft_draw_list *list)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->length; i++) {
+		utf_holder_destroy(list->runs[i].text);
+		free(list->runs[i].gids);
+		list->runs[i].gids = NULL;
+		free(list->runs[i].glyphsets);
+		list->runs[i].glyphsets = NULL;
+		free(list->runs[i].advances);
+		list->runs[i].advances = NULL;
+		free(list->runs[i].passes);
+		list->runs[i].passes = NULL;
+	}
+	list->length = 0;
+}
+
+static void
+xcbft_shm_release(struct xcbft_shm *shm)
+{
+	if (shm->state > 0) {
+		xcb_shm_detach(shm->c, shm->seg);
+		shmdt(shm->addr);
+		shm->addr = NULL;
+		shm->size = 0;
+		shm->state = 0;
+	}
+}
+
+/*
+ * Have a segment of at least size bytes attached by the server,
+ * replacing a smaller one or one of another connection (which must
+ * still be open).
+ *
+ * Returns 0 if shared memory can't be used with this connection
+ */
+static int
+xcbft_shm_reserve(xcb_connection_t *c, struct xcbft_shm *shm, size_t size)
+{
+	const xcb_query_extension_reply_t *extension;
+	xcb_generic_error_t *error;
+
+	/* attached to (or tried with) another connection, start over */
+	if (shm->state != 0 && shm->c != c) {
+		xcbft_shm_release(shm);
+		shm->state = 0;
+	}
+	shm->c = c;
+	if (shm->state < 0) {
+		return 0;
+	}
+	if (shm->state > 0 && shm->size >= size) {
+		return 1;
+	}
+	extension = xcb_get_extension_data(c, &xcb_shm_id);
+	if (extension == NULL || !extension->present) {
+		shm->state = -1;
+		return 0;
+	}
+	xcbft_shm_release(shm);
+
+	shm->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (shm->shmid < 0) {
+		shm->state = -1;
+		return 0;
+	}
+	shm->addr = shmat(shm->shmid, NULL, 0);
+	if (shm->addr == (void *)-1) {
+		shmctl(shm->shmid, IPC_RMID, NULL);
+		shm->addr = NULL;
+		shm->state = -1;
+		return 0;
+	}
+	shm->seg = xcb_generate_id(c);
+	error = xcb_request_check(c,
+		xcb_shm_attach_checked(c, shm->seg, shm->shmid, 0));
+	/* the server attached it (or failed to), it goes away with us */
+	shmctl(shm->shmid, IPC_RMID, NULL);
+	if (error != NULL) {
+		/* remote server */
+		free(error);
+		shmdt(shm->addr);
+		shm->addr = NULL;
+		shm->state = -1;
+		return 0;
+	}
+	shm->size = size;
+	shm->state = 1;
+	return 1;
+}
+
+void
+xcbft_draw_list_destroy(struct xcbft_draw_list *list)
+{
+	xcbft_draw_list_clear(list);
+	xcbft_shm_release(&list->shm);
+	free(list->runs);
+	free(list);
+}
+
+static int
+xcbft_same_color(xcb_render_color_t a, xcb_render_color_t b)
+{
+	return a.red == b.red && a.green == b.green &&
+		a.blue == b.blue && a.alpha == b.alpha;
+}
+
+/*
+ * Every run of a frame is loaded at the same tick of its cache so that
+ * loading one doesn't free the glyphs of another.
+ */
+static void
+xcbft_draw_list_tick(struct xcbft_draw_list *list)
+{
+	unsigned int i;
+
+	for (i = 0; i < list->length; i++) {
+		list->runs[i].faces.cache->clock++;
+	}
+}
+
+/*
+ * Find the glyph ids and glyphsets of a run and the smallest encoding
+ * the ids fit in, the arrays of the run having room for its text
+ */
+static void
+xcbft_run_fill_glyph_ids(xcb_connection_t *c, struct xcbft_draw_run *run,
+	xcb_render_glyphset_t glyphset)
+{
+	struct xcbft_glyph_entry *entry;
+	uint32_t max_gid;
+	unsigned int i;
+
+	max_gid = 0;
+	for (i = 0; i < run->text.length; i++) {
+		entry = xcbft_glyph_cache_find(run->faces.cache, run->text.str[i]);
+		run->gids[i] = entry ? entry->gid : 0;
+		run->advances[i].x = run->advances[i].y = 0;
+		run->passes[i] = XCBFT_PASS_TEXT;
+		if (entry == NULL) {
+			/* gid 0 is a glyph like the others, leave it out */
+			run->glyphsets[i] = glyphset;
+			run->passes[i] = XCBFT_PASS_NONE;
+		} else if (entry->borrowed) {
+			run->glyphsets[i] =
+				run->faces.cache->borrowed[entry->borrowed - 1];
+		} else {
+			run->glyphsets[i] = xcbft_glyph_cache_glyphset(c,
+				run->faces.cache, xcbft_mode_format(entry->mode));
+		}
+		if (entry != NULL) {
+			run->advances[i] = entry->advance;
+			if (entry->atlas == XCBFT_ATLAS_PLACED) {
+				run->passes[i] = XCBFT_PASS_ATLAS;
+			} else if (xcbft_mode_format(entry->mode) == XCBFT_FORMAT_COLOR) {
+				run->passes[i] = XCBFT_PASS_COLOR;
+			}
+		}
+		if (run->gids[i] > max_gid) {
+			max_gid = run->gids[i];
+		}
+	}
+	run->width = max_gid <= UINT8_MAX ? 1 : max_gid <= UINT16_MAX ? 2 : 4;
+}
+
+/* the same, allocating the arrays of the run */
+static void
+xcbft_run_glyph_ids(xcb_connection_t *c, struct xcbft_draw_run *run,
+	xcb_render_glyphset_t glyphset)
+{
+	/* drawn again after the shm backend gave up */
+	free(run->gids);
+	free(run->glyphsets);
+	free(run->advances);
+	free(run->passes);
+
+	run->gids = malloc(sizeof(uint32_t) * (run->text.length ? run->text.length : 1));
+	run->glyphsets = malloc(sizeof(xcb_render_glyphset_t) *
+		(run->text.length ? run->text.length : 1));
+	run->advances = malloc(sizeof(FT_Vector) *
+		(run->text.length ? run->text.length : 1));
+	run->passes = malloc(run->text.length ? run->text.length : 1);
+	xcbft_run_fill_glyph_ids(c, run, glyphset);
+}
+
+/*
+ * Load every run of the frame, then find their glyph ids: loading a run
+ * can move the glyphs of the others (atlas repacked, budget), the ids
+ * are only known once they're all loaded
+ */
+static void
+xcbft_draw_list_load(xcb_connection_t *c, struct xcbft_draw_list *list,
+	long dpi, uint8_t keep_images)
+{
+	struct xcbft_glyphset_and_advance glyphset_advance;
+	struct xcbft_draw_run *run;
+	unsigned int i;
+
+	xcbft_draw_list_tick(list);
+	for (i = 0; i < list->length; i++) {
+		run = &list->runs[i];
+		if (keep_images) {
+			run->faces.cache->keep_images = 1;
+		}
+		glyphset_advance = xcbft_load_glyphset_tick(c, run->faces,
+			run->text, dpi);
+		run->advance = glyphset_advance.advance;
+		run->glyphset = glyphset_advance.glyphset;
+	}
+	for (i = 0; i < list->length; i++) {
+		xcbft_run_glyph_ids(c, &list->runs[i], list->runs[i].glyphset);
+	}
+}
+
+/*
+ * Append the glyphs of a run drawn in a pass to a stream, with width
+ * bytes per glyph id. The pen is where the server left it, glyphs of
+ * other passes are stepped over with the deltas.
+ */
+static void
+xcbft_stream_run(xcb_render_util_composite_text_stream_t *ts,
+	struct xcbft_draw_run *run, uint8_t width, FT_Vector *pen,
+	xcb_render_glyphset_t *current, enum xcbft_pass pass)
+{
+	unsigned int i, j, count;
+	FT_Vector position;
+	int16_t dx, dy;
+	uint8_t gids_8[XCBFT_GLYPHS_PER_ELT];
+	uint16_t gids_16[XCBFT_GLYPHS_PER_ELT];
+
+	position.x = run->x;
+	position.y = run->y;
+	for (i = 0; i < run->text.length; i += count) {
+		count = 1;
+		if (run->passes[i] != pass) {
+			position.x += run->advances[i].x;
+			position.y += run->advances[i].y;
+			continue;
+		}
+		if (run->glyphsets[i] != *current) {
+			*current = run->glyphsets[i];
+			xcb_render_util_change_glyphset(ts, *current);
+		}
+		while (i + count < run->text.length &&
+				count < XCBFT_GLYPHS_PER_ELT &&
+				run->passes[i + count] == pass &&
+				run->glyphsets[i + count] == *current) {
+			count++;
+		}
+
+		dx = position.x - pen->x;
+		dy = position.y - pen->y;
+		if (width == 1) {
+			for (j = 0; j < count; j++) {
+				gids_8[j] = run->gids[i + j];
+			}
+			xcb_render_util_glyphs_8(ts, dx, dy, count, gids_8);
+		} else if (width == 2) {
+			for (j = 0; j < count; j++) {
+				gids_16[j] = run->gids[i + j];
+			}
+			xcb_render_util_glyphs_16(ts, dx, dy, count, gids_16);
+		} else {
+			xcb_render_util_glyphs_32(ts, dx, dy, count, run->gids + i);
+		}
+		for (j = 0; j < count; j++) {
+			position.x += run->advances[i + j].x;
+			position.y += run->advances[i + j].y;
+		}
+		*pen = position;
+	}
+}
+
+/* the runs of the color of runs[first] that need that width */
+static int
+xcbft_run_in_stream(struct xcbft_draw_list *list, unsigned int first,
+	unsigned int i, uint8_t width)
+{
+	return !list->runs[i].drawn && list->runs[i].width == width &&
+		xcbft_same_color(list->runs[first].color, list->runs[i].color);
+}
+
+/*
+ * Build the stream of every run of the color of runs[first] with that
+ * width, with their glyphs drawn in that pass.
+ *
+ * Returns NULL if there is nothing to draw
+ */
+static xcb_render_util_composite_text_stream_t *
+xcbft_draw_list_stream(struct xcbft_draw_list *list, unsigned int first,
+	uint8_t width, enum xcbft_pass pass)
+{
+	unsigned int i, j, glyphs, changes;
+	xcb_render_glyphset_t start, current;
+	xcb_render_util_composite_text_stream_t *ts;
+	struct xcbft_draw_run *run;
+	FT_Vector pen;
+
+	/* size the stream, the first glyph sets the glyphset */
+	glyphs = changes = 0;
+	start = current = 0;
+	for (i = first; i < list->length; i++) {
+		if (!xcbft_run_in_stream(list, first, i, width)) {
+			continue;
+		}
+		run = &list->runs[i];
+		for (j = 0; j < run->text.length; j++) {
+			if (run->passes[j] != pass) {
+				continue;
+			}
+			if (glyphs++ == 0) {
+				start = current = run->glyphsets[j];
+			} else if (run->glyphsets[j] != current) {
+				current = run->glyphsets[j];
+				changes++;
+			}
+		}
+	}
+	if (glyphs == 0) {
+		return NULL;
+	}
+
+	ts = xcb_render_util_composite_text_stream(start, glyphs, changes);
+	current = start;
+	pen.x = pen.y = 0;
+	for (i = first; i < list->length; i++) {
+		if (xcbft_run_in_stream(list, first, i, width)) {
+			xcbft_stream_run(ts, &list->runs[i], width, &pen,
+				&current, pass);
+		}
+	}
+	return ts;
+}
+
+/* composite the glyphs of a run that are in the atlas */
+static void
+xcbft_draw_run_atlas(xcb_connection_t *c, struct xcbft_draw_run *run,
+	xcb_render_picture_t pen, xcb_render_picture_t picture)
+{
+	unsigned int i;
+	FT_Vector position;
+	struct xcbft_glyph_entry *entry;
+
+	if (run->faces.cache->atlas == NULL) {
+		return;
+	}
+
+	XCBFT_TRACE_BEGIN(requests);
+	position.x = run->x;
+	position.y = run->y;
+	for (i = 0; i < run->text.length; i++) {
+		entry = NULL;
+		if (run->passes[i] == XCBFT_PASS_ATLAS) {
+			entry = xcbft_glyph_cache_find(run->faces.cache,
+				run->text.str[i]);
+		}
+		if (entry != NULL && entry->atlas == XCBFT_ATLAS_PLACED) {
+			xcb_render_composite(c, XCB_RENDER_PICT_OP_OVER,
+				pen, run->faces.cache->atlas->picture, picture,
+				0, 0,
+				entry->slot.x, entry->slot.y,
+				position.x - entry->slot.origin_x,
+				position.y - entry->slot.origin_y,
+				entry->slot.width, entry->slot.height);
+			xcbft_count(XCBFT_COUNT_COMPOSITE_REQUESTS, 1);
+		}
+		position.x += run->advances[i].x;
+		position.y += run->advances[i].y;
+	}
+	XCBFT_TRACE_END("Composite atlas", requests);
+}
+
+/*
+ * What the runs are composited with: the picture of the drawable and the
+ * pens, made once for all the lists drawn on it in a call
+ */
+struct xcbft_draw_target {
+	const xcb_render_query_pict_formats_reply_t *formats;
+	xcb_render_picture_t picture;
+	/* of the last color drawn */
+	xcb_render_picture_t pen;
+	xcb_render_color_t pen_color;
+	/* for the color glyphs, 0 until needed */
+	xcb_render_picture_t white_pen;
+};
+
+static void
+xcbft_draw_target_init(xcb_connection_t *c, xcb_drawable_t drawable,
+	struct xcbft_draw_target *target)
+{
+	xcb_render_pictvisual_t *fmt;
+	xcb_screen_t *screen;
+	uint32_t values[2];
+
+	target->formats = xcb_render_util_query_formats(c);
+	screen = xcb_setup_roots_iterator(xcb_get_setup(c)).data;
+	fmt = xcb_render_util_find_visual_format(target->formats,
+		screen->root_visual);
+	target->picture = xcb_generate_id(c);
+	values[0] = XCB_RENDER_POLY_EDGE_SMOOTH;
+	values[1] = XCB_RENDER_POLY_MODE_IMPRECISE;
+	xcb_render_create_picture(c, target->picture, drawable, fmt->format,
+		XCB_RENDER_CP_POLY_EDGE | XCB_RENDER_CP_POLY_MODE, values);
+	target->pen = 0;
+	target->white_pen = 0;
+}
+
+/* the pen of that color, the one of the last color drawn is kept */
+static xcb_render_picture_t
+xcbft_draw_target_pen(xcb_connection_t *c, struct xcbft_draw_target *target,
+	xcb_render_color_t color)
+{
+	if (target->pen != 0 && xcbft_same_color(target->pen_color, color)) {
+		return target->pen;
+	}
+	if (target->pen != 0) {
+		xcb_render_free_picture(c, target->pen);
+	}
+	target->pen = xcbft_create_pen(c, color);
+	target->pen_color = color;
+	return target->pen;
+}
+
+static void
+xcbft_draw_target_done(xcb_connection_t *c, struct xcbft_draw_target *target)
+{
+	if (target->pen != 0) {
+		xcb_render_free_picture(c, target->pen);
+	}
+	if (target->white_pen != 0) {
+		xcb_render_free_picture(c, target->white_pen);
+	}
+	xcb_render_free_picture(c, target->picture);
+	xcbft_flush(c);
+}
+
+/*
+ * Draw the runs of the list, their glyphs loaded and their ids found.
+ * Runs of the same color share a pen and a single composite text stream,
+ * the glyphset switches and positions being encoded in the stream, so a
+ * full redraw is one CompositeGlyphs per color.
+ * The stream uses CompositeGlyphs8 or 16 when the glyph ids of the runs
+ * fit, runs needing wider ids go in a stream of their own.
+ * Without mask format subpixel (ARGB) glyphs get component alpha.
+ * Color glyphs are drawn over afterwards with their own colors: first
+ * their alpha is cut out of the destination, then they are added.
+ * Glyphs in an atlas are composited one by one.
+ * Runs of different colors are drawn color by color, in the order of
+ * their first run.
+ */
+static void
+xcbft_draw_list_composite(xcb_connection_t *c, struct xcbft_draw_target *target,
+	struct xcbft_draw_list *list)
+{
+	static const uint8_t widths[] = { 1, 2, 4 };
+	static const xcb_render_color_t white = {
+		0xffff, 0xffff, 0xffff, 0xffff
+	};
+	unsigned int i, j, k;
+	xcb_render_picture_t picture, pen;
+	xcb_render_util_composite_text_stream_t *ts;
+	xcb_render_pictforminfo_t *a8;
+	int first;
+
+	picture = target->picture;
+	for (i = 0; i < list->length; i++) {
+		if (list->runs[i].drawn) {
+			continue;
+		}
+
+		pen = xcbft_draw_target_pen(c, target, list->runs[i].color);
+		for (k = 0; k < sizeof(widths); k++) {
+			first = -1;
+			for (j = i; j < list->length && first < 0; j++) {
+				if (xcbft_run_in_stream(list, i, j, widths[k])) {
+					first = j;
+				}
+			}
+			if (first < 0) {
+				continue;
+			}
+
+			ts = xcbft_draw_list_stream(list, first, widths[k],
+				XCBFT_PASS_TEXT);
+			if (ts != NULL) {
+				XCBFT_TRACE_BEGIN(request);
+				xcb_render_util_composite_text(
+					c, XCB_RENDER_PICT_OP_OVER,
+					pen, picture, 0,
+					0, 0,
+					ts);
+				XCBFT_TRACE_END("CompositeGlyphs", request);
+				xcbft_count(XCBFT_COUNT_COMPOSITE_REQUESTS, 1);
+				xcb_render_util_composite_text_free(ts);
+			}
+
+			ts = xcbft_draw_list_stream(list, first, widths[k],
+				XCBFT_PASS_COLOR);
+			if (ts != NULL) {
+				if (target->white_pen == 0) {
+					target->white_pen = xcbft_create_pen(c, white);
+				}
+				/* through an A8 mask only the alpha is used */
+				a8 = xcb_render_util_find_standard_format(
+					target->formats, XCB_PICT_STANDARD_A_8);
+				XCBFT_TRACE_BEGIN(request);
+				xcb_render_util_composite_text(
+					c, XCB_RENDER_PICT_OP_OUT_REVERSE,
+					target->white_pen, picture, a8->id,
+					0, 0,
+					ts);
+				xcb_render_util_composite_text(
+					c, XCB_RENDER_PICT_OP_ADD,
+					target->white_pen, picture, 0,
+					0, 0,
+					ts);
+				XCBFT_TRACE_END("CompositeGlyphs color", request);
+				xcbft_count(XCBFT_COUNT_COMPOSITE_REQUESTS, 2);
+				xcb_render_util_composite_text_free(ts);
+			}
+
+			for (j = first; j < list->length; j++) {
+				if (xcbft_run_in_stream(list, first, j, widths[k])) {
+					xcbft_draw_run_atlas(c, &list->runs[j], pen,
+						picture);
+					list->runs[j].drawn = 1;
+				}
+			}
+		}
+	}
+}
+
+/* draw every run of the list on the drawable and clear it */
+void
+xcbft_draw_list_render(xcb_connection_t *c, xcb_drawable_t drawable,
+	struct xcbft_draw_list *list, long dpi)
+{
+	struct xcbft_draw_target target;
+
+	if (list->length == 0) {
+		return;
+	}
+
+	/* upload whatever is missing first */
+	xcbft_draw_list_load(c, list, dpi, 0);
+	xcbft_draw_target_init(c, drawable, &target);
+	xcbft_draw_list_composite(c, &target, list);
+	xcbft_draw_target_done(c, &target);
+
+	xcbft_draw_list_clear(list);
+}
+
+/* a*b/255 rounded */
+static uint32_t
+xcbft_mul8(uint32_t a, uint32_t b)
+{
+	uint32_t t = a*b + 128;
+
+	return (t + (t >> 8)) >> 8;
+}
+
+/*
+ * Premultiplied src through a mask, per channel (b, g, r, a):
+ * dst = src*mask + dst*(1 - src alpha*mask)
+ */
+static uint32_t
+xcbft_blend_pixel(uint32_t dst, const uint8_t src[4], const uint8_t mask[4])
+{
+	uint32_t out, d;
 	int i;
-	double maximum_pix_size;
-	FcValue fc_pixel_size;
-	FcResult result;
 
-	maximum_pix_size = 0;
-	for (i = 0; i < patterns.length; i++) {
-		result = FcPatternGet(patterns.patterns[i], FC_PIXEL_SIZE, 0, &fc_pixel_size);
-		if (result != FcResultMatch || fc_pixel_size.u.d == 0) {
-			fprintf(stderr, "font has no pixel size, using 12 by default");
-			fc_pixel_size.type = FcTypeInteger;
-			fc_pixel_size.u.d = 12.0;
+	out = 0;
+	for (i = 0; i < 4; i++) {
+		d = (dst >> (8*i)) & 0xff;
+		d = xcbft_mul8(src[i], mask[i]) +
+			xcbft_mul8(d, 255 - xcbft_mul8(src[3], mask[i]));
+		out |= (d > 255 ? 255 : d) << (8*i);
+	}
+	return out;
+}
+
+#if defined(__SSE2__)
+/* xcbft_mul8 on 16 bits lanes */
+static inline __m128i
+xcbft_mul8_epi16(__m128i a, __m128i b)
+{
+	__m128i t;
+
+	t = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+/*
+ * xcbft_blend_pixel on 2 pixels, a channel per 16 bits lane, alpha
+ * being the alpha of src in every lane of its pixel
+ */
+static inline __m128i
+xcbft_blend_epi16(__m128i dst, __m128i src, __m128i mask, __m128i alpha)
+{
+	return _mm_add_epi16(xcbft_mul8_epi16(src, mask),
+		xcbft_mul8_epi16(dst, _mm_sub_epi16(_mm_set1_epi16(255),
+			xcbft_mul8_epi16(alpha, mask))));
+}
+
+/* blend 4 pixels of dst, the 4 channels of each given by src and mask */
+static inline void
+xcbft_blend_4(uint32_t *dst, __m128i src, __m128i mask, __m128i alpha_lo,
+	__m128i alpha_hi, int src_per_pixel)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i d, lo, hi, src_lo, src_hi;
+
+	d = _mm_loadu_si128((const __m128i *)dst);
+	src_lo = src_per_pixel ? _mm_unpacklo_epi8(src, zero) : src;
+	src_hi = src_per_pixel ? _mm_unpackhi_epi8(src, zero) : src;
+	lo = xcbft_blend_epi16(_mm_unpacklo_epi8(d, zero), src_lo,
+		_mm_unpacklo_epi8(mask, zero), alpha_lo);
+	hi = xcbft_blend_epi16(_mm_unpackhi_epi8(d, zero), src_hi,
+		_mm_unpackhi_epi8(mask, zero), alpha_hi);
+	/* saturates like the clamp of xcbft_blend_pixel */
+	_mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+}
+#endif
+
+/* a row of an A8 mask in the pen color */
+static void
+xcbft_blend_row_a8(uint32_t *dst, const uint8_t *mask, int length,
+	const uint8_t color[4])
+{
+	uint8_t channels[4];
+	int i = 0;
+#if defined(__SSE2__)
+	__m128i src, alpha, m;
+	uint32_t word;
+
+	/* the color on the 4 lanes of both pixels */
+	src = _mm_set_epi16(color[3], color[2], color[1], color[0],
+		color[3], color[2], color[1], color[0]);
+	alpha = _mm_set1_epi16(color[3]);
+	for (; i + 4 <= length; i += 4) {
+		memcpy(&word, mask + i, sizeof(word));
+		if (word == 0) {
+			continue;
 		}
-		if (fc_pixel_size.u.d > maximum_pix_size) {
-			maximum_pix_size = fc_pixel_size.u.d;
+		/* each coverage on the 4 channels of its pixel */
+		m = _mm_cvtsi32_si128((int)word);
+		m = _mm_unpacklo_epi8(m, m);
+		m = _mm_unpacklo_epi16(m, m);
+		xcbft_blend_4(dst + i, src, m, alpha, alpha, 0);
+	}
+#endif
+	for (; i < length; i++) {
+		if (mask[i] != 0) {
+			memset(channels, mask[i], 4);
+			dst[i] = xcbft_blend_pixel(dst[i], color, channels);
 		}
 	}
-
-	return maximum_pix_size;
 }
 
-struct xcbft_face_holder
-xcbft_load_faces(struct xcbft_patterns_holder patterns, long dpi)
+/* a row of an A1 mask, from its bit first, as A8 a chunk at a time */
+static void
+xcbft_blend_row_a1(uint32_t *dst, const uint8_t *bits, int first,
+	int length, const uint8_t color[4])
 {
-	int i;
-	struct xcbft_face_holder faces;
-	FcResult result;
-	FcValue fc_file, fc_index, fc_matrix, fc_pixel_size;
-	FT_Matrix ft_matrix;
-	FT_Error error;
-	FT_Library library;
+	uint8_t mask[64];
+	int i, j, count;
 
-	faces.length = 0;
-	error = FT_Init_FreeType(&library);
-	if (error != FT_Err_Ok) {
-		perror(NULL);
-		return faces;
+	for (i = 0; i < length; i += count) {
+		count = length - i < 64 ? length - i : 64;
+		for (j = 0; j < count; j++) {
+			mask[j] = bits[(first + i + j) >> 3] &
+				(0x80 >> ((first + i + j) & 7)) ? 0xff : 0;
+		}
+		xcbft_blend_row_a8(dst + i, mask, count, color);
 	}
+}
 
-	/* allocate the same size as patterns as it should be <= its length */
-	faces.faces = malloc(sizeof(FT_Face)*patterns.length);
+/* a row of subpixel coverage, a mask per channel, in the pen color */
+static void
+xcbft_blend_row_lcd(uint32_t *dst, const uint32_t *mask, int length,
+	const uint8_t color[4])
+{
+	uint8_t channels[4];
+	int i = 0;
+#if defined(__SSE2__)
+	__m128i src, alpha, m;
 
-	for (i = 0; i < patterns.length; i++) {
-		/* get the information needed from the pattern */
-		result = FcPatternGet(patterns.patterns[i], FC_FILE, 0, &fc_file);
-		if (result != FcResultMatch) {
-			fprintf(stderr, "font has not file location");
+	src = _mm_set_epi16(color[3], color[2], color[1], color[0],
+		color[3], color[2], color[1], color[0]);
+	alpha = _mm_set1_epi16(color[3]);
+	for (; i + 4 <= length; i += 4) {
+		m = _mm_loadu_si128((const __m128i *)(mask + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(m,
+				_mm_setzero_si128())) == 0xffff) {
 			continue;
 		}
-		result = FcPatternGet(patterns.patterns[i], FC_INDEX, 0, &fc_index);
-		if (result != FcResultMatch) {
-			fprintf(stderr, "font has no index, using 0 by default");
-			fc_index.type = FcTypeInteger;
-			fc_index.u.i = 0;
+		xcbft_blend_4(dst + i, src, m, alpha, alpha, 0);
+	}
+#endif
+	for (; i < length; i++) {
+		if (mask[i] != 0) {
+			channels[0] = mask[i];
+			channels[1] = mask[i] >> 8;
+			channels[2] = mask[i] >> 16;
+			channels[3] = mask[i] >> 24;
+			dst[i] = xcbft_blend_pixel(dst[i], color, channels);
 		}
-		/* TODO: load more info like */
-		/*	autohint */
-		/*	hinting */
-		/*	verticallayout */
+	}
+}
 
-		/* load the face */
-		error = FT_New_Face(
-				library,
-				(const char *) fc_file.u.s,
-				fc_index.u.i,
-				&(faces.faces[faces.length]) );
-		if (error == FT_Err_Unknown_File_Format) {
-			fprintf(stderr, "wrong file format");
-			continue;
-		} else if (error == FT_Err_Cannot_Open_Resource) {
-			fprintf(stderr, "could not open resource");
-			continue;
-		} else if (error) {
-			fprintf(stderr, "another sort of error");
+/* a row of a color glyph, premultiplied ARGB32 with its own colors */
+static void
+xcbft_blend_row_argb(uint32_t *dst, const uint32_t *argb, int length)
+{
+	static const uint8_t opaque[4] = { 0xff, 0xff, 0xff, 0xff };
+	uint8_t src[4];
+	int i = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i pixels, alpha_lo, alpha_hi;
+
+	for (; i + 4 <= length; i += 4) {
+		pixels = _mm_loadu_si128((const __m128i *)(argb + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(pixels, zero)) == 0xffff) {
 			continue;
 		}
-		if (faces.faces[faces.length] == NULL) {
-			fprintf(stderr, "face was empty");
-			continue;
+		/* the alpha of each pixel on its 4 lanes */
+		alpha_lo = _mm_unpacklo_epi8(pixels, zero);
+		alpha_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(alpha_lo,
+			_MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		alpha_hi = _mm_unpackhi_epi8(pixels, zero);
+		alpha_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(alpha_hi,
+			_MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		xcbft_blend_4(dst + i, pixels, _mm_set1_epi8((char)0xff),
+			alpha_lo, alpha_hi, 1);
+	}
+#endif
+	for (; i < length; i++) {
+		if (argb[i] != 0) {
+			src[0] = argb[i];
+			src[1] = argb[i] >> 8;
+			src[2] = argb[i] >> 16;
+			src[3] = argb[i] >> 24;
+			dst[i] = xcbft_blend_pixel(dst[i], src, opaque);
 		}
+	}
+}
 
-		result = FcPatternGet(patterns.patterns[i], FC_MATRIX, 0, &fc_matrix);
-		if (result == FcResultMatch) {
-			ft_matrix.xx = (FT_Fixed)(fc_matrix.u.m->xx * 0x10000L);
-			ft_matrix.xy = (FT_Fixed)(fc_matrix.u.m->xy * 0x10000L);
-			ft_matrix.yx = (FT_Fixed)(fc_matrix.u.m->yx * 0x10000L);
-			ft_matrix.yy = (FT_Fixed)(fc_matrix.u.m->yy * 0x10000L);
+/*
+ * Blend a glyph image at (x, y) of a width x height buffer, clipped
+ * once, then a row at a time by the kernel of its format
+ */
+static void
+xcbft_blend_glyph(uint32_t *pixels, int width, int height, int x, int y,
+	const struct xcbft_glyph_image *image, const uint8_t color[4])
+{
+	int gy, first, last;
+	const uint8_t *row;
+	uint32_t *dst;
 
-			/* apply the matrix */
-			FT_Set_Transform(
-				faces.faces[faces.length],
-				&ft_matrix,
-				NULL);
+	first = x < 0 ? -x : 0;
+	last = image->info.width;
+	if (x + last > width) {
+		last = width - x;
+	}
+	if (first >= last) {
+		return;
+	}
+	for (gy = y < 0 ? -y : 0; gy < image->info.height && y + gy < height;
+			gy++) {
+		row = image->data + gy*image->stride;
+		dst = pixels + (y + gy)*width + x + first;
+		switch (image->format) {
+		case XCBFT_FORMAT_A1:
+			xcbft_blend_row_a1(dst, row, first, last - first, color);
+			break;
+		case XCBFT_FORMAT_LCD:
+			xcbft_blend_row_lcd(dst, (const uint32_t *)row + first,
+				last - first, color);
+			break;
+		case XCBFT_FORMAT_COLOR:
+			xcbft_blend_row_argb(dst, (const uint32_t *)row + first,
+				last - first);
+			break;
+		default:
+			xcbft_blend_row_a8(dst, row + first, last - first, color);
+			break;
 		}
+	}
+}
 
-		result = FcPatternGet(patterns.patterns[i], FC_PIXEL_SIZE, 0, &fc_pixel_size);
-		if (result != FcResultMatch || fc_pixel_size.u.d == 0) {
-			fprintf(stderr, "font has no pixel size, using 12 by default");
-			fc_pixel_size.type = FcTypeInteger;
-			fc_pixel_size.u.d = 12;
-		}
-		/*error = FT_Set_Pixel_Sizes( */
-		/*	faces.faces[faces.length], */
-		/*	0, // width */
-		/*	fc_pixel_size.u.d); // height */
+/*
+ * Blend the glyphs of the list, their images loaded, into pixels of
+ * width x height whose first one is at (x0, y0) of the drawable
+ */
+static void
+xcbft_draw_list_blend(struct xcbft_draw_list *list, uint32_t *pixels,
+	int width, int height, int x0, int y0)
+{
+	struct xcbft_draw_run *run;
+	struct xcbft_glyph_entry *entry;
+	FT_Vector position;
+	uint8_t color[4];
+	unsigned int i, j;
 
-		/* pixel_size/ (dpi/72.0) */
-		FT_Set_Char_Size(
-			faces.faces[faces.length], 0,
-			(fc_pixel_size.u.d/((double)dpi/72.0))*64,
-			dpi, dpi);
-		if (error != FT_Err_Ok) {
-			perror(NULL);
-			fprintf(stderr, "could not char size");
-			continue;
+	XCBFT_TRACE_BEGIN(blending);
+	for (i = 0; i < list->length; i++) {
+		run = &list->runs[i];
+		/* premultiplied, in the order of the pixels */
+		color[0] = run->color.blue >> 8;
+		color[1] = run->color.green >> 8;
+		color[2] = run->color.red >> 8;
+		color[3] = run->color.alpha >> 8;
+		position.x = run->x;
+		position.y = run->y;
+		for (j = 0; j < run->text.length; j++) {
+			entry = xcbft_glyph_cache_find(run->faces.cache,
+				run->text.str[j]);
+			if (entry != NULL && entry->image != NULL) {
+				xcbft_blend_glyph(pixels, width, height,
+					position.x - entry->image->info.x - x0,
+					position.y - entry->image->info.y - y0,
+					entry->image, color);
+			}
+			position.x += run->advances[j].x;
+			position.y += run->advances[j].y;
 		}
-
-		faces.length++;
 	}
-
-	faces.library = library;
-
-	return faces;
+	XCBFT_TRACE_END("blend", blending);
 }
 
-FcStrSet*
-xcbft_extract_fontsearch_list(char *string)
+/*
+ * Draw the list blending the glyphs on the client into a copy of the
+ * area of the drawable covered by the text, read and written back
+ * through shared memory. However dense the text, that's one GetImage
+ * and one PutImage instead of the server compositing every glyph.
+ *
+ * Returns 0, having drawn nothing, when shared memory or the pixels
+ * of the drawable (32 bits, in the byte order of the client) can't be
+ * used
+ */
+static int
+xcbft_draw_list_render_shm(xcb_connection_t *c, xcb_drawable_t drawable,
+	struct xcbft_draw_list *list, long dpi)
 {
-	FcStrSet *fontsearch = NULL;
-	FcChar8 *fontquery;
-	FcBool result = FcFalse;
-	char *r = strdup(string);
-	char *p_to_r = r;
-	char *token = NULL;
-
-	fontsearch = FcStrSetCreate();
+	static const uint16_t byte_order = 1;
+	const xcb_setup_t *setup;
+	xcb_format_iterator_t formats;
+	xcb_get_geometry_reply_t *geometry;
+	xcb_shm_get_image_reply_t *image;
+	struct xcbft_draw_run *run;
+	struct xcbft_glyph_entry *entry;
+	xcb_gcontext_t gc;
+	FT_Vector position;
+	int bpp, x, y, x0, y0, x1, y1;
+	unsigned int i, j;
 
-	token = strtok(r, ",");
-	while (token != NULL) {
-		fontquery = (FcChar8*)token;
-		result = FcStrSetAdd(fontsearch, fontquery);
-		if (result == FcFalse) {
-			fprintf(stderr,
-				"Couldn't add fontquery to fontsearch set");
+	if (list->shm.state < 0) {
+		return 0;
+	}
+	setup = xcb_get_setup(c);
+	if (setup->image_byte_order != (*(const uint8_t *)&byte_order ?
+			XCB_IMAGE_ORDER_LSB_FIRST : XCB_IMAGE_ORDER_MSB_FIRST)) {
+		return 0;
+	}
+	geometry = xcb_get_geometry_reply(c,
+		xcb_get_geometry(c, drawable), NULL);
+	if (geometry == NULL) {
+		return 0;
+	}
+	bpp = 0;
+	for (formats = xcb_setup_pixmap_formats_iterator(setup);
+			formats.rem; xcb_format_next(&formats)) {
+		if (formats.data->depth == geometry->depth) {
+			bpp = formats.data->bits_per_pixel;
 		}
-		token = strtok(NULL, ",");
+	}
+	if (bpp != 32 || (geometry->depth != 24 && geometry->depth != 32)) {
+		free(geometry);
+		return 0;
 	}
 
-	free(p_to_r);
+	/* the glyphs, with their images this time */
+	xcbft_draw_list_load(c, list, dpi, 1);
 
-	return fontsearch;
-}
+	/* the area to read back, within the drawable */
+	x0 = geometry->width;
+	y0 = geometry->height;
+	x1 = y1 = 0;
+	for (i = 0; i < list->length; i++) {
+		run = &list->runs[i];
+		position.x = run->x;
+		position.y = run->y;
+		for (j = 0; j < run->text.length; j++) {
+			entry = xcbft_glyph_cache_find(run->faces.cache,
+				run->text.str[j]);
+			if (entry != NULL && entry->image != NULL) {
+				x = position.x - entry->image->info.x;
+				y = position.y - entry->image->info.y;
+				if (x < x0) x0 = x;
+				if (y < y0) y0 = y;
+				if (x + entry->image->info.width > x1)
+					x1 = x + entry->image->info.width;
+				if (y + entry->image->info.height > y1)
+					y1 = y + entry->image->info.height;
+			}
+			position.x += run->advances[j].x;
+			position.y += run->advances[j].y;
+		}
+	}
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > geometry->width) x1 = geometry->width;
+	if (y1 > geometry->height) y1 = geometry->height;
+	if (x0 >= x1 || y0 >= y1) {
+		free(geometry);
+		xcbft_draw_list_clear(list);
+		return 1;
+	}
 
+	if (!xcbft_shm_reserve(c, &list->shm, 4*(x1 - x0)*(y1 - y0))) {
+		free(geometry);
+		return 0;
+	}
+	XCBFT_TRACE_BEGIN(reading);
+	image = xcb_shm_get_image_reply(c,
+		xcb_shm_get_image(c, drawable, x0, y0, x1 - x0, y1 - y0,
+			~0, XCB_IMAGE_FORMAT_Z_PIXMAP, list->shm.seg, 0),
+		NULL);
+	XCBFT_TRACE_END("ShmGetImage", reading);
+	if (image == NULL) {
+		free(geometry);
+		return 0;
+	}
+	free(image);
 
+	xcbft_draw_list_blend(list, (uint32_t *)list->shm.addr,
+		x1 - x0, y1 - y0, x0, y0);
 
-void
-xcbft_patterns_holder_destroy(struct xcbft_patterns_holder patterns)
-{
-	int i = 0;
+	gc = xcb_generate_id(c);
+	xcb_create_gc(c, gc, drawable, 0, NULL);
+	XCBFT_TRACE_BEGIN(request);
+	xcb_shm_put_image(c, drawable, gc, x1 - x0, y1 - y0, 0, 0,
+		x1 - x0, y1 - y0, x0, y0, geometry->depth,
+		XCB_IMAGE_FORMAT_Z_PIXMAP, 0, list->shm.seg, 0);
+	XCBFT_TRACE_END("ShmPutImage", request);
+	xcb_free_gc(c, gc);
+	xcbft_flush(c);
 
-	for (; i < patterns.length; i++) {
-		FcPatternDestroy(patterns.patterns[i]);
-	}
-	free(patterns.patterns);
+	free(geometry);
+	xcbft_draw_list_clear(list);
+	return 1;
 }
 
-void
-xcbft_face_holder_destroy(struct xcbft_face_holder faces)
+/*
+ * Count the requests xcbft_draw_list_composite would send for the list,
+ * by color and glyph id width the same way, marking the runs drawn
+ */
+static void
+xcbft_draw_list_count(struct xcbft_draw_list *list)
 {
-	int i = 0;
+	static const uint8_t widths[] = { 1, 2, 4 };
+	unsigned int i, j, k, l, requests;
+	uint8_t text, color;
 
-	for (; i < faces.length; i++) {
-		FT_Done_Face(faces.faces[i]);
-	}
-	if (faces.faces) {
-		free(faces.faces);
+	for (i = 0; i < list->length; i++) {
+		if (list->runs[i].drawn) {
+			continue;
+		}
+		for (k = 0; k < sizeof(widths); k++) {
+			text = color = 0;
+			requests = 0;
+			for (j = i; j < list->length; j++) {
+				if (!xcbft_run_in_stream(list, i, j, widths[k])) {
+					continue;
+				}
+				for (l = 0; l < list->runs[j].text.length; l++) {
+					switch (list->runs[j].passes[l]) {
+					case XCBFT_PASS_TEXT:
+						text = 1;
+						break;
+					case XCBFT_PASS_COLOR:
+						color = 1;
+						break;
+					case XCBFT_PASS_ATLAS:
+						requests++;
+						break;
+					default:
+						break;
+					}
+				}
+				list->runs[j].drawn = 1;
+			}
+			/* cut out and added for the color glyphs */
+			xcbft_count(XCBFT_COUNT_COMPOSITE_REQUESTS,
+				requests + text + 2*color);
+		}
 	}
-	FT_Done_FreeType(faces.library);
 }
 
-xcb_render_picture_t
-xcbft_create_pen(xcb_connection_t *c, xcb_render_color_t color)
+/*
+ * Draw the list into an image in memory, without an X server. The glyphs
+ * are rasterized and blended on the client as by the shm backend, and
+ * the requests the Render backend would have sent (AddGlyphs, composites)
+ * are counted in xcbft_stats as if they had been: the counters are for
+ * the whole process, take the difference from before the call for this
+ * render alone.
+ *
+ * The glyphs rasterized here are cached with the faces but aren't on any
+ * server, the first load of them on a connection sends them.
+ */
+void
+xcbft_draw_list_render_image(struct xcbft_draw_list *list,
+	struct xcbft_image *image, long dpi)
 {
-	const xcb_render_query_pict_formats_reply_t *fmt_rep = xcb_render_util_query_formats(c);
-	/* alpha can only be used with a picture containing a pixmap */
-	xcb_render_pictforminfo_t *fmt = xcb_render_util_find_standard_format(
-		fmt_rep,
-		XCB_PICT_STANDARD_ARGB_32
-	);
+	if (list->length == 0) {
+		return;
+	}
 
-	xcb_drawable_t root = xcb_setup_roots_iterator(
-			xcb_get_setup(c)
-		).data->root;
+	xcbft_draw_list_load(NULL, list, dpi, 1);
+	xcbft_draw_list_count(list);
+	xcbft_draw_list_blend(list, image->pixels, image->width, image->height,
+		0, 0);
 
-	xcb_pixmap_t pm = xcb_generate_id(c);
-    xcb_rectangle_t rect = {0, 0, 1, 1};
-	xcb_render_picture_t picture = xcb_generate_id(c);
+	xcbft_draw_list_clear(list);
+}
 
-	uint32_t values[1];
-	values[0] = XCB_RENDER_REPEAT_NORMAL;
+/*
+ * Draw the list with the backend of choice, the shm backend falls back
+ * to Render when shared memory isn't usable (remote display, unusual
+ * visual)
+ */
+void
+xcbft_draw_list_render_backend(xcb_connection_t *c, xcb_drawable_t drawable,
+	struct xcbft_draw_list *list, long dpi, enum xcbft_backend backend)
+{
+	if (backend == XCBFT_BACKEND_SHM &&
+			xcbft_draw_list_render_shm(c, drawable, list, dpi)) {
+		return;
+	}
+	xcbft_draw_list_render(c, drawable, list, dpi);
+}
 
-	xcb_create_pixmap(c, 32, pm, root, 1, 1);
-	xcb_render_create_picture(c,
-		picture,
-		pm,
-		fmt->id,
-		XCB_RENDER_CP_REPEAT,
-		values);
+/*
+ * Draw text at (x, y) on a window or pixmap
+ *
+ * Returns the advance of the text
+ */
+FT_Vector
+xcbft_draw_text(
+	xcb_connection_t *c, // conn
+	xcb_drawable_t pmap, // win or pixmap
+	int16_t x, int16_t y, // x, y
+	struct utf_holder text, // text
+	xcb_render_color_t color,
+	struct xcbft_face_holder faces,
+	long dpi)
+{
+	struct xcbft_draw_list list = {0};
+	FT_Vector advance;
 
-	xcb_render_fill_rectangles(c,
-		XCB_RENDER_PICT_OP_OVER,
-		picture,
-		color, 1, &rect);
+	xcbft_draw_list_add(&list, x, y, text, color, faces);
+	xcbft_draw_list_render(c, pmap, &list, dpi);
+	advance = list.runs[0].advance;
+	free(list.runs);
 
-	xcb_free_pixmap(c, pm);
-	return picture;
+	return advance;
 }
 
-struct xcbft_glyphset_and_advance
-xcbft_load_glyphset(
-	xcb_connection_t *c,
-	struct xcbft_face_holder faces,
-	struct utf_holder text,
-	long dpi)
+/*
+ * Draw length bytes of UTF-8 at (x, y) on a window or pixmap.
+ *
+ * The text is decoded and drawn a chunk at a time from buffers on the
+ * stack, the picture and the pen are made once for all the chunks. Only
+ * the request of each chunk is allocated (by xcb-renderutil) when its
+ * glyphs are already loaded.
+ *
+ * Returns the advance of the text
+ */
+FT_Vector
+xcbft_draw_utf8(xcb_connection_t *c, xcb_drawable_t drawable,
+	int16_t x, int16_t y, const char *bytes, size_t length,
+	xcb_render_color_t color, struct xcbft_face_holder faces, long dpi)
 {
-	unsigned int i, j;
-	int glyph_index;
-	xcb_render_glyphset_t gs;
-	xcb_render_pictforminfo_t *fmt_a8;
-	struct xcbft_face_holder faces_for_unsupported;
-	const xcb_render_query_pict_formats_reply_t *fmt_rep =
-		xcb_render_util_query_formats(c);
-	FT_Vector total_advance, glyph_advance;
+	FcChar32 chars[XCBFT_UTF8_CHUNK];
+	uint32_t gids[XCBFT_UTF8_CHUNK];
+	xcb_render_glyphset_t glyphsets[XCBFT_UTF8_CHUNK];
+	FT_Vector advances[XCBFT_UTF8_CHUNK];
+	uint8_t passes[XCBFT_UTF8_CHUNK];
 	struct xcbft_glyphset_and_advance glyphset_advance;
+	struct xcbft_draw_list list = {0};
+	struct xcbft_draw_run run = {0};
+	struct xcbft_draw_target target;
+	struct utf_decoder decoder;
+	FT_Vector total;
 
-	total_advance.x = total_advance.y = 0;
-	glyph_index = 0;
-	faces_for_unsupported.length = 0;
-	/* create a glyphset with a specific format */
-	fmt_a8 = xcb_render_util_find_standard_format(
-		fmt_rep,
-		XCB_PICT_STANDARD_A_8
-	);
-	gs = xcb_generate_id(c);
-	xcb_render_create_glyph_set(c, gs, fmt_a8->id);
-
-	for (i = 0; i < text.length; i++) {
-		for (j = 0; j < faces.length; j++) {
-			glyph_index = FT_Get_Char_Index(
-				faces.faces[j],
-				text.str[i]);
-			if (glyph_index != 0) break;
-		}
-		/* here use face at index j */
-		if (glyph_index != 0) {
-			glyph_advance = xcbft_load_glyph(c, gs, faces.faces[j], text.str[i]);
-			total_advance.x += glyph_advance.x;
-			total_advance.y += glyph_advance.y;
-		} else {
-			/* fallback */
-			/* TODO pass at least some of the query (font size, italic, etc..) */
-
-			glyph_index = 0;
-			/* check if we already loaded that face as fallback */
-			if (faces_for_unsupported.length > 0) {
-				glyph_index = FT_Get_Char_Index(
-					faces_for_unsupported.faces[0],
-					text.str[i]);
-			}
-			if (glyph_index == 0) {
-				if (faces_for_unsupported.length > 0) {
-					xcbft_face_holder_destroy(faces_for_unsupported);
-				}
-				faces_for_unsupported = xcbft_query_by_char_support(
-					text.str[i],
-					NULL, dpi);
-			}
-			if (faces_for_unsupported.length == 0) {
-				fprintf(stderr,
-					"No faces found supporting character: %02x\n",
-					text.str[i]);
-				/* draw a block using whatever font */
-				glyph_advance = xcbft_load_glyph(c, gs, faces.faces[0], text.str[i]);
-				total_advance.x += glyph_advance.x;
-				total_advance.y += glyph_advance.y;
-			} else {
-				FT_Set_Char_Size(
-						faces_for_unsupported.faces[0],
-						0, (faces.faces[0]->size->metrics.x_ppem/((double)dpi/72.0))*64,
-						dpi, dpi);
+	total.x = total.y = 0;
+	utf_decoder_init(&decoder);
+	target.picture = 0;
+	run.text.str = chars;
+	run.color = color;
+	run.faces = faces;
+	run.gids = gids;
+	run.glyphsets = glyphsets;
+	run.advances = advances;
+	run.passes = passes;
+	list.runs = &run;
+	list.length = 1;
 
-				glyph_advance = xcbft_load_glyph(c, gs,
-					faces_for_unsupported.faces[0],
-					text.str[i]);
-				total_advance.x += glyph_advance.x;
-				total_advance.y += glyph_advance.y;
-			}
+	while ((run.text.length = xcbft_utf8_chunk(&decoder, &bytes, &length,
+			chars)) > 0) {
+		run.x = x + total.x;
+		run.y = y + total.y;
+		run.drawn = 0;
+		faces.cache->clock++;
+		glyphset_advance = xcbft_load_glyphset_tick(c, faces, run.text,
+			dpi);
+		xcbft_run_fill_glyph_ids(c, &run, glyphset_advance.glyphset);
+		if (target.picture == 0) {
+			xcbft_draw_target_init(c, drawable, &target);
 		}
+		xcbft_draw_list_composite(c, &target, &list);
+		total.x += glyphset_advance.advance.x;
+		total.y += glyphset_advance.advance.y;
 	}
-	if (faces_for_unsupported.length > 0) {
-		xcbft_face_holder_destroy(faces_for_unsupported);
+	if (target.picture != 0) {
+		xcbft_draw_target_done(c, &target);
 	}
 
-	glyphset_advance.advance = total_advance;
-	glyphset_advance.glyphset = gs;
-	return glyphset_advance;
+	return total;
 }
 
-FT_Vector
-xcbft_load_glyph(
-	xcb_connection_t *c, xcb_render_glyphset_t gs, FT_Face face, int charcode)
+/*
+ * What the library did since the process started, all threads summed:
+ * each thread counts on its own and they are only added up here.
+ */
+struct xcbft_stats
+xcbft_stats(void)
 {
-	uint32_t gid;
-	int glyph_index, stride, y;
-    uint8_t *tmpbitmap;
-	FT_Vector glyph_advance;
-	xcb_render_glyphinfo_t ginfo;
-	FT_Bitmap *bitmap;
+	uint64_t values[XCBFT_COUNTERS];
+	struct xcbft_counters *counters;
+	struct xcbft_stats stats;
+	unsigned int i;
 
-	FT_Select_Charmap(face, ft_encoding_unicode);
-	glyph_index = FT_Get_Char_Index(face, charcode);
+	pthread_mutex_lock(&xcbft_counters_lock);
+	memcpy(values, xcbft_counters_exited, sizeof(values));
+	for (counters = xcbft_counters_threads; counters != NULL;
+			counters = counters->next) {
+		for (i = 0; i < XCBFT_COUNTERS; i++) {
+			values[i] += atomic_load_explicit(&counters->values[i],
+				memory_order_relaxed);
+		}
+	}
+	pthread_mutex_unlock(&xcbft_counters_lock);
 
-	FT_Load_Glyph(face, glyph_index, FT_LOAD_RENDER | FT_LOAD_FORCE_AUTOHINT);
+	stats.fc_matches = values[XCBFT_COUNT_FC_MATCHES];
+	stats.faces_opened = values[XCBFT_COUNT_FACES_OPENED];
+	stats.glyphs_rasterized = values[XCBFT_COUNT_GLYPHS_RASTERIZED];
+	stats.cache_hits = values[XCBFT_COUNT_CACHE_HITS];
+	stats.cache_misses = values[XCBFT_COUNT_CACHE_MISSES];
+	stats.add_glyphs_requests = values[XCBFT_COUNT_ADD_GLYPHS_REQUESTS];
+	stats.add_glyphs_bytes = values[XCBFT_COUNT_ADD_GLYPHS_BYTES];
+	stats.composite_requests = values[XCBFT_COUNT_COMPOSITE_REQUESTS];
+	stats.fallback_lookups = values[XCBFT_COUNT_FALLBACK_LOOKUPS];
+	return stats;
+}
 
-	bitmap = &face->glyph->bitmap;
+/*
+ * Bytes held by the faces. The FreeType memory of the faces is shared
+ * with their views, plus the copies made by the measuring threads.
+ */
+struct xcbft_memory
+xcbft_memory(struct xcbft_face_holder faces)
+{
+	struct xcbft_glyph_cache *cache = faces.cache;
+	struct xcbft_thread_faces *thread;
+	struct xcbft_memory memory;
 
-	ginfo.x = -face->glyph->bitmap_left;
-	ginfo.y = face->glyph->bitmap_top;
-	ginfo.width = bitmap->width;
-	ginfo.height = bitmap->rows;
-	glyph_advance.x = face->glyph->advance.x/64;
-	glyph_advance.y = face->glyph->advance.y/64;
-	ginfo.x_off = glyph_advance.x;
-	ginfo.y_off = glyph_advance.y;
+	memory.faces = atomic_load(&cache->ft_memory->bytes);
+	pthread_mutex_lock(&cache->metrics->threads_lock);
+	for (thread = cache->metrics->threads; thread != NULL;
+			thread = thread->next) {
+		if (thread->faces.cache != NULL) {
+			memory.faces += atomic_load(
+				&thread->faces.cache->ft_memory->bytes);
+		}
+	}
+	pthread_mutex_unlock(&cache->metrics->threads_lock);
+	memory.glyphs = atomic_load(&cache->client_bytes) +
+		atomic_load(&cache->raster->bytes);
+	memory.metrics = atomic_load(&cache->metrics->bytes) +
+		atomic_load(&cache->runs->bytes);
+	memory.server = xcbft_glyph_memory(faces);
+	return memory;
+}
 
-    /*
-	 * keep track of the max horiBearingY (yMax) and yMin
-	 * 26.6 fractional pixel format
-	 * yMax = face->glyph->metrics.horiBearingY/64; (yMax);
-	 * yMin = -(face->glyph->metrics.height -
-	 *		face->glyph->metrics.horiBearingY)/64;
-     */
+/* bytes held by all the faces of the process, fallback fonts included */
+struct xcbft_memory
+xcbft_memory_total(void)
+{
+	enum xcbft_glyph_format format;
+	struct xcbft_glyph_cache *cache;
+	struct xcbft_memory memory;
+	size_t client;
+
+	memory.metrics = memory.server = 0;
+	pthread_mutex_lock(&xcbft_caches_lock);
+	client = atomic_load(&xcbft_cache_bytes);
+	for (cache = xcbft_caches; cache != NULL; cache = cache->next) {
+		memory.metrics += atomic_load(&cache->metrics->bytes) +
+			atomic_load(&cache->runs->bytes);
+		for (format = 0; format < XCBFT_FORMATS; format++) {
+			memory.server += atomic_load(&cache->glyphsets[format].bytes);
+		}
+		memory.server += atomic_load(&cache->atlas_bytes);
+	}
+	pthread_mutex_unlock(&xcbft_caches_lock);
+	memory.faces = atomic_load(&xcbft_ft_bytes);
+	/* the rest of the client caches, the counters move meanwhile */
+	memory.glyphs = client > memory.metrics ? client - memory.metrics : 0;
+	return memory;
+}
+
+/*
+ * Keep the client caches of all the face holders (glyph images, glyphs
+ * kept for the views, advances, runs) under that many bytes, 0 for no
+ * limit. When over it, they are emptied down to 3/4 of it, the runs
+ * first and the images last. The faces and the server memory aren't
+ * part of it, see xcbft_glyph_budget for the latter.
+ */
+void
+xcbft_memory_budget(size_t bytes)
+{
+	atomic_store(&xcbft_cache_budget, bytes);
+	xcbft_memory_check();
+}
 
-	gid = charcode;
+/*
+ * Write the scopes timed since the start, or the last xcbft_trace_clear,
+ * to path as Chrome trace events (chrome://tracing, Perfetto). Only when
+ * built with XCBFT_TRACE defined.
+ *
+ * Returns 1 on success, 0 otherwise
+ */
+int
+xcbft_trace_dump(const char *path)
+{
+#ifdef XCBFT_TRACE
+	struct xcbft_trace_buffer *buffer;
+	struct xcbft_trace_event *event;
+	const char *separator = "";
+	unsigned int i;
+	FILE *file;
+	int pid = getpid();
 
-	stride = (ginfo.width+3)&~3;
-	tmpbitmap = calloc(sizeof(uint8_t),stride*ginfo.height);
+	file = fopen(path, "w");
+	if (file == NULL) {
+		fprintf(stderr, "couldn't open %s for the trace\n", path);
+		return 0;
+	}
 
-	for (y = 0; y < ginfo.height; y++)
-		memcpy(tmpbitmap+y*stride, bitmap->buffer+y*ginfo.width, ginfo.width);
+	fputs("{\"traceEvents\":[", file);
+	pthread_mutex_lock(&xcbft_trace_lock);
+	for (buffer = xcbft_trace_buffers; buffer != NULL;
+			buffer = buffer->next) {
+		pthread_mutex_lock(&buffer->lock);
+		for (i = 0; i < buffer->length; i++) {
+			event = &buffer->events[i];
+			/* complete events, in microseconds */
+			fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"xcbft\","
+				"\"ph\":\"X\",\"ts\":%llu.%03u,\"dur\":%llu.%03u,"
+				"\"pid\":%d,\"tid\":%u}",
+				separator, event->name,
+				(unsigned long long)(event->start/1000),
+				(unsigned int)(event->start%1000),
+				(unsigned long long)(event->duration/1000),
+				(unsigned int)(event->duration%1000),
+				pid, buffer->tid);
+			separator = ",";
+		}
+		pthread_mutex_unlock(&buffer->lock);
+	}
+	pthread_mutex_unlock(&xcbft_trace_lock);
+	fputs("\n]}\n", file);
 
-	xcb_render_add_glyphs_checked(c,
-		gs, 1, &gid, &ginfo, stride*ginfo.height, tmpbitmap);
+	if (fclose(file) != 0) {
+		fprintf(stderr, "couldn't write the trace to %s\n", path);
+		return 0;
+	}
+	return 1;
+#else
+	(void)path;
+	return 0;
+#endif
+}
 
-	free(tmpbitmap);
+/* forget the scopes timed so far */
+void
+xcbft_trace_clear(void)
+{
+#ifdef XCBFT_TRACE
+	struct xcbft_trace_buffer *buffer, **link;
 
-	xcb_flush(c);
-	return glyph_advance;
+	pthread_mutex_lock(&xcbft_trace_lock);
+	for (link = &xcbft_trace_buffers; (buffer = *link) != NULL;) {
+		pthread_mutex_lock(&buffer->lock);
+		buffer->length = 0;
+		if (buffer->exited) {
+			*link = buffer->next;
+			pthread_mutex_unlock(&buffer->lock);
+			pthread_mutex_destroy(&buffer->lock);
+			free(buffer->events);
+			free(buffer);
+			continue;
+		}
+		pthread_mutex_unlock(&buffer->lock);
+		link = &buffer->next;
+	}
+	pthread_mutex_unlock(&xcbft_trace_lock);
+#endif
 }
@@ -6,10 +6,102 @@ struct xcbft_patterns_holder {
 	uint8_t length;
 };
 
+struct xcbft_glyph_cache;
+struct xcbft_prewarm;
+struct xcbft_async_query;
+struct xcbft_draw_list;
+
 struct xcbft_face_holder {
 	FT_Face *faces;
 	uint8_t length;
 	FT_Library library;
+	/* the pattern each face was loaded from, same order as faces */
+	FcPattern **patterns;
+	/* glyphs already uploaded for this set of faces */
+	struct xcbft_glyph_cache *cache;
+};
+
+/* how a draw list is put on the drawable */
+enum xcbft_backend {
+	/* glyphs composited by the server (Render) */
+	XCBFT_BACKEND_RENDER,
+	/* glyphs blended on the client, sent through MIT-SHM */
+	XCBFT_BACKEND_SHM
+};
+
+/*
+ * Pixels for xcbft_draw_list_render_image, premultiplied ARGB32 in the
+ * byte order of the client, rows of width pixels one after the other
+ */
+struct xcbft_image {
+	uint32_t *pixels;
+	uint16_t width;
+	uint16_t height;
+};
+
+/* face index of the characters none of the faces has */
+#define XCBFT_FACE_FALLBACK 0xff
+
+/* script of a run, common characters take the one of their run */
+enum xcbft_script {
+	XCBFT_SCRIPT_COMMON,
+	XCBFT_SCRIPT_INHERITED,
+	XCBFT_SCRIPT_UNKNOWN,
+	XCBFT_SCRIPT_LATIN,
+	XCBFT_SCRIPT_GREEK,
+	XCBFT_SCRIPT_CYRILLIC,
+	XCBFT_SCRIPT_ARMENIAN,
+	XCBFT_SCRIPT_HEBREW,
+	XCBFT_SCRIPT_ARABIC,
+	XCBFT_SCRIPT_DEVANAGARI,
+	XCBFT_SCRIPT_BENGALI,
+	XCBFT_SCRIPT_TAMIL,
+	XCBFT_SCRIPT_THAI,
+	XCBFT_SCRIPT_TIBETAN,
+	XCBFT_SCRIPT_GEORGIAN,
+	XCBFT_SCRIPT_HANGUL,
+	XCBFT_SCRIPT_HIRAGANA,
+	XCBFT_SCRIPT_KATAKANA,
+	XCBFT_SCRIPT_HAN
+};
+
+/* characters of a text drawn with the same face, all of one script */
+struct xcbft_font_run {
+	uint32_t start;
+	uint32_t length;
+	/* index in the face holder or XCBFT_FACE_FALLBACK */
+	uint8_t face;
+	/* enum xcbft_script */
+	uint8_t script;
+};
+
+/* counters of xcbft_stats, since the start of the process */
+struct xcbft_stats {
+	/* fontconfig matches, fallback lookups included */
+	uint64_t fc_matches;
+	uint64_t faces_opened;
+	uint64_t glyphs_rasterized;
+	/* characters of loaded text already in the glyph cache, or not */
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t add_glyphs_requests;
+	uint64_t add_glyphs_bytes;
+	/* CompositeGlyphs and Composite requests */
+	uint64_t composite_requests;
+	/* fonts searched for characters none of the faces has */
+	uint64_t fallback_lookups;
+};
+
+/* bytes held, by xcbft_memory and xcbft_memory_total */
+struct xcbft_memory {
+	/* FreeType faces, sizes and glyph slots */
+	size_t faces;
+	/* glyph cache entries and images, glyphs kept for the views */
+	size_t glyphs;
+	/* advances and runs of the measured and drawn texts */
+	size_t metrics;
+	/* glyphsets and atlas on the X server */
+	size_t server;
 };
 
 struct xcbft_glyphset_and_advance {
@@ -19,6 +111,7 @@ struct xcbft_glyphset_and_advance {
 
 int xcbft_init(void);
 void xcbft_done(void);
+int xcbft_load_xrm_settings(xcb_connection_t *);
 FcPattern* xcbft_query_fontsearch(FcChar8 *);
 struct xcbft_face_holder xcbft_query_by_char_support(
 		FcChar32, const FcPattern *, long);
@@ -29,11 +122,65 @@ struct xcbft_face_holder xcbft_load_faces(
 FcStrSet* xcbft_extract_fontsearch_list(char *);
 void xcbft_patterns_holder_destroy(struct xcbft_patterns_holder);
 void xcbft_face_holder_destroy(struct xcbft_face_holder);
+struct xcbft_face_holder xcbft_face_holder_view(struct xcbft_face_holder,
+	long);
+int xcbft_rescan(unsigned int *);
+int xcbft_face_holder_refresh(struct xcbft_face_holder, long);
 xcb_render_picture_t xcbft_create_pen(xcb_connection_t*,
 		xcb_render_color_t);
 struct xcbft_glyphset_and_advance xcbft_load_glyphset(xcb_connection_t *,
 	struct xcbft_face_holder, struct utf_holder, long);
 FT_Vector xcbft_load_glyph(xcb_connection_t *, xcb_render_glyphset_t,
 	FT_Face, int);
+struct xcbft_font_run* xcbft_itemize(struct xcbft_face_holder,
+	struct utf_holder, unsigned int *);
+FT_Vector xcbft_measure_text(struct xcbft_face_holder, struct utf_holder,
+	long);
+FT_Vector xcbft_draw_text(xcb_connection_t*, xcb_drawable_t,
+	int16_t, int16_t, struct utf_holder, xcb_render_color_t,
+	struct xcbft_face_holder, long);
+FT_Vector xcbft_measure_utf8(struct xcbft_face_holder, const char *, size_t,
+	long);
+FT_Vector xcbft_draw_utf8(xcb_connection_t*, xcb_drawable_t,
+	int16_t, int16_t, const char *, size_t, xcb_render_color_t,
+	struct xcbft_face_holder, long);
+struct xcbft_draw_list* xcbft_draw_list_create(void);
+void xcbft_draw_list_add(struct xcbft_draw_list *, int, int,
+	struct utf_holder, xcb_render_color_t, struct xcbft_face_holder);
+void xcbft_draw_list_render(xcb_connection_t *, xcb_drawable_t,
+	struct xcbft_draw_list *, long);
+void xcbft_draw_list_render_backend(xcb_connection_t *, xcb_drawable_t,
+	struct xcbft_draw_list *, long, enum xcbft_backend);
+void xcbft_draw_list_render_image(struct xcbft_draw_list *,
+	struct xcbft_image *, long);
+void xcbft_draw_list_clear(struct xcbft_draw_list *);
+void xcbft_draw_list_destroy(struct xcbft_draw_list *);
+void xcbft_charset_add_range(FcCharSet *, FcChar32, FcChar32);
+void xcbft_charset_add_text(FcCharSet *, struct utf_holder);
+struct xcbft_prewarm* xcbft_prewarm_start(struct xcbft_face_holder,
+	const FcCharSet *, long);
+int xcbft_prewarm_upload(xcb_connection_t *, struct xcbft_prewarm *);
+void xcbft_prewarm_destroy(struct xcbft_prewarm *);
+int xcbft_raster_pool_start(struct xcbft_face_holder, unsigned int, long);
+int xcbft_atlas_start(struct xcbft_face_holder, uint16_t, uint16_t);
+int xcbft_atlas_repack(xcb_connection_t *, struct xcbft_face_holder);
+void xcbft_glyph_budget(struct xcbft_face_holder, size_t);
+size_t xcbft_glyph_memory(struct xcbft_face_holder);
+struct xcbft_memory xcbft_memory(struct xcbft_face_holder);
+struct xcbft_memory xcbft_memory_total(void);
+void xcbft_memory_budget(size_t);
+int xcbft_share_publish(xcb_connection_t *, struct xcbft_face_holder);
+int xcbft_share_attach(xcb_connection_t *, struct xcbft_face_holder);
+struct xcbft_stats xcbft_stats(void);
+int xcbft_trace_dump(const char *);
+void xcbft_trace_clear(void);
+struct xcbft_async_query* xcbft_query_fontsearch_async(FcStrSet *, long);
+struct xcbft_async_query* xcbft_query_by_char_support_async(
+	FcChar32, const FcPattern *, long);
+int xcbft_async_query_fd(struct xcbft_async_query *);
+int xcbft_async_query_done(struct xcbft_async_query *);
+struct xcbft_face_holder xcbft_async_query_finish(struct xcbft_async_query *);
+void xcbft_async_query_cancel(struct xcbft_async_query *);
+int xcbft_fallback_fd(struct xcbft_face_holder);
 
 #endif